@@ -7,6 +7,7 @@
 #include "app_menu.h"
 #include "config_storage.h"
 #include "keychain_container.h"
+#include "totp_clock.h"
 
 class MainWindow : public Gtk::ApplicationWindow {
 public:
@@ -15,7 +16,12 @@ public:
             {"_Lock Vaults", [this]() { lockVaults(); }},
             {"_Load New Vault", [this]() { addNewVault(); }},
             {"_Refresh Vaults", [this]() { refreshVaults(); }},
-            {"_Quit", [this]() { get_application()->quit(); }}};
+            {"_Quit",
+             [this]() {
+                 // Locking saves each vault's snapshot for the next launch.
+                 lockVaults();
+                 get_application()->quit();
+             }}};
 
         set_default_geometry(800, 480);
 
@@ -27,6 +33,20 @@ public:
         header_bar.set_show_close_button(false);
         header_bar.pack_start(*app_menu);
 
+        // Opt-in: setting session_key_timeout in the cache file to a number of seconds keeps
+        // decrypted master keys in the session keyring for that long, so relaunching doesn't
+        // have to derive them again.
+        auto key_timeout = config_cache.find("session_key_timeout");
+        if (key_timeout != config_cache.end() && key_timeout->is_number_unsigned() &&
+            *key_timeout > 0 && SessionKeyCache::available()) {
+            key_cache = std::make_shared<SessionKeyCache>(key_timeout->get<unsigned int>());
+        }
+        // Setting load_mode to "eager" decrypts every item, across all cores, while a vault
+        // unlocks. By default only the list is loaded and each item is decrypted when it's opened.
+        auto mode = config_cache.find("load_mode");
+        if (mode != config_cache.end() && mode->is_string() && *mode == "eager")
+            load_mode = Keychain::LoadMode::Eager;
+
         if (config_cache.find("loaded_vaults") != config_cache.end()) {
             auto loaded_vaults = config_cache["loaded_vaults"];
             for (auto it = loaded_vaults.begin(); it != loaded_vaults.end(); ++it) {
@@ -44,9 +64,19 @@ public:
     virtual ~MainWindow(){};
 
 protected:
+    // A hidden window unmaps its item views, which takes their codes off the clock, but an
+    // iconified one stays mapped, so stop the clock outright for that.
+    bool on_window_state_event(GdkEventWindowState* event) override {
+        TOTPClock::get().setPaused(
+            event->new_window_state & (GDK_WINDOW_STATE_ICONIFIED | GDK_WINDOW_STATE_WITHDRAWN));
+        return Gtk::ApplicationWindow::on_window_state_event(event);
+    }
+
     void addNewVault() {
         remove();
         auto new_vault = std::make_shared<KeychainContainer>("");
+        new_vault->setKeyCache(key_cache);
+        new_vault->setLoadMode(load_mode);
         auto unlock_cb = [new_vault, this](std::string title, std::string password) {
             unlockCb(new_vault, title, password);
         };
@@ -85,6 +115,8 @@ protected:
 
     void addCachedVault(std::string path, bool master) {
         auto new_vault = std::make_shared<KeychainContainer>(path);
+        new_vault->setKeyCache(key_cache);
+        new_vault->setLoadMode(load_mode);
         auto unlock_cb = [new_vault, this](std::string title, std::string password) {
             unlockCb(new_vault, title, password);
         };
@@ -126,6 +158,9 @@ protected:
             return;
         } else if (path == config_cache["master_vault"])
             return;
+        // Without a key there's nothing to protect the other vaults' passwords with.
+        if (master_vault->getKeychain()->readOnly())
+            return;
 
         json cached_data_dict;
         if (config_cache.find("loaded_vaults") != config_cache.end()) {
@@ -147,6 +182,9 @@ protected:
         if (config_cache.find("loaded_vaults") == config_cache.end()) {
             return;
         }
+        // Passwords are only cached under a master vault with a key; see updateCache.
+        if (master_vault->getKeychain()->readOnly())
+            return;
         auto cached_vaults = config_cache["loaded_vaults"];
 
         for (auto vault : container_list) {
@@ -165,6 +203,8 @@ protected:
     }
 
     ConfigCache config_cache;
+    std::shared_ptr<const SessionKeyCache> key_cache;
+    Keychain::LoadMode load_mode = Keychain::LoadMode::Lazy;
     std::shared_ptr<KeychainContainer> master_vault;
     std::unique_ptr<AppMenu> app_menu;
     std::set<std::shared_ptr<KeychainContainer>> container_list;
@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+#include "base64.h"
+
+// The vector codecs are compiled with per-function target attributes, so the rest of the build
+// doesn't need -mavx2 and the scalar code still runs on older CPUs.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BASE64_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace {
+const char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Kernels decode whole blocks from the start of src for as long as every character in the
+// block is in the alphabet, and return how many characters they used. dst is advanced past the
+// bytes written, but a kernel may store up to 8 bytes of garbage beyond that.
+using DecodeKernel = size_t (*)(const char* src, size_t size, uint8_t*& dst);
+// Encode kernels turn groups of 3 bytes into 4 characters and return how many bytes they used.
+// They read up to 4 bytes past the last group they use, but never past size.
+using EncodeKernel = size_t (*)(const uint8_t* src, size_t size, char* dst);
+
+const size_t kDecodeSlack = 8;
+
+#ifdef BASE64_X86_KERNELS
+// After Muła and Lemire, "Faster Base64 Encoding and Decoding using AVX2 Instructions".
+// Characters are validated and translated with two nibble lookups, then packed 4 to 3. The
+// single block helpers are always inlined, so that the AVX2 kernels' tails are VEX encoded too
+// rather than paying for a switch back to legacy SSE.
+#define BASE64_INLINE __attribute__((always_inline)) inline
+
+// Decodes 16 characters into 12 bytes (storing 16), or returns false if any of them isn't in
+// the alphabet.
+__attribute__((target("sse4.1"))) BASE64_INLINE bool decodeBlock(const char* src, uint8_t* dst) {
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll =
+        _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i pack_shuffle =
+        _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m128i nibble_mask = _mm_set1_epi8(0x0f);
+
+    const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(input, 4), nibble_mask);
+    const __m128i lo_nibbles = _mm_and_si128(input, nibble_mask);
+    const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    if (!_mm_testz_si128(lo, hi))
+        return false;
+
+    const __m128i eq_slash = _mm_cmpeq_epi8(input, _mm_set1_epi8('/'));
+    const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_slash, hi_nibbles));
+    const __m128i values = _mm_add_epi8(input, roll);
+    const __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    const __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_shuffle_epi8(words, pack_shuffle));
+    return true;
+}
+
+__attribute__((target("sse4.1"))) size_t decodeSSE41(const char* src, size_t size, uint8_t*& dst) {
+    size_t used = 0;
+    for (; size - used >= 16 && decodeBlock(src + used, dst); used += 16)
+        dst += 12;
+    return used;
+}
+
+__attribute__((target("avx2"))) size_t decodeAVX2(const char* src, size_t size, uint8_t*& dst) {
+    // The same tables as decodeBlock, once per lane.
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                              0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71,
+                                              0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack_shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+                                                  8, 14, 13, 12, -1, -1, -1, -1,
+                                                  2, 1, 0, 6, 5, 4, 10, 9,
+                                                  8, 14, 13, 12, -1, -1, -1, -1);
+    // Moves the 12 bytes from the top lane down against the 12 from the bottom one.
+    const __m256i pack_lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+
+    size_t used = 0;
+    for (; size - used >= 32; used += 32) {
+        const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + used));
+        const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(input, 4), nibble_mask);
+        const __m256i lo_nibbles = _mm256_and_si256(input, nibble_mask);
+        const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if (!_mm256_testz_si256(lo, hi))
+            break;
+
+        const __m256i eq_slash = _mm256_cmpeq_epi8(input, _mm256_set1_epi8('/'));
+        const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_slash, hi_nibbles));
+        const __m256i values = _mm256_add_epi8(input, roll);
+        const __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        const __m256i words = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+        const __m256i packed = _mm256_permutevar8x32_epi32(
+            _mm256_shuffle_epi8(words, pack_shuffle), pack_lanes);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), packed);
+        dst += 24;
+    }
+    // Pick up a 16 character block the loop above left behind.
+    if (size - used >= 16 && decodeBlock(src + used, dst)) {
+        used += 16;
+        dst += 12;
+    }
+    return used;
+}
+
+// Spreads 12 bytes over 16 lanes as [b1 b0 b2 b1] per 3 bytes, then shifts each 6-bit index
+// into its own byte and translates the indices to characters with one lookup.
+__attribute__((target("sse4.1"))) BASE64_INLINE __m128i encodeBlock(__m128i input) {
+    input = _mm_shuffle_epi8(input,
+                             _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m128i t0 = _mm_and_si128(input, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(input, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    const __m128i indices = _mm_or_si128(t1, t3);
+
+    // 0-25 map to 13 ('A'), 26-51 to 0 ('a'), 52-61 to 1-10 ('0'), 62 to 11 and 63 to 12.
+    __m128i offsets = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    offsets = _mm_or_si128(offsets, _mm_and_si128(upper, _mm_set1_epi8(13)));
+    const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(shift_lut, offsets), indices);
+}
+
+__attribute__((target("sse4.1"))) size_t encodeSSE41(const uint8_t* src, size_t size, char* dst) {
+    size_t used = 0;
+    for (; size - used >= 16; used += 12, dst += 16) {
+        const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + used));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), encodeBlock(input));
+    }
+    return used;
+}
+
+__attribute__((target("avx2"))) size_t encodeAVX2(const uint8_t* src, size_t size, char* dst) {
+    const __m256i shuffle = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                             1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    size_t used = 0;
+    for (; size - used >= 28; used += 24, dst += 32) {
+        // Each lane takes 12 of the 24 bytes.
+        __m256i input = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + used))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + used + 12)),
+            1);
+        input = _mm256_shuffle_epi8(input, shuffle);
+        const __m256i t0 = _mm256_and_si256(input, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256(input, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i offsets = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        offsets = _mm256_or_si256(offsets, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+        const __m256i shift_lut = _mm256_setr_epi8(
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+        const __m256i output = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, offsets), indices);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), output);
+    }
+    for (; size - used >= 16; used += 12, dst += 16) {
+        const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + used));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), encodeBlock(input));
+    }
+    return used;
+}
+#endif
+
+DecodeKernel decodeKernel(Base64Backend backend) {
+    if (!base64BackendSupported(backend))
+        throw std::invalid_argument("Base64 backend isn't supported on this CPU");
+    switch (backend) {
+#ifdef BASE64_X86_KERNELS
+        case Base64Backend::SSE41:
+            return decodeSSE41;
+        case Base64Backend::AVX2:
+            return decodeAVX2;
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+EncodeKernel encodeKernel(Base64Backend backend) {
+    if (!base64BackendSupported(backend))
+        throw std::invalid_argument("Base64 backend isn't supported on this CPU");
+    switch (backend) {
+#ifdef BASE64_X86_KERNELS
+        case Base64Backend::SSE41:
+            return encodeSSE41;
+        case Base64Backend::AVX2:
+            return encodeAVX2;
+#endif
+        default:
+            return nullptr;
+    }
+}
+}  // namespace
+
+bool base64BackendSupported(Base64Backend backend) {
+    switch (backend) {
+        case Base64Backend::Scalar:
+            return true;
+#ifdef BASE64_X86_KERNELS
+        case Base64Backend::SSE41:
+            return __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1");
+        case Base64Backend::AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+Base64Backend base64Backend() {
+    static const Base64Backend best = [] {
+        for (auto backend : {Base64Backend::AVX2, Base64Backend::SSE41}) {
+            if (base64BackendSupported(backend))
+                return backend;
+        }
+        return Base64Backend::Scalar;
+    }();
+    return best;
+}
+
+std::vector<uint8_t> base64Decode(const char* data, size_t size) {
+    std::vector<uint8_t> ret;
+    base64Decode(data, size, ret);
+    return ret;
+}
+
+void base64Decode(const char* data, size_t size, std::vector<uint8_t>& ret) {
+    base64Decode(data, size, ret, base64Backend());
+}
+
+void base64Decode(const char* data, size_t size, std::vector<uint8_t>& ret, Base64Backend backend) {
+    static const struct DecodeTable {
+        DecodeTable() {
+            std::fill(std::begin(values), std::end(values), -1);
+            for (int i = 0; i < 64; ++i)
+                values[static_cast<uint8_t>(kAlphabet[i])] = i;
+        }
+        int8_t values[256];
+    } table;
+    const auto kernel = decodeKernel(backend);
+
+    ret.resize((size / 4) * 3 + 3 + kDecodeSlack);
+    uint8_t* out = ret.data();
+    uint32_t accumulator = 0;
+    int bits = 0;
+    int quantum = 0;
+    // The kernels can only start on a quantum boundary. After one stops on a block with an
+    // escape or padding in it, the scalar loop takes over until it's past the character that
+    // stopped it and back on a boundary.
+    size_t scalar_until = 0;
+    for (size_t i = 0; i < size;) {
+        if (kernel && quantum == 0 && i >= scalar_until) {
+            i += kernel(data + i, size - i, out);
+            if (i == size)
+                break;
+            scalar_until = i;
+            while (scalar_until < size &&
+                   table.values[static_cast<uint8_t>(data[scalar_until])] >= 0)
+                ++scalar_until;
+        }
+
+        const auto ch = static_cast<uint8_t>(data[i++]);
+        if (ch == '=')
+            break;
+        const auto value = table.values[ch];
+        if (value < 0) {
+            if (ch == '\\' || ch == '\n' || ch == '\r')
+                continue;
+            throw std::runtime_error("Invalid base64 data");
+        }
+        accumulator = (accumulator << 6) | value;
+        quantum = (quantum + 1) & 3;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            *out++ = (accumulator >> bits) & 0xff;
+        }
+    }
+    ret.resize(out - ret.data());
+}
+
+std::string base64Encode(const uint8_t* data, size_t size) {
+    return base64Encode(data, size, base64Backend());
+}
+
+std::string base64Encode(const uint8_t* data, size_t size, Base64Backend backend) {
+    const auto kernel = encodeKernel(backend);
+    std::string ret(((size + 2) / 3) * 4, '\0');
+    char* out = &ret[0];
+    size_t i = 0;
+    if (kernel && size > 0) {
+        i = kernel(data, size, out);
+        out += (i / 3) * 4;
+    }
+
+    for (; size - i >= 3; i += 3) {
+        const uint32_t group = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        *out++ = kAlphabet[(group >> 18) & 0x3f];
+        *out++ = kAlphabet[(group >> 12) & 0x3f];
+        *out++ = kAlphabet[(group >> 6) & 0x3f];
+        *out++ = kAlphabet[group & 0x3f];
+    }
+    if (i < size) {
+        const uint32_t group = (data[i] << 16) | (size - i > 1 ? data[i + 1] << 8 : 0);
+        *out++ = kAlphabet[(group >> 18) & 0x3f];
+        *out++ = kAlphabet[(group >> 12) & 0x3f];
+        *out++ = size - i > 1 ? kAlphabet[(group >> 6) & 0x3f] : '=';
+        *out++ = '=';
+    }
+    return ret;
+}
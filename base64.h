@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The codecs behind base64Decode and base64Encode. The vector ones work on whole 16 or 32
+// character blocks and leave anything else (escapes, padding, the tail) to the scalar code, so
+// every backend gives exactly the same results.
+enum class Base64Backend { Scalar, SSE41, AVX2 };
+
+// The fastest backend this CPU supports; picked once, on first use.
+Base64Backend base64Backend();
+bool base64BackendSupported(Base64Backend backend);
+
+// Decodes base64 straight out of a JSON string token. Backslashes are skipped so that escaped
+// slashes ("\/") don't need to be unescaped into a copy first, and decoding stops at padding.
+// Throws std::runtime_error on any other character outside the base64 alphabet.
+std::vector<uint8_t> base64Decode(const char* data, size_t size);
+// Same, but decodes into out, replacing its contents and reusing its memory.
+void base64Decode(const char* data, size_t size, std::vector<uint8_t>& out);
+// Same, with a particular backend; for tests and benchmarks. Throws std::invalid_argument if
+// the CPU doesn't support it.
+void base64Decode(const char* data, size_t size, std::vector<uint8_t>& out, Base64Backend backend);
+
+inline std::vector<uint8_t> base64Decode(const std::string& data) {
+    return base64Decode(data.data(), data.size());
+}
+
+// Padded, with no line breaks.
+std::string base64Encode(const uint8_t* data, size_t size);
+std::string base64Encode(const uint8_t* data, size_t size, Base64Backend backend);
+
+inline std::string base64Encode(const std::vector<uint8_t>& data) {
+    return base64Encode(data.data(), data.size());
+}
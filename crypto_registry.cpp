@@ -0,0 +1,192 @@
+#include <openssl/crypto.h>
+#include <stdexcept>
+
+#include "crypto_registry.h"
+
+#ifdef CRYPTO_REGISTRY_FETCH
+#include <openssl/core_names.h>
+#endif
+
+namespace {
+#ifdef CRYPTO_REGISTRY_FETCH
+// Falls back to the built-in object if the default provider can't supply one, so a missing
+// algorithm fails where it's used rather than at startup.
+const EVP_CIPHER* fetchCipher(const char* name,
+                              const EVP_CIPHER* builtin,
+                              std::vector<EVP_CIPHER*>& fetched) {
+    auto cipher = EVP_CIPHER_fetch(nullptr, name, nullptr);
+    if (!cipher)
+        return builtin;
+    fetched.push_back(cipher);
+    return cipher;
+}
+
+const EVP_MD* fetchDigest(const char* name,
+                          const EVP_MD* builtin,
+                          std::vector<EVP_MD*>& fetched) {
+    auto digest = EVP_MD_fetch(nullptr, name, nullptr);
+    if (!digest)
+        return builtin;
+    fetched.push_back(digest);
+    return digest;
+}
+#endif
+}  // namespace
+
+#ifdef CRYPTO_REGISTRY_FETCH
+CryptoRegistry::CryptoRegistry() {
+    aes128CBC = fetchCipher("AES-128-CBC", EVP_aes_128_cbc(), fetched_ciphers);
+    aes256CBC = fetchCipher("AES-256-CBC", EVP_aes_256_cbc(), fetched_ciphers);
+    md5 = fetchDigest("MD5", EVP_md5(), fetched_digests);
+    sha1 = fetchDigest("SHA1", EVP_sha1(), fetched_digests);
+    sha256 = fetchDigest("SHA256", EVP_sha256(), fetched_digests);
+    sha512 = fetchDigest("SHA512", EVP_sha512(), fetched_digests);
+    hmac = EVP_MAC_fetch(nullptr, "HMAC", nullptr);
+}
+
+CryptoRegistry::~CryptoRegistry() {
+    for (auto cipher : fetched_ciphers)
+        EVP_CIPHER_free(cipher);
+    for (auto digest : fetched_digests)
+        EVP_MD_free(digest);
+    EVP_MAC_free(hmac);
+}
+#else
+CryptoRegistry::CryptoRegistry()
+    : aes128CBC(EVP_aes_128_cbc()),
+      aes256CBC(EVP_aes_256_cbc()),
+      md5(EVP_md5()),
+      sha1(EVP_sha1()),
+      sha256(EVP_sha256()),
+      sha512(EVP_sha512()) {}
+
+CryptoRegistry::~CryptoRegistry() = default;
+#endif
+
+const CryptoRegistry& cryptoRegistry() {
+    static const CryptoRegistry registry;
+    return registry;
+}
+
+DigestContext::DigestContext() {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
+    ctx = EVP_MD_CTX_create();
+#else
+    ctx = EVP_MD_CTX_new();
+#endif
+    if (!ctx)
+        throw std::bad_alloc();
+}
+
+DigestContext::~DigestContext() {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
+    EVP_MD_CTX_destroy(ctx);
+#else
+    EVP_MD_CTX_free(ctx);
+#endif
+}
+
+void DigestContext::init(const EVP_MD* md) {
+    if (EVP_DigestInit_ex(ctx, md, nullptr) != 1)
+        throw std::runtime_error("Couldn't initialize digest");
+}
+
+void DigestContext::initFrom(const DigestContext& prefix) {
+    if (EVP_MD_CTX_copy_ex(ctx, prefix.ctx) != 1)
+        throw std::runtime_error("Couldn't initialize digest");
+}
+
+void DigestContext::update(const void* data, size_t size) {
+    if (EVP_DigestUpdate(ctx, data, size) != 1)
+        throw std::runtime_error("Couldn't update digest");
+}
+
+unsigned int DigestContext::final(uint8_t* out) {
+    unsigned int size = 0;
+    if (EVP_DigestFinal_ex(ctx, out, &size) != 1)
+        throw std::runtime_error("Couldn't finalize digest");
+    return size;
+}
+
+HMACContext::HMACContext(const EVP_MD* _md) : md(_md) {
+#ifdef CRYPTO_REGISTRY_FETCH
+    ctx = cryptoRegistry().hmac ? EVP_MAC_CTX_new(cryptoRegistry().hmac) : nullptr;
+#elif OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
+    ctx = new HMAC_CTX;
+    HMAC_CTX_init(ctx);
+#else
+    ctx = HMAC_CTX_new();
+#endif
+    if (!ctx)
+        throw std::runtime_error("Couldn't create HMAC context");
+}
+
+HMACContext::~HMACContext() {
+    OPENSSL_cleanse(key.data(), key.size());
+#ifdef CRYPTO_REGISTRY_FETCH
+    EVP_MAC_CTX_free(ctx);
+#elif OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
+    HMAC_CTX_cleanup(ctx);
+    delete ctx;
+#else
+    HMAC_CTX_free(ctx);
+#endif
+}
+
+size_t HMACContext::size() const {
+    return EVP_MD_size(md);
+}
+
+void HMACContext::init(const uint8_t* new_key, size_t key_size) {
+    const bool same_key = keyed && key_size == key.size() &&
+        CRYPTO_memcmp(new_key, key.data(), key_size) == 0;
+    // OpenSSL reads a null key as "start over with the last one", so an empty key still needs
+    // a real pointer.
+    static const uint8_t empty_key = 0;
+    const uint8_t* init_key = same_key ? nullptr : (key_size ? new_key : &empty_key);
+    int res;
+#ifdef CRYPTO_REGISTRY_FETCH
+    if (keyed) {
+        res = EVP_MAC_init(ctx, init_key, same_key ? 0 : key_size, nullptr);
+    } else {
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_utf8_string(
+                OSSL_MAC_PARAM_DIGEST, const_cast<char*>(EVP_MD_get0_name(md)), 0),
+            OSSL_PARAM_construct_end()};
+        res = EVP_MAC_init(ctx, init_key, key_size, params);
+    }
+#else
+    res = HMAC_Init_ex(ctx, init_key, same_key ? 0 : key_size, keyed ? nullptr : md, nullptr);
+#endif
+    if (res != 1) {
+        keyed = false;
+        throw std::runtime_error("Couldn't initialize HMAC");
+    }
+    if (!same_key) {
+        OPENSSL_cleanse(key.data(), key.size());
+        key.assign(new_key, new_key + key_size);
+    }
+    keyed = true;
+}
+
+void HMACContext::update(const uint8_t* data, size_t size) {
+#ifdef CRYPTO_REGISTRY_FETCH
+    const int res = EVP_MAC_update(ctx, data, size);
+#else
+    const int res = HMAC_Update(ctx, data, size);
+#endif
+    if (res != 1)
+        throw std::runtime_error("Couldn't update HMAC");
+}
+
+void HMACContext::final(uint8_t* out) {
+#ifdef CRYPTO_REGISTRY_FETCH
+    size_t out_size = 0;
+    const int res = EVP_MAC_final(ctx, out, &out_size, size());
+#else
+    unsigned int out_size = 0;
+    const int res = HMAC_Final(ctx, out, &out_size);
+#endif
+    if (res != 1 || out_size != size())
+        throw std::runtime_error("Couldn't finalize HMAC");
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <vector>
+
+// OpenSSL 3 moved the algorithms into providers. The old EVP_aes_128_cbc()-style getters still
+// work there, but every context set up with one has to look the real implementation up again,
+// which takes a lock on a shared store. Fetching them explicitly, once, skips that.
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(LIBRESSL_VERSION_NUMBER)
+#define CRYPTO_REGISTRY_FETCH
+#endif
+
+// The ciphers and digests used anywhere in gonepass, looked up once for the whole process. On
+// OpenSSL 1.0, 1.1 and LibreSSL these are just the built-in objects.
+struct CryptoRegistry {
+    CryptoRegistry();
+    ~CryptoRegistry();
+    CryptoRegistry(const CryptoRegistry&) = delete;
+    CryptoRegistry& operator=(const CryptoRegistry&) = delete;
+
+    const EVP_CIPHER* aes128CBC;
+    const EVP_CIPHER* aes256CBC;
+    const EVP_MD* md5;
+    const EVP_MD* sha1;
+    const EVP_MD* sha256;
+    const EVP_MD* sha512;
+#ifdef CRYPTO_REGISTRY_FETCH
+    EVP_MAC* hmac;
+#endif
+
+private:
+    std::vector<EVP_CIPHER*> fetched_ciphers;
+    std::vector<EVP_MD*> fetched_digests;
+};
+
+// Builds the registry on first use; safe to call from any thread.
+const CryptoRegistry& cryptoRegistry();
+
+// An EVP_MD_CTX that's kept between messages instead of being allocated for each one.
+class DigestContext {
+public:
+    DigestContext();
+    ~DigestContext();
+    DigestContext(const DigestContext&) = delete;
+    DigestContext& operator=(const DigestContext&) = delete;
+
+    void init(const EVP_MD* md);
+    // Carries on from wherever prefix has got to, so a long prefix that many messages share only
+    // has to be hashed once. prefix isn't changed, and may be shared between threads.
+    void initFrom(const DigestContext& prefix);
+    void update(const void* data, size_t size);
+    // Writes the digest to out, which must have room for EVP_MAX_MD_SIZE bytes, and returns its
+    // size.
+    unsigned int final(uint8_t* out);
+
+private:
+    EVP_MD_CTX* ctx;
+};
+
+// HMACs with one digest, reusing the context, and the key schedule too for as long as the key
+// stays the same. Not safe to share between threads.
+class HMACContext {
+public:
+    explicit HMACContext(const EVP_MD* md);
+    ~HMACContext();
+    HMACContext(const HMACContext&) = delete;
+    HMACContext& operator=(const HMACContext&) = delete;
+
+    size_t size() const;
+    void init(const uint8_t* key, size_t key_size);
+    void update(const uint8_t* data, size_t size);
+    // Writes size() bytes to out.
+    void final(uint8_t* out);
+
+    // init, update and final in one go.
+    void compute(const uint8_t* key,
+                 size_t key_size,
+                 const uint8_t* data,
+                 size_t size,
+                 uint8_t* out) {
+        init(key, key_size);
+        update(data, size);
+        final(out);
+    }
+
+private:
+    const EVP_MD* md;
+    // The key the context was last set up with, wiped on destruction.
+    std::vector<uint8_t> key;
+    bool keyed = false;
+#ifdef CRYPTO_REGISTRY_FETCH
+    EVP_MAC_CTX* ctx;
+#else
+    HMAC_CTX* ctx;
+#endif
+};
@@ -0,0 +1,13 @@
+ld({
+  "0EDE7D0C2C9A4F8A8B4A2C6B1F3C5D01": {
+    "category": "001",
+    "created": 1420000000,
+    "updated": 1420000100,
+    "tx": 1420000200,
+    "uuid": "0EDE7D0C2C9A4F8A8B4A2C6B1F3C5D01",
+    "k": "QlOe/qw+AJCgiAhM9GJ9xiA5YyLcdDcN1LvZl0j44s1Kv1H/5eM/y2ZNlxX+EJS3yv9wRhaIrMx4i80iNAMrsbFzs9Y5BJN744fZCfTqGEv2cjO0jT9hjfEJC8jxErVszIUqSeGu9v6dZy8H6QKFPA==",
+    "o": "b3BkYXRhMDGSAAAAAAAAAEwtDmzBMM8BkUAr2ZhfgTpN7LWVMbSS/ckCSXKQHqI5EeFxuuoKt+kYwW19a9K5yYIGkrBdW/6eVrFFdItFtlSYD/9j7fk/E9dG13vidWFWPAAnXawbX42UVhUkx5SZ1hjlxmiRiGcj1FVnhF9G2eWIKnUg1aNnrdPBscJ7w34xMtXgxR5bChZ4vnif/OnS2ZqXEzWaf5a3qwM/bwuVLXIRiK8P9DUKZEAvsONQTOKNUE56yfaREq0C8cRl7BxxcRdALRTIuUWfC/pqNMjYhHI=",
+    "d": "b3BkYXRhMDHQAAAAAAAAACXHl7sCUwsrBw5eklkU9806QKOT3VXo86YhICOM+W7yXtA35wdI2ub7UFhZFgACcidot2ukcTBUCEoFyMbCcX6c9EJJnjP8o58yzUWNYW2Fb5tfHUxDnNFFr2fvE4G7cplnTJKnlNCXDdZSUNF+VcnSEEdzol55KQiHn5nv2N/bLyzyF4DfoLauLgHi1zr7wNth9VArI9FMM7ScDubI2I29JepJhOhpPu24lwae5n4JEOuLHp0I+B3NDnrFynXtzQqjvXc4biX8mN0vLiHaZbooKVtDjN1t9Kz6wwJTTSnBcMspmaU4aPPK1gnRA7Q0ZE2Nc5dQwWe2ea9iJsbclwVSwXK1dSal34oBxv8zWTN9",
+    "hmac": "HSnKC2eM2lyeGn5VFT6DcaTwkfcuBB1tWsux4CPqL3g="
+  }
+});
\ No newline at end of file
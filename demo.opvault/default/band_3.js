@@ -0,0 +1,14 @@
+ld({
+  "3A1B2C3D4E5F40718293A4B5C6D7E8F9": {
+    "category": "003",
+    "created": 1420000001,
+    "updated": 1420000101,
+    "tx": 1420000201,
+    "uuid": "3A1B2C3D4E5F40718293A4B5C6D7E8F9",
+    "k": "MNnBZN/WartX0gu/2yQ/AxdHAceDH8Pl294k9+Z32DfZso8/LmBFAfRGL/gbq6TJtQ3FJA/hyXzc5qYwDZQSDHPXl+hkaL46MMYwUH1nysBOoI7cwIo4SpV7hXtUZrrxE3UnYmbd22qdJM2QAOuK4Q==",
+    "o": "b3BkYXRhMDEYAAAAAAAAANsgRLCQX783G1DWKp5mkpNeEUfRBtGxVzOKL6xTGg17SQ8NsxadIF+OpCHB9lKX05IZorFLaJ3m+N3MYAMs+A0vqQRNQQpVU0vkOlX2tULf",
+    "d": "b3BkYXRhMDEjAAAAAAAAAOS582186U3ZPayYSw7lkq6fP9+RjhV8DdQxMiPpAX7iMN9o18iZw01GPiYWYrcHtAD5OJWd9UWxHEJxex1GNskxHgIYt56x2LB7LPUm38hxb1rdT+K0b3OsNbk9NFBxeQ==",
+    "fave": 1,
+    "hmac": "8BH+ewuIgP4h1XSm2a/TZzgyw1msJ1DDvp9JTGcrhj0="
+  }
+});
\ No newline at end of file
@@ -0,0 +1,13 @@
+ld({
+  "7C0FFEE0123445678899AABBCCDDEEFF": {
+    "category": "002",
+    "created": 1420000002,
+    "updated": 1420000102,
+    "tx": 1420000202,
+    "uuid": "7C0FFEE0123445678899AABBCCDDEEFF",
+    "k": "Rcq8b7/EBAlr/K2rlkqVV05vg8LUpRvFBVdJ4pTpywxK/ZPapyBeBcSrYxWBgDmrGxFu8zUYPnlYvHDOpTkHbCxhPjQhCXxCsdpMDimGFMwvk0jS7Aw60OD5DFIeY/3IbIeDr2qaimQx85gjtWHElQ==",
+    "o": "b3BkYXRhMDEWAAAAAAAAAB9SZYcBCukdV3Zxo9+loBRj4NNEMnLU8mKq9WwhkLt/40Tu89ExlkgFZh2cTWfvtuuszLHrvPxSlCB1/MmkAF19yLGKW3ui9ruUrrgVUCbP",
+    "d": "b3BkYXRhMDEVAQAAAAAAACDlye6ObaidjLLhAK+FNTkuOGMTI05138a1qoe1PaizYBfGFf+oCM/ULJK8i8vLgW8Q4pqHAvkfgfYdsadt1qQt4dFCbVlhn1LAhtjqBqdOHAvL3wG/fm1fv1yFSx+0uF1KupwS7MZCgHS3ERYoMD+NvWhowd2q0slBL2cvXyjMD+pgPyej7iFEdnUhASgKZNcruYok5WPw+NUEtvTjVske1IaNZEgAFsTW4rm0XGnwsmA3R1gKsBAXczP3PB4wnJxDWndTYU6Ca9XiiQWJThdVgTFKKWtpEuq+0Wgsd1pQawbcpWO5qn6ktaAmz3ro4HzYluzmUq3l/DClBWQsfM6RepFDqp5QZTyaac6OHugfYmKD/r1JyeyIiRugPR9BHPSD80Uw/G6D3f8crPI3Bm8913Hvs0vYiDOxEW9Yl3tK0waj2fqeJxmutsRyGmp4QA==",
+    "hmac": "z/9hhClOSdP83hqeMZ7O3qLlQlTg0QgwCxOBy8TxMAo="
+  }
+});
\ No newline at end of file
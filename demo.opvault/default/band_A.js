@@ -0,0 +1,14 @@
+ld({
+  "A0B1C2D3E4F5061728394A5B6C7D8E9F": {
+    "category": "005",
+    "created": 1420000003,
+    "updated": 1420000103,
+    "tx": 1420000203,
+    "uuid": "A0B1C2D3E4F5061728394A5B6C7D8E9F",
+    "k": "5VOMoWi0JeWc1yEGpydRIB8R7DkBUB8NJYfFRqKcfsCDJ1T17Fp9JoGS+lJ2X0AobOQu7rQEqgbUlBT1YCHdJ7y87nTd6u0aJfzGKIfZuPpq1HXbqMzY9RjhIYVII8P0CUWcv7GnSasByebmnCwAOQ==",
+    "o": "b3BkYXRhMDEZAAAAAAAAAHB/VtWZYKzAJ0TgMbjlEVHvnb/4ig4MCtnQ95C/MNt9VGts7jSQ5xYIiFHDXJivCSWJTCbu5d8BSpPSuiD9JRsINHB7dfQfCxlfFgk9uLQL",
+    "d": "b3BkYXRhMDEdAAAAAAAAAEGTjZ555aadjC+o4Ok2F2Of2TuUSi5RR7r+g9XolE51ykTvWxCtgICyUw/aRgVGponLRFzjvSjtdoPqFk4/RVeeDKXJC/XBxlBiNE/WfciE",
+    "trashed": true,
+    "hmac": "oAEmwFoXjT+8mpV+8/aykraucmkNL/FflchADL5ilz8="
+  }
+});
\ No newline at end of file
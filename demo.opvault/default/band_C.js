@@ -0,0 +1,13 @@
+ld({
+  "C4C4C4C4C4C4C4C4C4C4C4C4C4C4C4C4": {
+    "category": "099",
+    "created": 1420000004,
+    "updated": 1420000104,
+    "tx": 1420000204,
+    "uuid": "C4C4C4C4C4C4C4C4C4C4C4C4C4C4C4C4",
+    "k": "tVTM4DoulPh35JBrKS/PMYITpeLq2r7UgcqKkC5Te9CQido77JYRqPQFEPV3fNvCxVBjUe5wIj+EEmoIplhvrJrSZ5fyOa8cAE2kniEz22XW4VmSm1PVJdgVj1NMIdmX2Wjg/DG0JLrwJRSG8ERN4g==",
+    "o": "b3BkYXRhMDEUAAAAAAAAAJXiUXEeWPI3uH56gMDKoOgbKQtvSv4UDgYj3AXdBUhyFGaulRm6nmCwAjkVYX7oulomYmSKR3JL0xz9eQMPZoj2mWvgSs689bIH7gDG0h0k",
+    "d": "b3BkYXRhMDECAAAAAAAAAOCS4N07GGJEztUj9mbGekjtidG1GrYISHG/eujhHUvro/A9wlYscd9WwLqIj66JNpX6AjW5pNH2Y4KIVuGC7v0=",
+    "hmac": "VngXXsDcPiuy5q7uscnUGHK9HAV5NHQsdnS9qC6QdcU="
+  }
+});
\ No newline at end of file
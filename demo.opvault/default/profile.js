@@ -0,0 +1 @@
+var profile={"lastUpdatedBy": "Dropbox", "updatedAt": 1420000000, "profileName": "default", "salt": "zH9YCuV4rtxDXUgDG6lRIQ==", "passwordHint": "", "iterations": 10000, "masterKey": "b3BkYXRhMDEAAQAAAAAAAAZxqBV/5jVC8wyUyf5F6QbRwzZAHsfsPyGEANZQt6ZngLf4LQbJHPWMBvo+0CgX0vaWlB8VbLxJ2ySCQFulN/4rrmMi9LwcdMC8Z/dJqPRzi5BOfiA7Abj0qsFhUaqVQPtZ1jkw/QIoFxoc6A7OOrrab9Haov9fWdhNuE9VVSxmo3/1jDbn6xdVBI0riryMpj2/8jJWW6/5JAabKeOL5xhyjhal8UPzjIbVHBrD9MtdVGtvCPrIZTQU0sT3fOntj0WfiUld8+xXm2nMgvp1kgHhvMqSzr4DxJqkUSU74qlSQm775UEp/FvPnpAfAtEvkt+QS2EgF2k02tCl6reJAqn9m3x8mAIF6TDNvznNFER4NuAiK6H6KrH/WAty1dpWR2z1zgr7Coj3PZJstS0RCVUzgwpLNqxdJQbQJbnu8SWL", "overviewKey": "b3BkYXRhMDEAAQAAAAAAAMDrRMVZ5pZ+zt7gdPocvTm5keNMTi7hmLWTuw+AYFIaOfcX9yVnCi3u3qkmf5B4+vXv7gwQrILoXT56ufxRcMqPaKBTcQ2ACA5olXe9UZPsvcSzUdqwAX8eJ+/bgIaUhAdAb0x3Rc4pzf28PEgGsi9X3EyicGpoxa4pEYdvj+TR7hGQLaVEbBia3Ddyf2KUbL0qlpna5HH++Witeb7DiJpleJ9atikqVKESFaRuCLybIccwGRHm7HhkjtzufWP/r3WV3YHkLF77HzxRmjg3iQUOl+u9WC+6eF6GWILjdMAT5a6LjxsdD+pmTO7sssaDL8/ojAkao3UlynaFatgJLEsW7tD8YmJXYiBCfGuFTOCwThjazX6/lYpf/ue/SyYK3msi9FVhvGMauHvyJ/ICcwvgqkaz/HyU+OpaLNaAJFtM", "uuid": "2B894A18997C4638BACC55F2D56A4890", "createdAt": 1420000000};
\ No newline at end of file
@@ -0,0 +1,68 @@
+#pragma once
+#include <sstream>
+#include <vector>
+
+#include <gtkmm.h>
+
+#include "keychain.h"
+
+// A dismissable bar listing the items that couldn't be loaded. Unlike errorDialog this doesn't
+// block, and any number of failures are shown together.
+class ErrorPanel : public Gtk::InfoBar {
+public:
+    ErrorPanel() : Gtk::InfoBar(), details_expander("Details") {
+        set_message_type(Gtk::MESSAGE_WARNING);
+        set_show_close_button(true);
+
+        auto content = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_VERTICAL));
+        content->set_spacing(3);
+        summary_label.set_halign(Gtk::ALIGN_START);
+        content->pack_start(summary_label, false, true, 0);
+
+        details_label.set_halign(Gtk::ALIGN_START);
+        details_label.set_selectable(true);
+        details_label.set_line_wrap(true);
+        details_scroller.set_policy(Gtk::POLICY_NEVER, Gtk::POLICY_AUTOMATIC);
+        details_scroller.set_min_content_height(100);
+        details_scroller.add(details_label);
+        details_expander.add(details_scroller);
+        content->pack_start(details_expander, false, true, 0);
+
+        dynamic_cast<Gtk::Container*>(get_content_area())->add(*content);
+        signal_response().connect([this](int) { clear(); });
+
+        show_all_children();
+        set_no_show_all(true);
+        hide();
+    }
+
+    void addErrors(const std::vector<KeychainLoadError>& new_errors) {
+        if (new_errors.empty())
+            return;
+        errors.insert(errors.end(), new_errors.begin(), new_errors.end());
+
+        std::stringstream summary;
+        summary << errors.size() << (errors.size() == 1 ? " item" : " items")
+                << " couldn't be loaded";
+        summary_label.set_text(summary.str());
+
+        std::stringstream details;
+        for (const auto& error : errors) {
+            details << error.title << " (" << error.uuid << "): " << error.reason << "\n";
+        }
+        details_label.set_text(details.str());
+        show();
+    }
+
+    void clear() {
+        errors.clear();
+        hide();
+    }
+
+private:
+    std::vector<KeychainLoadError> errors;
+    Gtk::Label summary_label;
+    Gtk::Expander details_expander;
+    Gtk::ScrolledWindow details_scroller;
+    Gtk::Label details_label;
+};
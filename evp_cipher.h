@@ -1,9 +1,14 @@
 #pragma once
 #include <array>
+#include <memory>
+#include <openssl/crypto.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <stdexcept>
 #include <vector>
 
+#include "thread_local_pool.h"
+
 using EVPKey = std::array<uint8_t, EVP_MAX_KEY_LENGTH>;
 using EVPIv = std::array<uint8_t, EVP_MAX_IV_LENGTH>;
 
@@ -20,54 +25,91 @@ public:
     char err_msg_buf[128];
 };
 
-class EVPCipher {
-private:
-    std::function<void(EVP_CIPHER_CTX*)> cipherFreeFn = [](EVP_CIPHER_CTX* ptr) {
+// Frees the context; a plain function object, so holding one costs nothing per cipher.
+struct EVPCipherContextFree {
+    void operator()(EVP_CIPHER_CTX* ptr) const {
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
+        EVP_CIPHER_CTX_cleanup(ptr);
         delete ptr;
 #else
         EVP_CIPHER_CTX_free(ptr);
 #endif
-    };
+    }
+};
 
+class EVPCipher {
 public:
-    EVPCipher(const EVP_CIPHER* type, const EVPKey& key, const EVPIv& iv, bool encrypt) {
+    // A context that isn't set up for anything yet; call init before using it.
+    EVPCipher() {
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
-        ctx = std::unique_ptr<EVP_CIPHER_CTX, decltype(cipherFreeFn)>(new EVP_CIPHER_CTX,
-                                                                      cipherFreeFn);
+        ctx.reset(new EVP_CIPHER_CTX);
 #else
-        ctx = std::unique_ptr<EVP_CIPHER_CTX, decltype(cipherFreeFn)>(EVP_CIPHER_CTX_new(),
-                                                                      cipherFreeFn);
+        ctx.reset(EVP_CIPHER_CTX_new());
 #endif
         EVP_CIPHER_CTX_init(ctx.get());
-        EVP_CipherInit_ex(ctx.get(), type, nullptr, key.data(), iv.data(), encrypt ? 1 : 0);
     }
 
-    ~EVPCipher() {
-        EVP_CIPHER_CTX_cleanup(ctx.get());
+    EVPCipher(const EVP_CIPHER* type, const EVPKey& key, const EVPIv& iv, bool encrypt)
+        : EVPCipher() {
+        init(type, key, iv, encrypt);
+    }
+
+    // Sets the context up for a new message, keeping both it and the accumulator's memory.
+    // Staying with the same cipher and direction only swaps the key and IV, which unlike a
+    // full re-initialisation doesn't make OpenSSL allocate anything.
+    void init(const EVP_CIPHER* type,
+              const EVPKey& key,
+              const EVPIv& iv,
+              bool encrypt,
+              bool padding = true) {
+        const int enc = encrypt ? 1 : 0;
+        const bool same_setup = type == init_type && enc == init_enc;
+        if (EVP_CipherInit_ex(ctx.get(),
+                              same_setup ? nullptr : type,
+                              nullptr,
+                              key.data(),
+                              iv.data(),
+                              enc) != 1) {
+            init_type = nullptr;
+            throw EVPCipherException();
+        }
+        init_type = type;
+        init_enc = enc;
+        EVP_CIPHER_CTX_set_padding(ctx.get(), padding ? 1 : 0);
+        accumulator.clear();
+        finalized = false;
+    }
+
+    // Overwrites the output, keeping its memory for the next message.
+    void wipe() {
+        OPENSSL_cleanse(accumulator.data(), accumulator.size());
+        accumulator.clear();
     }
 
     void expandAccumulator(size_t inputSize) {
         auto block_size = EVP_CIPHER_CTX_block_size(ctx.get());
         const auto maxIncrease = (((inputSize / block_size) + 1) * block_size);
+        // Leave room for finalize's last block too, so a whole message grows the buffer once.
+        accumulator.reserve(accumulator.size() + maxIncrease + block_size);
         accumulator.resize(accumulator.size() + maxIncrease);
     }
 
-    void update(const std::vector<uint8_t>& data) {
+    void update(const uint8_t* data, size_t size) {
         const auto oldSize = accumulator.size();
-        expandAccumulator(data.size());
+        expandAccumulator(size);
         int encryptedSize = 0;
-        if (EVP_CipherUpdate(ctx.get(),
-                             accumulator.data() + oldSize,
-                             &encryptedSize,
-                             data.data(),
-                             data.size()) != 1) {
+        if (EVP_CipherUpdate(
+                ctx.get(), accumulator.data() + oldSize, &encryptedSize, data, size) != 1) {
             throw EVPCipherException();
         }
 
         accumulator.resize(oldSize + encryptedSize);
     }
 
+    void update(const std::vector<uint8_t>& data) {
+        update(data.data(), data.size());
+    }
+
     void update(const std::string& data) {
         const auto oldSize = accumulator.size();
         expandAccumulator(data.size());
@@ -117,7 +159,26 @@ public:
         return accumulator.cend();
     }
 
-    std::unique_ptr<EVP_CIPHER_CTX, decltype(cipherFreeFn)> ctx;
+    std::unique_ptr<EVP_CIPHER_CTX, EVPCipherContextFree> ctx;
     std::vector<uint8_t> accumulator;
     bool finalized = false;
+
+private:
+    const EVP_CIPHER* init_type = nullptr;
+    int init_enc = -1;
 };
+
+// Each thread keeps the cipher contexts it's finished with, and their output buffers, so
+// per-message encryption and decryption stop allocating once the thread has warmed up. The
+// threads parallelFor runs on are kept between calls, so they only warm up once.
+using EVPCipherPool = ThreadLocalPool<EVPCipher>;
+
+inline EVPCipherPool::Lease leaseCipher(const EVP_CIPHER* type,
+                                        const EVPKey& key,
+                                        const EVPIv& iv,
+                                        bool encrypt,
+                                        bool padding = true) {
+    auto cipher = EVPCipherPool::acquire();
+    cipher->init(type, key, iv, encrypt, padding);
+    return cipher;
+}
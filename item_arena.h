@@ -0,0 +1,170 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <openssl/crypto.h>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Backs all the decrypted item data from one vault load. Memory is handed out from large
+// chunks and never given back individually; it's all wiped and freed at once when the arena
+// goes away, which is when the keychain reloads, locks or compacts its items and the last item
+// pointing into it is gone.
+class ItemArena {
+public:
+    ItemArena() = default;
+    ItemArena(const ItemArena&) = delete;
+    ItemArena& operator=(const ItemArena&) = delete;
+
+    ~ItemArena() {
+        for (auto& chunk : chunks)
+            OPENSSL_cleanse(chunk.blocks.get(), chunk.size);
+    }
+
+    // Returns size bytes aligned for any type. Safe to call from multiple threads at once.
+    void* allocate(size_t size) {
+        size = alignUp(std::max<size_t>(size, 1));
+        std::lock_guard<std::mutex> guard(lock);
+        bytes_used += size;
+        // Anything too big to share a chunk gets a chunk of its own.
+        if (size > kChunkSize / 4)
+            return addChunk(size);
+        if (size > remaining) {
+            next = static_cast<char*>(addChunk(kChunkSize));
+            remaining = kChunkSize;
+        }
+        auto ret = next;
+        next += size;
+        remaining -= size;
+        return ret;
+    }
+
+    size_t bytesUsed() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return bytes_used;
+    }
+
+    size_t bytesReserved() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return bytes_reserved;
+    }
+
+    static size_t alignUp(size_t size) {
+        return (size + sizeof(Block) - 1) / sizeof(Block) * sizeof(Block);
+    }
+
+private:
+    using Block = std::max_align_t;
+    static const size_t kChunkSize = 64 * 1024;
+
+    struct Chunk {
+        std::unique_ptr<Block[]> blocks;
+        size_t size;
+    };
+
+    // size must be a multiple of sizeof(Block). Called with lock held.
+    void* addChunk(size_t size) {
+        chunks.push_back({std::unique_ptr<Block[]>(new Block[size / sizeof(Block)]), size});
+        bytes_reserved += size;
+        return chunks.back().blocks.get();
+    }
+
+    mutable std::mutex lock;
+    std::vector<Chunk> chunks;
+    char* next = nullptr;
+    size_t remaining = 0;
+    size_t bytes_used = 0;
+    size_t bytes_reserved = 0;
+};
+
+// A string stored in an ItemArena. It doesn't own its characters, and they aren't
+// null-terminated.
+class ArenaString {
+public:
+    ArenaString() = default;
+    ArenaString(const char* _data, size_t _size) : ptr(_data), length(_size) {}
+
+    const char* data() const {
+        return ptr;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    bool empty() const {
+        return length == 0;
+    }
+
+    std::string str() const {
+        return std::string(ptr, length);
+    }
+
+    operator std::string() const {
+        return str();
+    }
+
+    bool operator==(const ArenaString& other) const {
+        return length == other.length && std::memcmp(ptr, other.ptr, length) == 0;
+    }
+
+    bool operator==(const std::string& other) const {
+        return length == other.size() && other.compare(0, length, ptr, length) == 0;
+    }
+
+    bool operator!=(const ArenaString& other) const {
+        return !(*this == other);
+    }
+
+    bool operator!=(const std::string& other) const {
+        return !(*this == other);
+    }
+
+private:
+    const char* ptr = "";
+    size_t length = 0;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const ArenaString& str) {
+    return out.write(str.data(), str.size());
+}
+
+// A fixed-size array stored in an ItemArena. T must be trivially destructible, since nothing
+// in an arena is ever destroyed.
+template <typename T>
+class ArenaArray {
+public:
+    ArenaArray() = default;
+    ArenaArray(const T* _items, size_t _count) : items(_items), count(_count) {}
+
+    const T* begin() const {
+        return items;
+    }
+
+    const T* end() const {
+        return items + count;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    const T& operator[](size_t index) const {
+        return items[index];
+    }
+
+    bool operator==(const ArenaArray& other) const {
+        return count == other.count && std::equal(begin(), end(), other.begin());
+    }
+
+private:
+    const T* items = nullptr;
+    size_t count = 0;
+};
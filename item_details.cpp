@@ -0,0 +1,644 @@
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <stdexcept>
+
+#include "item_details.h"
+
+namespace {
+template <typename T>
+bool hasAllKeys(const json& d, T v) {
+    return d.find(v) != d.end();
+}
+
+template <typename T, typename... Args>
+bool hasAllKeys(const json& d, T first, Args... args) {
+    return hasAllKeys(d, first) && hasAllKeys(d, args...);
+}
+
+// The formatting for section fields that aren't plain strings. Both parsers share these so
+// their output can't drift apart.
+std::string formatDate(time_t time_val) {
+    char dateBuf[20] = {'\0'};
+    const auto local_time = std::localtime(&time_val);
+    if (!local_time)
+        throw std::runtime_error("Item has a date that's out of range");
+    std::strftime(dateBuf, sizeof(dateBuf), "%x", local_time);
+    return dateBuf;
+}
+
+std::string formatAddress(const std::string& street,
+                          const std::string& city,
+                          const std::string& state,
+                          const std::string& zip) {
+    std::stringstream ss;
+    ss << street << " " << city << ", " << state << " " << zip;
+    return ss.str();
+}
+
+std::string formatMonthYear(int value) {
+    auto stringVal = std::to_string(value);
+    std::stringstream ss;
+    ss << stringVal.substr(0, 4) << "/" << stringVal.substr(4, 2);
+    return ss.str();
+}
+
+// Thrown inside ItemScanner when the text is anything other than the shapes it handles.
+struct NotHandled {};
+
+// A strict, single pass JSON reader that pulls the item details out as it goes. It validates
+// everything it skips over as well, so that text the DOM parser would reject is never
+// accepted here.
+class ItemScanner {
+public:
+    ItemScanner(const char* data, size_t size) : cur(data), end(data + size) {}
+
+    void scan(ItemDetails& details) {
+        bool has_password = false;
+        std::string password;
+        std::vector<ItemDetailsField> fields;
+        std::vector<ItemDetailsField> section_fields;
+
+        if (peek() != '{')
+            throw NotHandled();
+        scanObject([&]() {
+            if (keyIs("notesPlain")) {
+                details.notes.clear();
+                readString(&details.notes);
+            } else if (keyIs("URLs")) {
+                details.URLs.clear();
+                scanURLs(details.URLs);
+            } else if (keyIs("password")) {
+                has_password = true;
+                password.clear();
+                readString(&password);
+            } else if (keyIs("fields")) {
+                fields.clear();
+                scanFields(fields);
+            } else if (keyIs("sections")) {
+                section_fields.clear();
+                scanSections(section_fields);
+            } else {
+                skipValue();
+            }
+        });
+        skipWhitespace();
+        if (cur != end)
+            throw NotHandled();
+
+        // Same order as itemDetailsFromJSON, whatever order the keys came in.
+        details.fields.clear();
+        if (has_password)
+            details.fields.push_back({"", "password", std::move(password), "P", true});
+        for (auto& field : fields)
+            details.fields.push_back(std::move(field));
+        for (auto& field : section_fields)
+            details.fields.push_back(std::move(field));
+    }
+
+private:
+    // A value's raw text, to be looked at again once the rest of its object is known.
+    struct Span {
+        const char* begin = nullptr;
+        const char* end = nullptr;
+    };
+
+    // A string member that's only used if it and its siblings turn out to be present.
+    struct StringMember {
+        bool present = false;
+        bool is_string = false;
+        std::string value;
+    };
+
+    void scanURLs(std::vector<std::string>& urls) {
+        if (peek() != '[')
+            throw NotHandled();
+        scanArray([&]() {
+            if (peek() != '{')
+                throw NotHandled();
+            StringMember url;
+            scanObject([&]() {
+                if (keyIs("url"))
+                    readMember(url);
+                else
+                    skipValue();
+            });
+            if (!url.present || !url.is_string)
+                throw NotHandled();
+            urls.push_back(std::move(url.value));
+        });
+    }
+
+    void scanFields(std::vector<ItemDetailsField>& fields) {
+        if (peek() != '[')
+            throw NotHandled();
+        scanArray([&]() {
+            if (peek() != '{') {
+                skipValue();
+                return;
+            }
+            StringMember designation, value, type;
+            scanObject([&]() {
+                if (keyIs("designation"))
+                    readMember(designation);
+                else if (keyIs("value"))
+                    readMember(value);
+                else if (keyIs("type"))
+                    readMember(type);
+                else
+                    skipValue();
+            });
+            if (!designation.present || !value.present || !type.present)
+                return;
+            if (!designation.is_string || !value.is_string || !type.is_string)
+                throw NotHandled();
+            const bool password = type.value == "P";
+            fields.push_back({"",
+                              std::move(designation.value),
+                              std::move(value.value),
+                              std::move(type.value),
+                              password});
+        });
+    }
+
+    void scanSections(std::vector<ItemDetailsField>& fields) {
+        if (peek() != '[')
+            throw NotHandled();
+        scanArray([&]() {
+            if (peek() != '{') {
+                skipValue();
+                return;
+            }
+            StringMember title;
+            bool has_fields = false;
+            std::vector<ItemDetailsField> section_fields;
+            scanObject([&]() {
+                if (keyIs("title")) {
+                    readMember(title);
+                } else if (keyIs("fields")) {
+                    has_fields = true;
+                    section_fields.clear();
+                    scanSectionFields(section_fields);
+                } else {
+                    skipValue();
+                }
+            });
+            if (!has_fields)
+                return;
+            if (title.present && !title.is_string)
+                throw NotHandled();
+            for (auto& field : section_fields) {
+                field.section = title.value;
+                fields.push_back(std::move(field));
+            }
+        });
+    }
+
+    void scanSectionFields(std::vector<ItemDetailsField>& fields) {
+        if (peek() != '[')
+            throw NotHandled();
+        scanArray([&]() {
+            if (peek() != '{') {
+                skipValue();
+                return;
+            }
+            StringMember kind, name;
+            bool has_value = false;
+            Span value;
+            scanObject([&]() {
+                if (keyIs("k")) {
+                    readMember(kind);
+                } else if (keyIs("t")) {
+                    readMember(name);
+                } else if (keyIs("v")) {
+                    has_value = true;
+                    value = captureValue();
+                } else {
+                    skipValue();
+                }
+            });
+            if (!kind.present || !name.present || !has_value)
+                return;
+            if (!kind.is_string || !name.is_string)
+                throw NotHandled();
+
+            std::string value_str;
+            ItemScanner value_scanner(value.begin, value.end - value.begin);
+            if (kind.value == "date") {
+                value_str = formatDate(static_cast<time_t>(value_scanner.readInteger()));
+            } else if (kind.value == "address") {
+                if (!value_scanner.readAddress(value_str))
+                    return;
+            } else if (kind.value == "monthYear") {
+                const auto month_year = value_scanner.readInteger();
+                if (month_year < INT_MIN || month_year > INT_MAX)
+                    throw NotHandled();
+                value_str = formatMonthYear(static_cast<int>(month_year));
+            } else {
+                value_scanner.readString(&value_str);
+            }
+            const bool password = kind.value == "concealed";
+            fields.push_back(
+                {"", std::move(name.value), std::move(value_str), std::move(kind.value), password});
+        });
+    }
+
+    // Returns false if the field should be left out because it has no street.
+    bool readAddress(std::string& out) {
+        if (peek() == 'n') {
+            skipValue();
+            return false;
+        }
+        if (peek() != '{')
+            throw NotHandled();
+        StringMember street, city, state, zip;
+        scanObject([&]() {
+            if (keyIs("street"))
+                readMember(street);
+            else if (keyIs("city"))
+                readMember(city);
+            else if (keyIs("state"))
+                readMember(state);
+            else if (keyIs("zip"))
+                readMember(zip);
+            else
+                skipValue();
+        });
+        if (!street.is_string)
+            return false;
+        if (!city.is_string || !state.is_string || !zip.is_string)
+            throw NotHandled();
+        out = formatAddress(street.value, city.value, state.value, zip.value);
+        return true;
+    }
+
+    // Only plain integers are handled; fractions and exponents go to the DOM.
+    long long readInteger() {
+        skipWhitespace();
+        const auto start = cur;
+        bool integer = false;
+        if (!skipNumber(integer) || !integer || cur - start > 20)
+            throw NotHandled();
+        char digits[24];
+        std::memcpy(digits, start, cur - start);
+        digits[cur - start] = '\0';
+        errno = 0;
+        const auto ret = std::strtoll(digits, nullptr, 10);
+        if (errno == ERANGE)
+            throw NotHandled();
+        return ret;
+    }
+
+    void readMember(StringMember& member) {
+        member.present = true;
+        member.is_string = peek() == '"';
+        member.value.clear();
+        if (member.is_string)
+            readString(&member.value);
+        else
+            skipValue();
+    }
+
+    Span captureValue() {
+        Span ret;
+        skipWhitespace();
+        ret.begin = cur;
+        skipValue();
+        ret.end = cur;
+        return ret;
+    }
+
+    template <size_t N>
+    bool keyIs(const char (&name)[N]) const {
+        return key.size() == N - 1 && std::memcmp(key.data(), name, N - 1) == 0;
+    }
+
+    void skipWhitespace() {
+        while (cur < end && (*cur == ' ' || *cur == '\n' || *cur == '\r' || *cur == '\t'))
+            ++cur;
+    }
+
+    char peek() {
+        skipWhitespace();
+        if (cur == end)
+            throw NotHandled();
+        return *cur;
+    }
+
+    void expect(char ch) {
+        if (peek() != ch)
+            throw NotHandled();
+        ++cur;
+    }
+
+    // Calls on_member with each key in key and cur on its value, which on_member must consume.
+    template <typename MemberFn>
+    void scanObject(MemberFn&& on_member) {
+        expect('{');
+        if (peek() == '}') {
+            ++cur;
+            return;
+        }
+        for (;;) {
+            key.clear();
+            readString(&key);
+            expect(':');
+            on_member();
+            if (peek() == ',') {
+                ++cur;
+                continue;
+            }
+            expect('}');
+            return;
+        }
+    }
+
+    template <typename ElementFn>
+    void scanArray(ElementFn&& on_element) {
+        expect('[');
+        if (peek() == ']') {
+            ++cur;
+            return;
+        }
+        for (;;) {
+            on_element();
+            if (peek() == ',') {
+                ++cur;
+                continue;
+            }
+            expect(']');
+            return;
+        }
+    }
+
+    // Reads a string, appending it to out with its escapes resolved, or just checks it if out
+    // is null.
+    void readString(std::string* out) {
+        expect('"');
+        for (;;) {
+            const auto start = cur;
+            while (cur < end && *cur != '"' && *cur != '\\' &&
+                   static_cast<unsigned char>(*cur) >= 0x20)
+                ++cur;
+            if (out)
+                out->append(start, cur);
+            if (cur == end || static_cast<unsigned char>(*cur) < 0x20)
+                throw NotHandled();
+            if (*cur++ == '"')
+                return;
+            if (cur == end)
+                throw NotHandled();
+            char escaped;
+            switch (*cur++) {
+                case '"':
+                    escaped = '"';
+                    break;
+                case '\\':
+                    escaped = '\\';
+                    break;
+                case '/':
+                    escaped = '/';
+                    break;
+                case 'b':
+                    escaped = '\b';
+                    break;
+                case 'f':
+                    escaped = '\f';
+                    break;
+                case 'n':
+                    escaped = '\n';
+                    break;
+                case 'r':
+                    escaped = '\r';
+                    break;
+                case 't':
+                    escaped = '\t';
+                    break;
+                case 'u':
+                    readUnicodeEscape(out);
+                    continue;
+                default:
+                    throw NotHandled();
+            }
+            if (out)
+                out->push_back(escaped);
+        }
+    }
+
+    unsigned int readHex4() {
+        if (end - cur < 4)
+            throw NotHandled();
+        unsigned int ret = 0;
+        for (int i = 0; i < 4; ++i) {
+            const char ch = *cur++;
+            ret <<= 4;
+            if (ch >= '0' && ch <= '9')
+                ret |= ch - '0';
+            else if (ch >= 'a' && ch <= 'f')
+                ret |= ch - 'a' + 10;
+            else if (ch >= 'A' && ch <= 'F')
+                ret |= ch - 'A' + 10;
+            else
+                throw NotHandled();
+        }
+        return ret;
+    }
+
+    // Anything unusual (NULs, unpaired surrogates) is left for the DOM parser to decide on.
+    void readUnicodeEscape(std::string* out) {
+        unsigned int codepoint = readHex4();
+        if (codepoint == 0 || (codepoint >= 0xDC00 && codepoint <= 0xDFFF))
+            throw NotHandled();
+        if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+            if (end - cur < 2 || cur[0] != '\\' || cur[1] != 'u')
+                throw NotHandled();
+            cur += 2;
+            const auto low = readHex4();
+            if (low < 0xDC00 || low > 0xDFFF)
+                throw NotHandled();
+            codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+        }
+        if (!out)
+            return;
+        if (codepoint < 0x80) {
+            out->push_back(static_cast<char>(codepoint));
+        } else if (codepoint < 0x800) {
+            out->push_back(static_cast<char>(0xC0 | (codepoint >> 6)));
+            out->push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+        } else if (codepoint < 0x10000) {
+            out->push_back(static_cast<char>(0xE0 | (codepoint >> 12)));
+            out->push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+            out->push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+        } else {
+            out->push_back(static_cast<char>(0xF0 | (codepoint >> 18)));
+            out->push_back(static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F)));
+            out->push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+            out->push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+        }
+    }
+
+    bool skipDigits() {
+        const auto start = cur;
+        while (cur < end && *cur >= '0' && *cur <= '9')
+            ++cur;
+        return cur != start;
+    }
+
+    // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?, and nothing else may follow directly.
+    bool skipNumber(bool& integer) {
+        integer = true;
+        if (cur < end && *cur == '-')
+            ++cur;
+        if (cur < end && *cur == '0')
+            ++cur;
+        else if (!skipDigits())
+            return false;
+        if (cur < end && *cur == '.') {
+            integer = false;
+            ++cur;
+            if (!skipDigits())
+                return false;
+        }
+        if (cur < end && (*cur == 'e' || *cur == 'E')) {
+            integer = false;
+            ++cur;
+            if (cur < end && (*cur == '+' || *cur == '-'))
+                ++cur;
+            if (!skipDigits())
+                return false;
+        }
+        return cur == end || *cur == ',' || *cur == '}' || *cur == ']' || *cur == ' ' ||
+            *cur == '\n' || *cur == '\r' || *cur == '\t';
+    }
+
+    template <size_t N>
+    void skipLiteral(const char (&literal)[N]) {
+        if (static_cast<size_t>(end - cur) < N - 1 || std::memcmp(cur, literal, N - 1) != 0)
+            throw NotHandled();
+        cur += N - 1;
+    }
+
+    void skipValue() {
+        // Anything nested this deep isn't an item; let the DOM parser deal with it.
+        if (++depth > kMaxDepth)
+            throw NotHandled();
+        const char ch = peek();
+        if (ch == '"') {
+            readString(nullptr);
+        } else if (ch == '{') {
+            scanObject([&]() { skipValue(); });
+        } else if (ch == '[') {
+            scanArray([&]() { skipValue(); });
+        } else if (ch == 't') {
+            skipLiteral("true");
+        } else if (ch == 'f') {
+            skipLiteral("false");
+        } else if (ch == 'n') {
+            skipLiteral("null");
+        } else {
+            bool integer;
+            if (!skipNumber(integer))
+                throw NotHandled();
+        }
+        --depth;
+    }
+
+    static const int kMaxDepth = 256;
+
+    const char* cur;
+    const char* end;
+    int depth = 0;
+    // The key of the member being read, reused from one member to the next.
+    std::string key;
+};
+}  // namespace
+
+ItemDetails itemDetailsFromJSON(const json& decrypted_item) {
+    ItemDetails item;
+    if (decrypted_item.find("notesPlain") != decrypted_item.end())
+        item.notes = decrypted_item["notesPlain"].get<std::string>();
+
+    if (decrypted_item.find("URLs") != decrypted_item.end()) {
+        for (auto url_obj : decrypted_item["URLs"]) {
+            item.URLs.push_back(url_obj["url"].get<std::string>());
+        }
+    }
+
+    if (decrypted_item.find("password") != decrypted_item.end()) {
+        std::string value_str = decrypted_item["password"];
+        item.fields.push_back({"", "password", value_str, "P", true});
+    }
+
+    auto fields = decrypted_item.find("fields");
+    if (fields != decrypted_item.end()) {
+        for (const auto& field : *fields) {
+            if (!hasAllKeys(field, "designation", "value", "type"))
+                continue;
+            auto typeStr = field["type"];
+            bool isPassword = typeStr == "P";
+            item.fields.push_back({"", field["designation"], field["value"], typeStr, isPassword});
+        }
+    }
+
+    auto sections = decrypted_item.find("sections");
+    if (sections != decrypted_item.end()) {
+        for (const auto& section : *sections) {
+            auto section_fields = section.find("fields");
+            if (section_fields == section.end()) {
+                continue;
+            }
+
+            std::string section_title;
+            if (section.find("title") != section.end())
+                section_title = section["title"];
+
+            for (const auto& field : *section_fields) {
+                if (!hasAllKeys(field, "k", "t", "v"))
+                    continue;
+                std::string typeStr = field["k"];
+                std::string nameStr = field["t"];
+                auto value = field["v"];
+                std::string valueStr;
+                bool isPassword = typeStr == "concealed";
+
+                if (typeStr == "date") {
+                    valueStr = formatDate(static_cast<time_t>(value));
+                } else if (typeStr == "address") {
+                    if (!value["street"].is_string())
+                        continue;
+
+                    valueStr = formatAddress(value["street"].get<std::string>(),
+                                             value["city"].get<std::string>(),
+                                             value["state"].get<std::string>(),
+                                             value["zip"].get<std::string>());
+                } else if (typeStr == "monthYear") {
+                    valueStr = formatMonthYear(value.get<int>());
+                } else {
+                    valueStr = value;
+                }
+
+                item.fields.push_back({section_title, nameStr, valueStr, typeStr, isPassword});
+            }
+        }
+    }
+    return item;
+}
+
+bool scanItemDetails(const char* data, size_t size, ItemDetails& details) {
+    try {
+        ItemScanner(data, size).scan(details);
+        return true;
+    } catch (NotHandled&) {
+        return false;
+    }
+}
+
+ItemDetails parseItemDetails(const char* data, size_t size) {
+    ItemDetails details;
+    if (scanItemDetails(data, size, details))
+        return details;
+    return itemDetailsFromJSON(json::parse(data, data + size));
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+// for convenience
+using json = nlohmann::json;
+
+struct ItemDetailsField {
+    std::string section;
+    std::string name;
+    std::string value;
+    std::string type;
+    bool password;
+
+    bool operator==(const ItemDetailsField& other) const {
+        return section == other.section && name == other.name && value == other.value &&
+            type == other.type && password == other.password;
+    }
+};
+
+// The decrypted contents of an item (notes, URLs and fields), with the fields in the order
+// they're shown. All the vault formats store these the same way.
+struct ItemDetails {
+    std::string notes;
+    std::vector<std::string> URLs;
+    std::vector<ItemDetailsField> fields;
+
+    bool operator==(const ItemDetails& other) const {
+        return notes == other.notes && URLs == other.URLs && fields == other.fields;
+    }
+};
+
+// Reads the details out of a parsed item. Throws if a field it needs has the wrong type.
+ItemDetails itemDetailsFromJSON(const json& decrypted_item);
+
+// Reads the details straight out of an item's decrypted JSON text in one pass, without building
+// a DOM. Only the shapes 1Password actually writes are handled; for anything else, including
+// JSON that doesn't parse, this returns false and the text should go through json::parse and
+// itemDetailsFromJSON instead. Whatever it does accept comes out exactly as
+// itemDetailsFromJSON would have it, and a field that itemDetailsFromJSON couldn't format
+// throws here too.
+bool scanItemDetails(const char* data, size_t size, ItemDetails& details);
+
+// scanItemDetails, falling back to the DOM when it has to.
+ItemDetails parseItemDetails(const char* data, size_t size);
@@ -0,0 +1,213 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "item_file.h"
+#include "json.hpp"
+
+namespace {
+class FileDescriptor {
+public:
+    explicit FileDescriptor(int _fd) : fd(_fd) {}
+    ~FileDescriptor() {
+        if (fd >= 0)
+            ::close(fd);
+    }
+    int fd;
+};
+
+class EnvelopeScanner {
+public:
+    EnvelopeScanner(const char* data, size_t size) : cur(data), end(data + size) {}
+
+    ItemEnvelope scan() {
+        ItemEnvelope envelope;
+        std::string nested_level;
+        scanObject([&](const char* key, size_t key_size) {
+            const char* value;
+            size_t value_size;
+            bool escaped;
+            if (keyIs(key, key_size, "encrypted") && readString(value, value_size, escaped)) {
+                envelope.encrypted = value;
+                envelope.encryptedSize = value_size;
+            } else if (keyIs(key, key_size, "securityLevel")) {
+                envelope.securityLevel = readStringValue();
+            } else if (keyIs(key, key_size, "title")) {
+                envelope.title = readStringValue();
+            } else if (keyIs(key, key_size, "openContents") && peek() == '{') {
+                scanObject([&](const char* nested_key, size_t nested_key_size) {
+                    if (keyIs(nested_key, nested_key_size, "securityLevel"))
+                        nested_level = readStringValue();
+                    else
+                        skipValue();
+                });
+            } else {
+                skipValue();
+            }
+        });
+
+        if (envelope.securityLevel.empty())
+            envelope.securityLevel = std::move(nested_level);
+        return envelope;
+    }
+
+private:
+    template <size_t N>
+    static bool keyIs(const char* key, size_t key_size, const char (&name)[N]) {
+        return key_size == N - 1 && std::memcmp(key, name, N - 1) == 0;
+    }
+
+    [[noreturn]] void fail() {
+        throw std::runtime_error("Malformed item file");
+    }
+
+    void skipWhitespace() {
+        while (cur < end && (*cur == ' ' || *cur == '\n' || *cur == '\r' || *cur == '\t'))
+            ++cur;
+    }
+
+    char peek() {
+        skipWhitespace();
+        if (cur == end)
+            fail();
+        return *cur;
+    }
+
+    void expect(char ch) {
+        if (peek() != ch)
+            fail();
+        ++cur;
+    }
+
+    // Reads a string token without unescaping it. Returns false, without consuming anything, if
+    // the next value isn't a string.
+    bool readString(const char*& value, size_t& value_size, bool& escaped) {
+        if (peek() != '"')
+            return false;
+        value = ++cur;
+        escaped = false;
+        while (cur < end && *cur != '"') {
+            if (*cur == '\\') {
+                escaped = true;
+                ++cur;
+            }
+            ++cur;
+        }
+        if (cur >= end)
+            fail();
+        value_size = cur - value;
+        ++cur;
+        return true;
+    }
+
+    // Reads a string value, resolving escapes. Non-string values are skipped and come back empty.
+    std::string readStringValue() {
+        const char* value;
+        size_t value_size;
+        bool escaped;
+        if (!readString(value, value_size, escaped)) {
+            skipValue();
+            return std::string();
+        }
+        if (!escaped)
+            return std::string(value, value_size);
+        return nlohmann::json::parse(value - 1, value + value_size + 1).get<std::string>();
+    }
+
+    template <typename KeyFn>
+    void scanObject(KeyFn&& on_key) {
+        expect('{');
+        if (peek() == '}') {
+            ++cur;
+            return;
+        }
+        for (;;) {
+            const char* key;
+            size_t key_size;
+            bool escaped;
+            if (!readString(key, key_size, escaped))
+                fail();
+            expect(':');
+            on_key(key, key_size);
+            if (peek() == ',') {
+                ++cur;
+                continue;
+            }
+            expect('}');
+            return;
+        }
+    }
+
+    void skipValue() {
+        const char ch = peek();
+        if (ch == '"') {
+            const char* value;
+            size_t value_size;
+            bool escaped;
+            readString(value, value_size, escaped);
+            return;
+        }
+        if (ch == '{' || ch == '[') {
+            int depth = 0;
+            while (cur < end) {
+                const char c = *cur;
+                if (c == '"') {
+                    const char* value;
+                    size_t value_size;
+                    bool escaped;
+                    readString(value, value_size, escaped);
+                    continue;
+                }
+                ++cur;
+                if (c == '{' || c == '[') {
+                    ++depth;
+                } else if (c == '}' || c == ']') {
+                    if (--depth == 0)
+                        return;
+                }
+            }
+            fail();
+        }
+        // Numbers, true, false and null run until the next delimiter.
+        while (cur < end && *cur != ',' && *cur != '}' && *cur != ']')
+            ++cur;
+    }
+
+    const char* cur;
+    const char* end;
+};
+}  // namespace
+
+ItemFile::ItemFile(const std::string& path) {
+    FileDescriptor file(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (file.fd < 0)
+        throw std::runtime_error("Cannot load item file");
+
+    struct stat st;
+    if (::fstat(file.fd, &st) != 0)
+        throw std::runtime_error("Cannot load item file");
+    file_size = st.st_size;
+
+    buffer.resize(file_size);
+    size_t read_size = 0;
+    while (read_size < file_size) {
+        auto res = ::pread(file.fd, buffer.data() + read_size, file_size - read_size, read_size);
+        if (res < 0 && errno == EINTR)
+            continue;
+        // Coming up short means the file was truncated since the fstat, most likely by a sync
+        // that is still writing it. The refresh after the sync picks up the finished file.
+        if (res == 0)
+            throw std::runtime_error("Item file changed while it was being read");
+        if (res < 0)
+            throw std::runtime_error("Error reading item file");
+        read_size += res;
+    }
+    file_data = buffer.data();
+}
+
+ItemEnvelope parseItemEnvelope(const char* data, size_t size) {
+    return EnvelopeScanner(data, size).scan();
+}
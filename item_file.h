@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// A read-only view of the raw bytes of a .1password file, read into memory with pread. Files
+// aren't mapped: a sync client truncating one mid-read would turn into SIGBUS, where a read just
+// comes up short.
+class ItemFile {
+public:
+    explicit ItemFile(const std::string& path);
+
+    ItemFile(const ItemFile&) = delete;
+    ItemFile& operator=(const ItemFile&) = delete;
+
+    const char* data() const {
+        return file_data;
+    }
+
+    size_t size() const {
+        return file_size;
+    }
+
+private:
+    const char* file_data = nullptr;
+    size_t file_size = 0;
+    std::vector<char> buffer;
+};
+
+// The parts of an item file's outer JSON object that are needed to decrypt it. encrypted
+// points straight into the file and still has its JSON escapes (1Password writes "/" as "\/");
+// the base64 decoder skips over them.
+struct ItemEnvelope {
+    const char* encrypted = nullptr;
+    size_t encryptedSize = 0;
+    std::string securityLevel;
+    std::string title;
+};
+
+// Scans the top level of an item file (and its openContents object) for the envelope fields
+// without building a DOM of the whole thing. Throws std::runtime_error on malformed input.
+ItemEnvelope parseItemEnvelope(const char* data, size_t size);
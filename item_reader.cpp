@@ -0,0 +1,494 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "item_reader.h"
+#include "parallel_for.h"
+
+namespace {
+// Network filesystems reward having lots of requests in flight; these threads spend nearly all
+// their time waiting.
+const size_t kIoThreads = 32;
+
+int readWholeFile(const std::string& path,
+                  std::chrono::microseconds latency,
+                  std::vector<char>& data) {
+    if (latency.count() > 0)
+        std::this_thread::sleep_for(latency);
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+
+    int error = 0;
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        error = errno;
+    } else {
+        data.resize(st.st_size);
+        size_t read_size = 0;
+        while (read_size < data.size()) {
+            auto res = ::pread(fd, data.data() + read_size, data.size() - read_size, read_size);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0) {
+                error = res < 0 ? errno : EIO;
+                break;
+            }
+            read_size += res;
+        }
+    }
+    ::close(fd);
+    return error;
+}
+}  // namespace
+
+#ifdef HAVE_IO_URING
+// A minimal io_uring submission/completion ring, driven through the raw syscalls so there's no
+// dependency on liburing.
+class ItemBatchReader::Ring {
+public:
+    // Returns null if io_uring, or any of the operations the reader needs, isn't available.
+    static std::unique_ptr<Ring> create(unsigned int entries) {
+        std::unique_ptr<Ring> ring(new Ring());
+        if (!ring->setup(entries) || !ring->supportsReaderOps())
+            return nullptr;
+        return ring;
+    }
+
+    ~Ring() {
+        if (sqes)
+            ::munmap(sqes, sqes_size);
+        if (cq_ptr && cq_ptr != sq_ptr)
+            ::munmap(cq_ptr, cq_size);
+        if (sq_ptr)
+            ::munmap(sq_ptr, sq_size);
+        if (ring_fd >= 0)
+            ::close(ring_fd);
+    }
+
+    unsigned int entries() const {
+        return sq_entries;
+    }
+
+    // Returns a zeroed submission entry, or null if the submission queue is full.
+    io_uring_sqe* nextSqe() {
+        const auto head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (local_tail - head >= sq_entries)
+            return nullptr;
+        const auto index = local_tail & *sq_mask;
+        auto sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        ++local_tail;
+        return sqe;
+    }
+
+    // Submits everything queued by nextSqe and blocks until at least one completion is ready.
+    // Returns false, with errno set, if the kernel won't take the submissions or won't wait.
+    bool submitAndWait() {
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        const bool fail = calls_until_failure != SIZE_MAX && calls_until_failure-- == 0;
+        for (;;) {
+            // The kernel can take fewer entries than it's offered. The rest stay queued after its
+            // head, so each call offers whatever's still there.
+            const auto to_submit = local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            auto res = ::syscall(__NR_io_uring_enter, ring_fd, to_submit, 1,
+                                 IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res < 0) {
+                // A full completion queue is emptied by reaping it.
+                return (errno == EBUSY || errno == EAGAIN) && completionsReady();
+            }
+            if (static_cast<unsigned int>(res) == to_submit)
+                break;
+            // It only waits once everything has been taken, so keep going while that's making
+            // progress.
+            if (res == 0) {
+                if (completionsReady())
+                    return true;
+                errno = EAGAIN;
+                return false;
+            }
+        }
+        if (fail) {
+            errno = EIO;
+            return false;
+        }
+        return true;
+    }
+
+    // Blocks until at least one completion is ready without submitting anything.
+    bool waitForCompletion() {
+        while (!completionsReady()) {
+            auto res = ::syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS,
+                                 nullptr, 0);
+            if (res < 0 && errno != EINTR)
+                return false;
+        }
+        return true;
+    }
+
+    // Takes back everything queued that the kernel hasn't taken yet, and returns how many
+    // entries that was.
+    unsigned int discardUnsubmitted() {
+        const auto head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        const auto count = local_tail - head;
+        local_tail = head;
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // Makes submitAndWait fail, after handing its entries to the kernel, once it has been called
+    // this many more times.
+    void simulateFailureAfter(size_t calls) {
+        calls_until_failure = calls;
+    }
+
+    template <typename Fn>
+    size_t reap(Fn&& on_completion) {
+        auto head = *cq_head;
+        const auto tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        size_t count = 0;
+        for (; head != tail; ++head, ++count) {
+            const auto& cqe = cqes[head & *cq_mask];
+            on_completion(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+private:
+    Ring() = default;
+
+    bool completionsReady() const {
+        return __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) != *cq_head;
+    }
+
+    bool setup(unsigned int entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring_fd = ::syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0)
+            return false;
+
+        sq_entries = params.sq_entries;
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+
+        sq_ptr = mapRing(sq_size, IORING_OFF_SQ_RING);
+        if (!sq_ptr)
+            return false;
+        cq_ptr = single_mmap ? sq_ptr : mapRing(cq_size, IORING_OFF_CQ_RING);
+        if (!cq_ptr)
+            return false;
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mapRing(sqes_size, IORING_OFF_SQES));
+        if (!sqes)
+            return false;
+
+        auto sq_base = static_cast<char*>(sq_ptr);
+        sq_head = reinterpret_cast<unsigned int*>(sq_base + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned int*>(sq_base + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned int*>(sq_base + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned int*>(sq_base + params.sq_off.array);
+        local_tail = *sq_tail;
+
+        auto cq_base = static_cast<char*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned int*>(cq_base + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned int*>(cq_base + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned int*>(cq_base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq_base + params.cq_off.cqes);
+        return true;
+    }
+
+    void* mapRing(size_t size, off_t offset) {
+        auto ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd, offset);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    }
+
+    bool supportsReaderOps() {
+        const size_t ops_count = 256;
+        std::vector<char> buffer(sizeof(io_uring_probe) + ops_count * sizeof(io_uring_probe_op));
+        auto probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+        if (::syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, ops_count) <
+            0)
+            return false;
+
+        for (auto op : {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE,
+                        IORING_OP_TIMEOUT}) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                return false;
+        }
+        return true;
+    }
+
+    int ring_fd = -1;
+    unsigned int sq_entries = 0;
+    void* sq_ptr = nullptr;
+    size_t sq_size = 0;
+    void* cq_ptr = nullptr;
+    size_t cq_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned int* sq_head = nullptr;
+    unsigned int* sq_tail = nullptr;
+    unsigned int* sq_mask = nullptr;
+    unsigned int* sq_array = nullptr;
+    unsigned int local_tail = 0;
+    unsigned int* cq_head = nullptr;
+    unsigned int* cq_tail = nullptr;
+    unsigned int* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    size_t calls_until_failure = SIZE_MAX;
+};
+
+namespace {
+const unsigned int kRingEntries = 1024;
+// Each file takes up to two submissions in one round (timeout, open).
+const size_t kRingBatchSize = kRingEntries / 4;
+
+// The low bits of each submission's user_data say what kind of operation it was, the rest is
+// the index of the file within the batch.
+enum RingOp : uint64_t { kOpOpen = 0, kOpStat = 1, kOpRead = 2, kOpClose = 3, kOpTimeout = 4 };
+const int kOpBits = 3;
+
+uint64_t ringUserData(size_t index, RingOp op) {
+    return (static_cast<uint64_t>(index) << kOpBits) | op;
+}
+}  // namespace
+
+std::vector<ItemBuffer> ItemBatchReader::readWithRing(const std::vector<std::string>& paths) {
+    std::vector<ItemBuffer> buffers(paths.size());
+    std::vector<int> fds;
+    std::vector<struct statx> stats;
+    std::vector<size_t> short_reads;
+    __kernel_timespec latency_ts;
+    latency_ts.tv_sec = simulated_latency.count() / 1000000;
+    latency_ts.tv_nsec = (simulated_latency.count() % 1000000) * 1000;
+
+    size_t start = 0;
+    size_t outstanding = 0;
+    auto on_done = [&](uint64_t user_data, int res) {
+        const size_t index = user_data >> kOpBits;
+        auto& buffer = buffers[start + index];
+        switch (user_data & ((1 << kOpBits) - 1)) {
+            case kOpOpen:
+                if (res >= 0)
+                    fds[index] = res;
+                else if (!buffer.error)
+                    buffer.error = -res;
+                break;
+            case kOpStat:
+                if (res < 0 && !buffer.error)
+                    buffer.error = -res;
+                break;
+            case kOpRead:
+                if (res < 0)
+                    buffer.error = -res;
+                else if (static_cast<size_t>(res) < buffer.data.size())
+                    short_reads.push_back(index);
+                break;
+            case kOpClose:
+                // Even a close that fails gives the descriptor up.
+                fds[index] = -1;
+                break;
+        }
+    };
+    // Returns a free submission entry, first waiting for some of what's in flight to finish if
+    // the ring is full or the completion queue could be.
+    auto queue = [&]() {
+        io_uring_sqe* sqe;
+        while (outstanding >= ring->entries() || !(sqe = ring->nextSqe())) {
+            if (!ring->submitAndWait())
+                throw std::runtime_error("Error submitting to io_uring");
+            outstanding -= ring->reap(on_done);
+        }
+        ++outstanding;
+        return sqe;
+    };
+    auto drain = [&]() {
+        while (outstanding > 0) {
+            if (!ring->submitAndWait())
+                throw std::runtime_error("Error waiting for io_uring completions");
+            outstanding -= ring->reap(on_done);
+        }
+    };
+
+    for (; start < paths.size(); start += kRingBatchSize) {
+        const size_t count = std::min(kRingBatchSize, paths.size() - start);
+        fds.assign(count, -1);
+        stats.assign(count, {});
+        short_reads.clear();
+
+        try {
+            // First round: open every file.
+            for (size_t index = 0; index < count; ++index) {
+                const auto& path = paths[start + index];
+                if (simulated_latency.count() > 0) {
+                    // A hard link makes the open wait for the timer even though the timer
+                    // "fails" with ETIME.
+                    auto sqe = queue();
+                    sqe->opcode = IORING_OP_TIMEOUT;
+                    sqe->fd = -1;
+                    sqe->addr = reinterpret_cast<uint64_t>(&latency_ts);
+                    sqe->len = 1;
+                    sqe->flags = IOSQE_IO_HARDLINK;
+                    sqe->user_data = ringUserData(index, kOpTimeout);
+                }
+
+                auto sqe = queue();
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = reinterpret_cast<uint64_t>(path.c_str());
+                sqe->open_flags = O_RDONLY | O_CLOEXEC;
+                sqe->user_data = ringUserData(index, kOpOpen);
+            }
+            drain();
+
+            // Second round: stat the descriptors that opened rather than the paths, which a sync
+            // could have replaced in between.
+            for (size_t index = 0; index < count; ++index) {
+                if (fds[index] < 0)
+                    continue;
+                auto sqe = queue();
+                sqe->opcode = IORING_OP_STATX;
+                sqe->fd = fds[index];
+                sqe->addr = reinterpret_cast<uint64_t>("");
+                sqe->statx_flags = AT_EMPTY_PATH;
+                sqe->len = STATX_SIZE;
+                sqe->off = reinterpret_cast<uint64_t>(&stats[index]);
+                sqe->user_data = ringUserData(index, kOpStat);
+            }
+            drain();
+
+            // Third round: read every file that opened, in one go now that its size is known.
+            for (size_t index = 0; index < count; ++index) {
+                auto& buffer = buffers[start + index];
+                if (fds[index] < 0 || buffer.error)
+                    continue;
+                buffer.data.resize(stats[index].stx_size);
+                if (buffer.data.empty())
+                    continue;
+
+                auto sqe = queue();
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = fds[index];
+                sqe->addr = reinterpret_cast<uint64_t>(buffer.data.data());
+                sqe->len = buffer.data.size();
+                sqe->off = 0;
+                sqe->user_data = ringUserData(index, kOpRead);
+            }
+            drain();
+
+            // Last round: close everything that was opened.
+            for (size_t index = 0; index < count; ++index) {
+                if (fds[index] < 0)
+                    continue;
+                auto sqe = queue();
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = fds[index];
+                sqe->user_data = ringUserData(index, kOpClose);
+            }
+            drain();
+        } catch (std::exception&) {
+            // Whatever the kernel has already taken still points into this batch's paths and
+            // buffers, so it has to finish before they can go. If even waiting fails, tearing
+            // the ring down is the only way left to cancel it.
+            outstanding -= ring->discardUnsubmitted();
+            while (outstanding > 0 && ring->waitForCompletion())
+                outstanding -= ring->reap(on_done);
+            if (outstanding > 0)
+                ring.reset();
+            for (auto fd : fds) {
+                if (fd >= 0)
+                    ::close(fd);
+            }
+            throw;
+        }
+
+        // Reads can legitimately come back short; finish those the slow way.
+        for (auto index : short_reads) {
+            auto& buffer = buffers[start + index];
+            buffer.error = readWholeFile(paths[start + index], std::chrono::microseconds(0),
+                                         buffer.data);
+        }
+    }
+
+    return buffers;
+}
+#else
+class ItemBatchReader::Ring {
+public:
+    static std::unique_ptr<Ring> create(unsigned int) {
+        return nullptr;
+    }
+};
+
+std::vector<ItemBuffer> ItemBatchReader::readWithRing(const std::vector<std::string>& paths) {
+    return readWithThreads(paths);
+}
+#endif
+
+ItemBatchReader::ItemBatchReader(Backend preferred) {
+#ifdef HAVE_IO_URING
+    if (preferred == Backend::IoUring)
+        ring = Ring::create(kRingEntries);
+#endif
+}
+
+ItemBatchReader::~ItemBatchReader() = default;
+
+ItemBatchReader::Backend ItemBatchReader::backend() const {
+    return ring ? Backend::IoUring : Backend::ThreadPool;
+}
+
+std::vector<ItemBuffer> ItemBatchReader::read(const std::vector<std::string>& paths) {
+    if (ring) {
+        try {
+            return readWithRing(paths);
+        } catch (std::exception&) {
+            // A ring that has failed once can't be trusted with the next batch either, so
+            // everything from here on, this read included, goes through the threads.
+            ring.reset();
+        }
+    }
+    return readWithThreads(paths);
+}
+
+void ItemBatchReader::simulateRingFailure(size_t after_waits) {
+#ifdef HAVE_IO_URING
+    if (ring)
+        ring->simulateFailureAfter(after_waits);
+#endif
+}
+
+std::vector<ItemBuffer> ItemBatchReader::readWithThreads(const std::vector<std::string>& paths) {
+    std::vector<ItemBuffer> buffers(paths.size());
+    parallelFor(paths.size(),
+                [&](size_t index) {
+                    auto& buffer = buffers[index];
+                    buffer.error = readWholeFile(paths[index], simulated_latency, buffer.data);
+                },
+                kIoThreads);
+    return buffers;
+}
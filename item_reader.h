@@ -0,0 +1,51 @@
+#pragma once
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct ItemBuffer {
+    std::vector<char> data;
+    // The errno from opening or reading the file, or zero if it was read successfully.
+    int error = 0;
+};
+
+// Reads many small item files at once. Where the kernel supports it, opens, stats, reads and
+// closes are submitted in large batches through io_uring, so on a network or FUSE filesystem
+// the per-file round trips overlap instead of adding up. Otherwise a pool of threads does
+// plain opens and preads, which overlaps them as well, just less cheaply.
+class ItemBatchReader {
+public:
+    enum class Backend { IoUring, ThreadPool };
+
+    explicit ItemBatchReader(Backend preferred = Backend::IoUring);
+    ~ItemBatchReader();
+
+    ItemBatchReader(const ItemBatchReader&) = delete;
+    ItemBatchReader& operator=(const ItemBatchReader&) = delete;
+
+    // Returns one buffer per path, in the same order. Not safe to call from several threads
+    // at once on the same reader.
+    std::vector<ItemBuffer> read(const std::vector<std::string>& paths);
+
+    Backend backend() const;
+
+    // Delays every file open by this much, to benchmark slow filesystems on a fast one.
+    void setSimulatedLatency(std::chrono::microseconds latency) {
+        simulated_latency = latency;
+    }
+
+    // Makes the io_uring backend fail partway through a read, after it has waited for
+    // completions this many times, to test that the reader cleans up and carries on with
+    // threads.
+    void simulateRingFailure(size_t after_waits);
+
+private:
+    class Ring;
+
+    std::vector<ItemBuffer> readWithThreads(const std::vector<std::string>& paths);
+    std::vector<ItemBuffer> readWithRing(const std::vector<std::string>& paths);
+
+    std::unique_ptr<Ring> ring;
+    std::chrono::microseconds simulated_latency{0};
+};
@@ -1,8 +1,13 @@
 #pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
 #include <gtkmm.h>
 
 #include "helper.h"
 #include "keychain.h"
+#include "totp_clock.h"
 
 class ItemView : public Gtk::Grid {
 public:
@@ -14,8 +19,8 @@ public:
 
         if (data.sections.size() > 0) {
             for (const auto& section : data.sections) {
-                attachSectionTitle(section.first);
-                for (const auto& field : section.second) {
+                attachSectionTitle(section.title);
+                for (const auto& field : section.fields) {
                     processSingleField(field);
                 }
             }
@@ -24,7 +29,7 @@ public:
         if (!data.notes.empty()) {
             attachSectionTitle("Notes");
             auto notes_buffer = Gtk::TextBuffer::create();
-            notes_buffer->set_text(data.notes);
+            notes_buffer->set_text(data.notes.str());
 
             auto notes_field = Gtk::manage(new Gtk::TextView(notes_buffer));
             notes_field->set_hexpand(true);
@@ -36,27 +41,63 @@ public:
 
         if (data.URLs.size() > 0) {
             attachSectionTitle("URLs");
-            for (auto& url : data.URLs) {
-                auto url_button = Gtk::manage(new Gtk::LinkButton(url, url));
+            for (const auto& url : data.URLs) {
+                auto url_button = Gtk::manage(new Gtk::LinkButton(url.str(), url.str()));
                 attach(*url_button, 0, row_index++, 4, 1);
             }
         }
 
         show_all_children();
     }
-    virtual ~ItemView() {}
+    virtual ~ItemView() {
+        stopClock();
+    }
 
 protected:
+    // TOTP codes only tick over while they can be seen.
+    void on_map() override {
+        Gtk::Grid::on_map();
+        if (!totp_rows.empty() && clock_id == 0)
+            clock_id = TOTPClock::get().add([this](time_t now) { updateCodes(now); });
+    }
+
+    void on_unmap() override {
+        stopClock();
+        Gtk::Grid::on_unmap();
+    }
+
+    void stopClock() {
+        if (clock_id != 0)
+            TOTPClock::get().remove(clock_id);
+        clock_id = 0;
+    }
+
+    void updateCodes(time_t now) {
+        char code[TOTPDescriptor::kMaxDigits + 1];
+        for (auto& row : totp_rows) {
+            const auto counter = row.totp.counter(now);
+            if (counter != row.counter) {
+                row.counter = counter;
+                try {
+                    row.totp.code(now, code);
+                    row.code->set_text(code);
+                } catch (std::exception& e) {
+                    // This comes round every period, so a dialog would keep coming back.
+                    row.code->set_text(e.what());
+                }
+            }
+            row.countdown->set_text(std::to_string(row.totp.secondsRemaining(now)) + "s");
+        }
+    }
+
     void attachSectionTitle(std::string label) {
         auto label_widget = Gtk::manage(new Gtk::Label(label));
         attach(*label_widget, 0, row_index++, 4, 1);
     }
 
     void processSingleField(const KeychainField& field) {
-        processSingleField(field.name, field.value, field.password);
-    }
-
-    void processSingleField(std::string label, std::string value, bool conceal) {
+        const std::string label = field.name.str();
+        const bool conceal = field.password;
         auto my_index = row_index++;
 
         auto label_widget = Gtk::manage(new Gtk::Label(label));
@@ -68,20 +109,33 @@ protected:
         value_widget->set_hexpand(true);
         value_widget->set_editable(false);
 
-        const auto isTOTP = isTOTPURI(value);
-        if (isTOTP) {
+        const auto isTOTP = field.otp;
+        const bool live_code = isTOTP && field.totp;
+        if (live_code) {
+            // The clock fills in the code, and keeps it current, once the view is on screen.
+            totp_rows.push_back({*field.totp, value_widget, nullptr, UINT64_MAX});
+        } else if (isTOTP) {
+            // A URI that couldn't be parsed when the item loaded is parsed again here, just so
+            // there's an error to show.
             try {
-                value_widget->set_text(calculateTOTP(value));
+                value_widget->set_text(calculateTOTP(field.value.str()));
             } catch (std::exception& e) {
                 errorDialog(e.what());
             }
         } else {
-            value_widget->set_text(value);
+            value_widget->set_text(field.value.str());
         }
 
         if (conceal && !isTOTP)
             value_widget->set_visibility(false);
-        attach(*value_widget, 1, my_index, conceal ? 1 : 3, 1);
+        attach(*value_widget, 1, my_index, conceal ? 1 : (live_code ? 2 : 3), 1);
+
+        if (live_code) {
+            auto countdown_widget = Gtk::manage(new Gtk::Label());
+            countdown_widget->set_width_chars(4);
+            attach(*countdown_widget, 3, my_index, 1, 1);
+            totp_rows.back().countdown = countdown_widget;
+        }
 
         if (conceal) {
             auto copy_button = Gtk::manage(new Gtk::Button("_Copy", true));
@@ -92,17 +146,7 @@ protected:
                 clipboard->store();
             });
             attach(*copy_button, 2, my_index, 1, 1);
-            if (isTOTP) {
-                auto calculate_button = Gtk::manage(new Gtk::Button("_Calculate", true));
-                calculate_button->signal_clicked().connect([value, value_widget]() {
-                    try {
-                        value_widget->set_text(calculateTOTP(value));
-                    } catch (std::exception& e) {
-                        errorDialog(e.what());
-                    }
-                });
-                attach(*calculate_button, 3, my_index, 1, 1);
-            } else {
+            if (!isTOTP) {
                 auto reveal_button = Gtk::manage(new Gtk::Button("_Reveal", true));
                 reveal_button->signal_clicked().connect([reveal_button, value_widget]() {
                     bool visible = value_widget->get_visibility();
@@ -112,8 +156,32 @@ protected:
                     reveal_button->set_label(visible ? "_Hide" : "_Reveal");
                 });
                 attach(*reveal_button, 3, my_index, 1, 1);
+            } else if (!live_code) {
+                auto calculate_button = Gtk::manage(new Gtk::Button("_Calculate", true));
+                const auto uri = field.value.str();
+                calculate_button->signal_clicked().connect([uri, value_widget]() {
+                    try {
+                        value_widget->set_text(calculateTOTP(uri));
+                    } catch (std::exception& e) {
+                        errorDialog(e.what());
+                    }
+                });
+                attach(*calculate_button, 3, my_index, 1, 1);
             }
         }
     }
+
+    // A TOTP field whose code is kept up to date by the clock.
+    struct TOTPRow {
+        // A copy, since the view can outlive the item's arena.
+        TOTPDescriptor totp;
+        Gtk::Entry* code;
+        Gtk::Label* countdown;
+        // The period the code shown is for; it's only worked out again when this changes.
+        uint64_t counter;
+    };
+
     int row_index = 0;
+    std::vector<TOTPRow> totp_rows;
+    unsigned int clock_id = 0;
 };
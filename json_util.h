@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+// Whether get<T>() would make sense of value, rather than throw or make something up.
+template <typename T>
+bool holds(const json& value);
+template <>
+inline bool holds<std::string>(const json& value) {
+    return value.is_string();
+}
+template <>
+inline bool holds<int64_t>(const json& value) {
+    return value.is_number();
+}
+template <>
+inline bool holds<bool>(const json& value) {
+    return value.is_boolean();
+}
+
+// A field that's missing, or of the wrong type, gets fallback, so one odd record in an
+// export or a vault can't stop the rest from loading.
+template <typename T>
+T valueOr(const json& object, const char* key, T fallback) {
+    auto it = object.find(key);
+    if (it == object.end() || !holds<T>(*it))
+        return fallback;
+    return it->get<T>();
+}
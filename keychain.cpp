@@ -1,86 +1,83 @@
 #include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <fstream>
-#include <glibmm.h>
-#include <openssl/bio.h>
-#include <openssl/buffer.h>
-#include <openssl/md5.h>
+#include <future>
+#include <openssl/crypto.h>
 #include <random>
 #include <sstream>
+#include <sys/stat.h>
 #include <vector>
 
+#include "base64.h"
+#include "crypto_registry.h"
 #include "evp_cipher.h"
-#include "helper.h"
+#include "item_details.h"
+#include "item_file.h"
+#include "item_reader.h"
 #include "keychain.h"
+#include "onepif.h"
+#include "opvault.h"
+#include "parallel_for.h"
+#include "thread_local_pool.h"
 
 namespace {
 using OpensslKeyData = std::pair<EVPKey, EVPIv>;
 using SaltData = std::array<uint8_t, 8>;
-
-OpensslKeyData opensslKey(const std::vector<uint8_t>& password, const SaltData& salt) {
-    MD5_CTX ctx;
+// Decryption buffers and contexts for one-off decrypts, kept per thread between items.
+using DecryptScratchPool = ThreadLocalPool<DecryptScratch>;
+
+// OpenSSL's EVP_BytesToKey with MD5 and one round, for a master key whose digest prefix has
+// already absorbed password.
+OpensslKeyData opensslKey(const DigestContext& password_digest,
+                          const std::vector<uint8_t>& password,
+                          const SaltData& salt) {
+    thread_local DigestContext ctx;
+    uint8_t digest[EVP_MAX_MD_SIZE];
     EVPKey keyOut;
     EVPIv ivOut;
     keyOut.fill(0);
     ivOut.fill(0);
 
     // Initial digest is password + salt;
-    MD5_Init(&ctx);
-    MD5_Update(&ctx, password.data(), password.size());
-    MD5_Update(&ctx, salt.data(), salt.size());
-    MD5_Final(keyOut.data(), &ctx);
-
-    MD5_Init(&ctx);
-    MD5_Update(&ctx, keyOut.data(), 16);
-    MD5_Update(&ctx, password.data(), password.size());
-    MD5_Update(&ctx, salt.data(), salt.size());
-    MD5_Final(ivOut.data(), &ctx);
+    ctx.initFrom(password_digest);
+    ctx.update(salt.data(), salt.size());
+    ctx.final(digest);
+    std::copy_n(digest, 16, keyOut.begin());
+
+    ctx.init(cryptoRegistry().md5);
+    ctx.update(keyOut.data(), 16);
+    ctx.update(password.data(), password.size());
+    ctx.update(salt.data(), salt.size());
+    ctx.final(digest);
+    std::copy_n(digest, 16, ivOut.begin());
+    OPENSSL_cleanse(digest, sizeof(digest));
 
     return OpensslKeyData(std::move(keyOut), std::move(ivOut));
 }
 
-OpensslKeyData opensslKeyNoSalt(const std::vector<uint8_t>& password) {
-    MD5_CTX ctx;
+OpensslKeyData opensslKeyNoSalt(const DigestContext& password_digest) {
+    thread_local DigestContext ctx;
+    uint8_t digest[EVP_MAX_MD_SIZE];
     EVPKey keyOut;
     EVPIv ivOut;
+    keyOut.fill(0);
+    ivOut.fill(0);
 
-    MD5_Init(&ctx);
-    MD5_Update(&ctx, password.data(), password.size());
-    MD5_Final(keyOut.data(), &ctx);
+    ctx.initFrom(password_digest);
+    ctx.final(digest);
+    std::copy_n(digest, 16, keyOut.begin());
+    OPENSSL_cleanse(digest, sizeof(digest));
 
     return OpensslKeyData(keyOut, ivOut);
 }
 
-std::vector<uint8_t> base64Decode(const std::string& data) {
-    std::vector<uint8_t> ret(data.size());
-
-    auto b64 = BIO_new(BIO_f_base64());
-#if defined(LIBRESSL_VERSION_NUMBER)
-    auto bmem = BIO_new_mem_buf((char*)data.c_str(), data.size());
-#else
-    auto bmem = BIO_new_mem_buf(data.c_str(), data.size());
-#endif
-    bmem = BIO_push(b64, bmem);
-    BIO_set_flags(bmem, BIO_FLAGS_BASE64_NO_NL);
-    int size = BIO_read(bmem, ret.data(), data.size());
-    BIO_free_all(bmem);
-
-    ret.resize(size);
-    return ret;
-}
-
-std::string base64Encode(std::vector<uint8_t>& data) {
-    auto b64 = BIO_push(BIO_new(BIO_f_base64()), BIO_new(BIO_s_mem()));
-    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-    BIO_write(b64, data.data(), data.size());
-    BIO_flush(b64);
-
-    BUF_MEM* bptr;
-    BIO_get_mem_ptr(b64, &bptr);
-
-    std::string ret(bptr->data, bptr->length);
-
-    BIO_free_all(b64);
-    return ret;
+// Overwrites str's characters before freeing them, so a password doesn't linger on the heap.
+void wipeString(std::string& str) {
+    if (!str.empty())
+        OPENSSL_cleanse(&str[0], str.size());
+    str.clear();
+    str.shrink_to_fit();
 }
 
 template <typename T>
@@ -97,10 +94,10 @@ std::array<uint8_t, 8> generateSalt() {
     static std::random_device engine;
 
     SaltData ret;
-    int cur_index = 0;
+    size_t cur_index = 0;
     while (cur_index < ret.size()) {
         auto cur_random = engine();
-        for (auto bits = (sizeof(cur_random) * 8) - 8; bits != 0; bits -= 8) {
+        for (size_t bits = 0; bits < sizeof(cur_random) * 8 && cur_index < ret.size(); bits += 8) {
             uint8_t byte = (cur_random >> bits) & 0xff;
             ret[cur_index++] = byte;
         }
@@ -108,43 +105,346 @@ std::array<uint8_t, 8> generateSalt() {
 
     return ret;
 }
+
+// Collects an item's decrypted data and then lays all of it out in a single arena allocation:
+// the sections, then the fields grouped by section, then the URLs, then the characters of
+// every string. otpauth:// URIs are parsed here too, and their descriptors go before the
+// sections.
+class ItemBuilder {
+public:
+    void setNotes(std::string _notes) {
+        notes = std::move(_notes);
+    }
+
+    void addURL(std::string url) {
+        urls.push_back(std::move(url));
+    }
+
+    void addDetails(ItemDetails details) {
+        setNotes(std::move(details.notes));
+        for (auto& url : details.URLs)
+            addURL(std::move(url));
+        for (auto& field : details.fields) {
+            addField(field.section,
+                     std::move(field.name),
+                     std::move(field.value),
+                     std::move(field.type),
+                     field.password);
+        }
+    }
+
+    void addField(const std::string& section_title,
+                  std::string name,
+                  std::string value,
+                  std::string type,
+                  bool password) {
+        auto section = std::find(section_titles.begin(), section_titles.end(), section_title);
+        if (section == section_titles.end())
+            section = section_titles.insert(section_titles.end(), section_title);
+        const bool otp = isTOTPURI(value);
+        if (otp) {
+            // A URI we can't use is still shown as one; the view reports why when it's asked
+            // for a code.
+            try {
+                totps.push_back({fields.size(), parseTOTPURI(value)});
+            } catch (const std::exception&) {
+            }
+        }
+        fields.push_back({static_cast<size_t>(section - section_titles.begin()),
+                          std::move(name),
+                          std::move(value),
+                          std::move(type),
+                          password,
+                          otp});
+    }
+
+    void finish(KeychainItem& item, const std::shared_ptr<ItemArena>& arena) const {
+        item.decrypted = true;
+        item.arena = arena;
+
+        size_t text_size = notes.size();
+        for (const auto& url : urls)
+            text_size += url.size();
+        for (const auto& title : section_titles)
+            text_size += title.size();
+        for (const auto& field : fields)
+            text_size += field.name.size() + field.value.size() + field.type.size();
+
+        const auto totps_size = ItemArena::alignUp(totps.size() * sizeof(TOTPDescriptor));
+        const auto sections_size = ItemArena::alignUp(section_titles.size() * sizeof(KeychainSection));
+        const auto fields_size = ItemArena::alignUp(fields.size() * sizeof(KeychainField));
+        const auto urls_size = ItemArena::alignUp(urls.size() * sizeof(ArenaString));
+        const auto total_size = totps_size + sections_size + fields_size + urls_size + text_size;
+        if (total_size == 0)
+            return;
+
+        item.arena_bytes = ItemArena::alignUp(total_size);
+        auto out_totps = static_cast<TOTPDescriptor*>(arena->allocate(total_size));
+        for (size_t index = 0; index < totps.size(); ++index)
+            out_totps[index] = totps[index].second;
+        auto base = reinterpret_cast<char*>(out_totps) + totps_size;
+        auto out_sections = reinterpret_cast<KeychainSection*>(base);
+        auto out_fields = reinterpret_cast<KeychainField*>(base + sections_size);
+        auto out_urls = reinterpret_cast<ArenaString*>(base + sections_size + fields_size);
+        auto text = base + sections_size + fields_size + urls_size;
+        auto copy = [&text](const std::string& str) {
+            std::memcpy(text, str.data(), str.size());
+            ArenaString ret(text, str.size());
+            text += str.size();
+            return ret;
+        };
+
+        item.notes = copy(notes);
+        for (size_t index = 0; index < urls.size(); ++index)
+            new (&out_urls[index]) ArenaString(copy(urls[index]));
+        item.URLs = ArenaArray<ArenaString>(out_urls, urls.size());
+
+        auto next_field = out_fields;
+        for (size_t section = 0; section < section_titles.size(); ++section) {
+            const auto first_field = next_field;
+            for (size_t index = 0; index < fields.size(); ++index) {
+                const auto& field = fields[index];
+                if (field.section != section)
+                    continue;
+                const TOTPDescriptor* totp = nullptr;
+                if (field.otp) {
+                    const auto found = std::find_if(
+                        totps.begin(), totps.end(), [index](const PendingTOTP& pending) {
+                            return pending.first == index;
+                        });
+                    if (found != totps.end())
+                        totp = &out_totps[found - totps.begin()];
+                }
+                new (next_field++) KeychainField{copy(field.name),
+                                                 copy(field.value),
+                                                 copy(field.type),
+                                                 field.password,
+                                                 field.otp,
+                                                 totp};
+            }
+            new (&out_sections[section]) KeychainSection{
+                copy(section_titles[section]),
+                ArenaArray<KeychainField>(first_field, next_field - first_field)};
+        }
+        item.sections = ArenaArray<KeychainSection>(out_sections, section_titles.size());
+    }
+
+private:
+    struct PendingField {
+        size_t section;
+        std::string name;
+        std::string value;
+        std::string type;
+        bool password;
+        bool otp;
+    };
+    // The index of the field and its parsed URI. Kept apart from the fields since so few have
+    // one.
+    using PendingTOTP = std::pair<size_t, TOTPDescriptor>;
+
+    std::string notes;
+    std::vector<std::string> urls;
+    std::vector<std::string> section_titles;
+    std::vector<PendingField> fields;
+    std::vector<PendingTOTP> totps;
+};
+
+KeychainIndexEntry parseIndexEntry(const json& contents_item) {
+    // Each entry is [uuid, typeName, title, location, updatedAt, folderUuid, strength, trashed]
+    if (!contents_item.is_array() || contents_item.size() < 3 || !contents_item[0].is_string())
+        throw std::runtime_error("Malformed entry in keychain contents");
+
+    KeychainIndexEntry entry;
+    entry.uuid = contents_item[0];
+    if (contents_item[1].is_string())
+        entry.category = contents_item[1];
+    if (contents_item[2].is_string())
+        entry.title = contents_item[2];
+    if (contents_item.size() > 3 && contents_item[3].is_string())
+        entry.location = contents_item[3];
+    if (contents_item.size() > 4 && contents_item[4].is_number())
+        entry.updatedAt = contents_item[4];
+    if (contents_item.size() > 5 && contents_item[5].is_string())
+        entry.folder = contents_item[5];
+    if (contents_item.size() > 7 && contents_item[7].is_string())
+        entry.trashed = contents_item[7] == "Y";
+    return entry;
+}
+
+KeychainItem itemFromIndex(const KeychainIndexEntry& entry) {
+    KeychainItem item;
+    item.uuid = entry.uuid;
+    item.title = entry.title;
+    item.category = entry.category;
+    item.folder = entry.folder;
+    item.website = entry.location;
+    item.updatedAt = entry.updatedAt;
+    item.trashed = entry.trashed;
+    return item;
+}
+
+// Bump this whenever the snapshot layout below changes; older snapshots are then ignored.
+const int kSnapshotVersion = 2;
+
+// How many item files to read ahead of decryption during an eager load.
+const size_t kItemReadBatchSize = 256;
+
+// Dead item data below this is left in the arena rather than compacted away.
+const size_t kMinDeadArenaBytes = 256 * 1024;
+
+json indexEntryToJSON(const KeychainIndexEntry& entry) {
+    return json{entry.uuid,
+                entry.category,
+                entry.title,
+                entry.location,
+                entry.updatedAt,
+                entry.folder,
+                0,
+                entry.trashed ? "Y" : "N"};
+}
+
+json itemToJSON(const KeychainItem& item) {
+    json sections = json::array();
+    for (const auto& section : item.sections) {
+        json fields = json::array();
+        for (const auto& field : section.fields) {
+            fields.push_back({field.name.str(), field.value.str(), field.type.str(), field.password});
+        }
+        sections.push_back({section.title.str(), std::move(fields)});
+    }
+    json urls = json::array();
+    for (const auto& url : item.URLs)
+        urls.push_back(url.str());
+    return json{item.uuid, item.title, item.notes.str(), std::move(urls), std::move(sections)};
+}
+
+KeychainItem itemFromJSON(const KeychainIndexEntry& entry,
+                          const json& item_json,
+                          const std::shared_ptr<ItemArena>& arena) {
+    KeychainItem item = itemFromIndex(entry);
+    item.title = item_json.at(1);
+
+    ItemBuilder builder;
+    builder.setNotes(item_json.at(2));
+    for (const auto& url : item_json.at(3))
+        builder.addURL(url);
+    for (const auto& section : item_json.at(4)) {
+        for (const auto& field : section.at(1)) {
+            builder.addField(section.at(0), field.at(0), field.at(1), field.at(2), field.at(3));
+        }
+    }
+    builder.finish(item, arena);
+    return item;
+}
+
+// The same item with its data copied into another arena.
+KeychainItem moveItemData(const KeychainItem& item, const std::shared_ptr<ItemArena>& arena) {
+    KeychainItem ret = item;
+    ItemBuilder builder;
+    builder.setNotes(item.notes);
+    for (const auto& url : item.URLs)
+        builder.addURL(url);
+    for (const auto& section : item.sections) {
+        for (const auto& field : section.fields)
+            builder.addField(section.title, field.name, field.value, field.type, field.password);
+    }
+    ret.arena_bytes = 0;
+    builder.finish(ret, arena);
+    return ret;
+}
+
+// Only a handful of fields are needed from the outer object of an item file, so they're
+// scanned for in place rather than parsing the whole file into a DOM.
+ItemEnvelope checkedItemEnvelope(const char* data, size_t size) {
+    auto envelope = parseItemEnvelope(data, size);
+    if (envelope.securityLevel.empty())
+        throw std::runtime_error("Could not find security level for item");
+    if (!envelope.encrypted)
+        throw std::runtime_error("Item has no encrypted data");
+    if (envelope.securityLevel != "SL5" && envelope.securityLevel != "SL3")
+        throw std::runtime_error("Invalid security level for item");
+    return envelope;
+}
+
+// Builds an agilekeychain item from its envelope and its decrypted JSON text.
+KeychainItem itemFromPlaintext(const KeychainIndexEntry& entry,
+                               const ItemEnvelope& envelope,
+                               const char* plaintext,
+                               size_t size,
+                               const std::shared_ptr<ItemArena>& arena) {
+    KeychainItem item = itemFromIndex(entry);
+    if (!envelope.title.empty())
+        item.title = envelope.title;
+    ItemBuilder builder;
+    builder.addDetails(parseItemDetails(plaintext, size));
+    builder.finish(item, arena);
+    return item;
+}
 }
 
 using RawKeyData = std::tuple<std::array<uint8_t, 8>, std::vector<uint8_t>, bool>;
-RawKeyData parseEncryptedString(const std::string& data) {
-    auto raw_key_data = base64Decode(data);
-    std::array<uint8_t, 8> salt;
+RawKeyData parseEncryptedString(const char* data, size_t size) {
+    auto raw_key_data = base64Decode(data, size);
+    std::array<uint8_t, 8> salt = {};
 
     if (raw_key_data.size() < 8) {
         throw std::runtime_error("Master key data is too short");
     }
 
-    std::string saltCheck(raw_key_data.begin(), raw_key_data.begin() + 8);
-    if (saltCheck == "Salted__") {
-        std::vector<uint8_t> output_data;
+    static const char salted[] = "Salted__";
+    if (raw_key_data.size() >= 16 && std::equal(salted, salted + 8, raw_key_data.begin())) {
+        // Shift the ciphertext down over the header rather than copying it into a new vector.
         std::copy_n(raw_key_data.begin() + 8, 8, salt.begin());
-        std::copy(raw_key_data.begin() + 16, raw_key_data.end(), std::back_inserter(output_data));
-        return RawKeyData(salt, output_data, true);
+        raw_key_data.erase(raw_key_data.begin(), raw_key_data.begin() + 16);
+        return RawKeyData(salt, std::move(raw_key_data), true);
     }
-    return RawKeyData(salt, raw_key_data, false);
+    return RawKeyData(salt, std::move(raw_key_data), false);
+}
+
+RawKeyData parseEncryptedString(const std::string& data) {
+    return parseEncryptedString(data.data(), data.size());
 }
 
 AgileKeychainMasterKey::AgileKeychainMasterKey(const json& input,
-                                               const std::string masterPassword) {
+                                               const std::string& masterPassword,
+                                               const SessionKeyCache* key_cache) {
     if (!hasAllKeys(input, "data", "iterations", "validation", "level", "identifier"))
         throw std::runtime_error("Master key data does not have required fields");
+    level = input["level"];
+    id = input["identifier"];
+
+    // A cached key still has to pass validation, so a stale one just falls back to PBKDF2.
+    if (key_cache) {
+        setKeyData(key_cache->fetch(id));
+        if (!key_data.empty()) {
+            try {
+                validate(input);
+                return;
+            } catch (std::runtime_error&) {
+                key_cache->forget(id);
+            }
+        }
+    }
 
+    derive(input, masterPassword);
+    validate(input);
+    if (key_cache)
+        key_cache->store(id, key_data);
+}
+
+void AgileKeychainMasterKey::derive(const json& input, const std::string& masterPassword) {
     RawKeyData input_key_data = parseEncryptedString(input["data"]);
     std::array<uint8_t, 32> master_key;
 
     // Generate a 32-byte key from the master password and its salt
-    PKCS5_PBKDF2_HMAC_SHA1(masterPassword.c_str(),
-                           masterPassword.size(),
-                           std::get<0>(input_key_data).data(),
-                           std::get<0>(input_key_data).size(),
-                           input["iterations"],
-                           master_key.size(),
-                           master_key.data());
+    PKCS5_PBKDF2_HMAC(masterPassword.c_str(),
+                      masterPassword.size(),
+                      std::get<0>(input_key_data).data(),
+                      std::get<0>(input_key_data).size(),
+                      input["iterations"],
+                      cryptoRegistry().sha1,
+                      master_key.size(),
+                      master_key.data());
 
     // This block decrypts the master key using the master password and stores it
     // in ret. If the
@@ -156,94 +456,208 @@ AgileKeychainMasterKey::AgileKeychainMasterKey(const json& input,
             std::copy_n(master_key.begin(), 16, master_aes_key.begin());
             std::copy(master_key.begin() + 16, master_key.end(), master_aes_iv.begin());
 
-            EVPCipher cipher(EVP_aes_128_cbc(), master_aes_key, master_aes_iv, false);
-            cipher.update(std::get<1>(input_key_data));
-            key_data = std::vector<uint8_t>(cipher.cbegin(), cipher.cend());
+            auto cipher = leaseCipher(cryptoRegistry().aes128CBC, master_aes_key, master_aes_iv, false);
+            cipher->update(std::get<1>(input_key_data));
+            setKeyData(std::vector<uint8_t>(cipher->cbegin(), cipher->cend()));
         } catch (EVPCipherException& e) {
             throw std::runtime_error("Couldn't decrypt master key!");
         }
     }
+}
 
+void AgileKeychainMasterKey::setKeyData(std::vector<uint8_t> data) {
+    key_data = std::move(data);
+    // Every salted item key starts out as MD5(key_data + salt), so hash key_data just once.
+    auto digest = std::make_shared<DigestContext>();
+    digest->init(cryptoRegistry().md5);
+    digest->update(key_data.data(), key_data.size());
+    key_digest = std::move(digest);
+}
+
+void AgileKeychainMasterKey::validate(const json& input) const {
     OpensslKeyData validation_keys;
     auto validation_data = parseEncryptedString(input["validation"]);
     if (std::get<2>(validation_data)) {
-        validation_keys = opensslKey(key_data, std::get<0>(validation_data));
+        validation_keys = opensslKey(*key_digest, key_data, std::get<0>(validation_data));
     } else {
-        validation_keys = opensslKeyNoSalt(key_data);
+        validation_keys = opensslKeyNoSalt(*key_digest);
     }
 
     // This block decrypts the validation key and validates the master key with it
     {
         try {
-            EVPCipher cipher(EVP_aes_128_cbc(),
-                             std::get<0>(validation_keys),
-                             std::get<1>(validation_keys),
-                             false);
-            cipher.update(std::get<1>(validation_data));
-            cipher.finalize();
-            if (cipher.accumulator != key_data) {
+            auto cipher = leaseCipher(cryptoRegistry().aes128CBC,
+                                      std::get<0>(validation_keys),
+                                      std::get<1>(validation_keys),
+                                      false);
+            cipher->update(std::get<1>(validation_data));
+            cipher->finalize();
+            if (cipher->accumulator != key_data) {
                 throw std::runtime_error("Couldn't verify master key!");
             }
         } catch (EVPCipherException& e) {
             throw std::runtime_error("Couldn't decrypt validation_key!");
         }
     }
-
-    level = input["level"];
-    id = input["identifier"];
 }
 
-json AgileKeychainMasterKey::decryptItem(const json& input) {
+json AgileKeychainMasterKey::decryptItem(const json& input) const {
     return decryptJSON(input["encrypted"]);
 }
 
-std::string AgileKeychainMasterKey::encryptJSON(const json& input) {
+std::string AgileKeychainMasterKey::encryptJSON(const json& input) const {
     const auto payload_str = input.dump();
     const auto new_salt = generateSalt();
-    const auto cipher_keys = opensslKey(key_data, new_salt);
+    const auto cipher_keys = opensslKey(*key_digest, key_data, new_salt);
 
-    std::vector<uint8_t> encrypted_payload;
-    encrypted_payload.reserve(1024);
-    const std::string salted_str = "Salted__";
-    std::copy(salted_str.begin(), salted_str.end(), std::back_inserter(encrypted_payload));
-    std::copy(new_salt.begin(), new_salt.end(), std::back_inserter(encrypted_payload));
     try {
-        EVPCipher cipher(
-            EVP_aes_128_cbc(), std::get<0>(cipher_keys), std::get<1>(cipher_keys), true);
-
-        cipher.update(payload_str);
-        std::copy(cipher.begin(), cipher.end(), std::back_inserter(encrypted_payload));
-
+        auto cipher = leaseCipher(
+            cryptoRegistry().aes128CBC, std::get<0>(cipher_keys), std::get<1>(cipher_keys), true);
+
+        // The header goes into the cipher's own buffer, ahead of the ciphertext, so the whole
+        // payload is encoded straight out of it.
+        const std::string salted_str = "Salted__";
+        auto& encrypted_payload = cipher->accumulator;
+        encrypted_payload.reserve(salted_str.size() + new_salt.size() + payload_str.size() + 32);
+        encrypted_payload.insert(encrypted_payload.end(), salted_str.begin(), salted_str.end());
+        encrypted_payload.insert(encrypted_payload.end(), new_salt.begin(), new_salt.end());
+        cipher->update(payload_str);
+        cipher->finalize();
+        return base64Encode(encrypted_payload);
     } catch (EVPCipherException& e) {
         throw std::runtime_error("Couldn't encrypt item");
     }
+}
+
+json AgileKeychainMasterKey::decryptJSON(const std::string& input) const {
+    return decryptJSON(input.data(), input.size());
+}
+
+json AgileKeychainMasterKey::decryptJSON(const char* input, size_t size) const {
+    auto scratch = DecryptScratchPool::acquire();
+    return decryptJSON(input, size, *scratch);
+}
 
-    return base64Encode(encrypted_payload);
+DecryptScratch::DecryptScratch() = default;
+
+DecryptScratch::~DecryptScratch() {
+    wipe();
+}
+
+void DecryptScratch::wipe() {
+    if (cipher)
+        OPENSSL_cleanse(cipher->accumulator.data(), cipher->accumulator.size());
+}
+
+json AgileKeychainMasterKey::decryptJSON(const char* input,
+                                         size_t size,
+                                         DecryptScratch& scratch) const {
+    const auto& plaintext = decrypt(input, size, scratch);
+    json ret;
+    try {
+        ret = json::parse(plaintext.begin(), plaintext.end());
+    } catch (...) {
+        scratch.wipe();
+        throw;
+    }
+    scratch.wipe();
+    return ret;
 }
 
-json AgileKeychainMasterKey::decryptJSON(const std::string& input) {
-    auto raw_payload = parseEncryptedString(input);
+const std::vector<uint8_t>& AgileKeychainMasterKey::decrypt(const char* input,
+                                                            size_t size,
+                                                            DecryptScratch& scratch) const {
+    scratch.wipe();
+    auto& raw_payload = scratch.ciphertext;
+    base64Decode(input, size, raw_payload);
+    if (raw_payload.size() < 8)
+        throw std::runtime_error("Item data is too short");
+
+    // Same layout as parseEncryptedString, without copying the ciphertext out.
+    static const char salted[] = "Salted__";
+    const uint8_t* ciphertext = raw_payload.data();
+    size_t ciphertext_size = raw_payload.size();
     OpensslKeyData cipher_keys;
-    if (std::get<2>(raw_payload)) {
-        cipher_keys = opensslKey(key_data, std::get<0>(raw_payload));
+    if (raw_payload.size() >= 16 && std::equal(salted, salted + 8, raw_payload.begin())) {
+        SaltData salt;
+        std::copy_n(raw_payload.begin() + 8, salt.size(), salt.begin());
+        cipher_keys = opensslKey(*key_digest, key_data, salt);
+        ciphertext += 16;
+        ciphertext_size -= 16;
     } else {
-        cipher_keys = opensslKeyNoSalt(key_data);
+        cipher_keys = opensslKeyNoSalt(*key_digest);
     }
 
+    auto& cipher = scratch.cipher;
     try {
-        EVPCipher cipher(
-            EVP_aes_128_cbc(), std::get<0>(cipher_keys), std::get<1>(cipher_keys), false);
-
-        cipher.update(std::get<1>(raw_payload));
-
-        const std::string json_str(cipher.cbegin(), cipher.cend());
-        return json::parse(json_str);
+        if (!cipher)
+            cipher.reset(new EVPCipher);
+        cipher->init(cryptoRegistry().aes128CBC, std::get<0>(cipher_keys), std::get<1>(cipher_keys), false);
+        cipher->update(ciphertext, ciphertext_size);
+        cipher->finalize();
     } catch (EVPCipherException& e) {
+        scratch.wipe();
         throw std::runtime_error("Couldn't decrypt item");
     }
+    return cipher->accumulator;
+}
+
+std::vector<DecryptedPayload> AgileKeychainMasterKey::decryptItems(
+    const std::vector<EncryptedPayload>& payloads) const {
+    std::vector<DecryptedPayload> results(payloads.size());
+    const auto errors =
+        decryptItems(payloads, [&](size_t index, const char* plaintext, size_t size) {
+            results[index].value = json::parse(plaintext, plaintext + size);
+        });
+    for (size_t index = 0; index < payloads.size(); ++index)
+        results[index].error = errors[index];
+    return results;
 }
 
-Keychain::Keychain(std::string path, std::string masterPassword) {
+std::vector<std::string> AgileKeychainMasterKey::decryptItems(
+    const std::vector<EncryptedPayload>& payloads,
+    const PlaintextConsumer& consume,
+    size_t max_workers) const {
+    std::vector<std::string> errors(payloads.size());
+    // A few chunks per worker keeps every core busy when items vary in size, while each chunk
+    // still spreads the cost of its cipher context and buffers over many payloads.
+    const auto chunk_count =
+        std::min(payloads.size(), parallelWorkerCount(payloads.size(), max_workers) * 4);
+    auto decrypt_chunk = [&](size_t chunk) {
+        const auto start = payloads.size() * chunk / chunk_count;
+        const auto stop = payloads.size() * (chunk + 1) / chunk_count;
+        auto scratch = DecryptScratchPool::acquire();
+        for (auto index = start; index < stop; ++index) {
+            try {
+                const auto& plaintext =
+                    decrypt(payloads[index].data, payloads[index].size, *scratch);
+                consume(index, reinterpret_cast<const char*>(plaintext.data()), plaintext.size());
+            } catch (std::exception& e) {
+                errors[index] = e.what();
+            }
+            scratch->wipe();
+        }
+    };
+    parallelFor(chunk_count, decrypt_chunk, max_workers);
+    return errors;
+}
+
+Keychain::Keychain(std::string path,
+                   std::string masterPassword,
+                   LoadMode mode,
+                   std::shared_ptr<const SessionKeyCache> _key_cache)
+    : key_cache(std::move(_key_cache)), load_mode(mode) {
+    vault_path = path;
+    if (OnePIFReader::isOnePIF(path)) {
+        onepif.reset(new OnePIFReader(path));
+        return;
+    }
+    if (OPVault::isOPVault(path)) {
+        opvault.reset(new OPVault(path, masterPassword));
+        title = opvault->profileName();
+        return;
+    }
+
     json keys_json;
     // Load the keys file into a json object
     {
@@ -260,165 +674,628 @@ Keychain::Keychain(std::string path, std::string masterPassword) {
         throw std::runtime_error("Could not find list of keys in keychain");
     }
 
-    for (const auto key : list) {
-        std::unique_ptr<AgileKeychainMasterKey> cur_master_key(
-            new AgileKeychainMasterKey(key, masterPassword));
-        if (cur_master_key->level == "SL3")
+    // Proving the password only takes one key, and nearly every item is SL5, so the SL3 key is
+    // left until an SL3 item actually needs it. If there's no SL5 key, SL3 has to do instead.
+    bool has_level5_key = false;
+    for (const auto& key : list) {
+        const auto level = key.find("level");
+        if (level == key.end() || !level->is_string())
+            throw std::runtime_error("Master key data does not have required fields");
+        if (*level != "SL3" && *level != "SL5")
+            throw std::runtime_error("Unknown security level for master key");
+        has_level5_key = has_level5_key || *level == "SL5";
+    }
+
+    // Each key costs a full PBKDF2 run, so derive and validate them all at once. Results are
+    // collected in list order, so the first failure in the list is still the one reported.
+    std::vector<std::future<std::unique_ptr<AgileKeychainMasterKey>>> derivations;
+    for (const auto& key : list) {
+        if (has_level5_key && key["level"] == "SL3") {
+            level3_key_data = key;
+            level3_password = masterPassword;
+            continue;
+        }
+        derivations.push_back(std::async(std::launch::async, [this, &key, &masterPassword]() {
+            return std::unique_ptr<AgileKeychainMasterKey>(
+                new AgileKeychainMasterKey(key, masterPassword, key_cache.get()));
+        }));
+    }
+
+    for (auto& derivation : derivations) {
+        auto cur_master_key = derivation.get();
+        if (cur_master_key->level == "SL3") {
             level3_key = std::move(cur_master_key);
-        else if (cur_master_key->level == "SL5")
+            std::call_once(level3_once, []() {});
+        } else {
             level5_key = std::move(cur_master_key);
-        else {
-            throw std::runtime_error("Unknown security level for master key");
         }
     }
+}
 
-    vault_path = path;
+Keychain::~Keychain() {
+    wipeString(level3_password);
 }
 
-void Keychain::loadItem(std::string uuid) {
-    KeychainItem item;
-    json item_json;
+const AgileKeychainMasterKey& Keychain::level3Key() const {
+    // If the derivation throws, the flag stays unset and the next SL3 item tries again.
+    std::call_once(level3_once, [this]() {
+        if (level3_key_data.is_null())
+            throw std::runtime_error("Keychain has no SL3 key");
+        level3_key.reset(
+            new AgileKeychainMasterKey(level3_key_data, level3_password, key_cache.get()));
+        wipeString(level3_password);
+    });
+    return *level3_key;
+}
 
-    {
-        std::stringstream item_path;
-        item_path << vault_path << "/data/default/" << uuid << ".1password";
-        auto item_fp = std::ifstream(item_path.str());
-        if (!item_fp) {
-            throw std::runtime_error("Cannot load item file");
-        }
-        item_fp >> item_json;
+json Keychain::decryptJSON(const std::string& input) const {
+    if (onepif)
+        throw std::runtime_error("1PIF exports can't decrypt data");
+    if (opvault)
+        return opvault->decryptJSON(input);
+    return level5_key->decryptJSON(input);
+}
+
+std::string Keychain::encryptJSON(const json& input) const {
+    if (onepif)
+        throw std::runtime_error("1PIF exports can't encrypt data");
+    if (opvault)
+        return opvault->encryptJSON(input);
+    return level5_key->encryptJSON(input);
+}
+
+std::string Keychain::dataPath() const {
+    if (onepif) {
+        const auto& file_path = onepif->filePath();
+        const auto slash = file_path.rfind('/');
+        return slash == std::string::npos ? "." : file_path.substr(0, slash);
     }
+    return vault_path + (opvault ? "/default" : "/data/default");
+}
 
-    auto typeName = item_json["typeName"];
-    std::string securityLevel;
-    if (item_json.find("securityLevel") == item_json.end()) {
-        auto openContents = item_json.find("openContents");
-        if (openContents == item_json.end())
-            throw std::runtime_error("Could not find security level for item");
-        securityLevel = (*openContents)["securityLevel"];
-    } else {
-        if (item_json.find("securityLevel") == item_json.end())
-            throw std::runtime_error("Could not find security level for item");
-        securityLevel = item_json["securityLevel"];
+KeychainItem Keychain::loadItem(const KeychainIndexEntry& entry) const {
+    if (onepif) {
+        const auto record = onepif->readRecord(entry.uuid);
+        KeychainItem item = itemFromIndex(entry);
+        ItemBuilder builder;
+        auto secure_contents = record.find("secureContents");
+        if (secure_contents != record.end())
+            builder.addDetails(itemDetailsFromJSON(*secure_contents));
+        builder.finish(item, arena);
+        return item;
     }
 
-    json decrypted_item;
-    if (securityLevel == "SL5")
-        decrypted_item = level5_key->decryptItem(item_json);
-    else if (securityLevel == "SL3")
-        decrypted_item = level3_key->decryptItem(item_json);
-    else
-        throw std::runtime_error("Invalid security level for item");
+    if (opvault) {
+        const auto record = opvault->findItem(entry.uuid);
+        if (!record)
+            throw std::runtime_error("Item is missing from the vault");
+        if (!record->error.empty())
+            throw std::runtime_error(record->error);
+
+        KeychainItem item = itemFromIndex(entry);
+        ItemBuilder builder;
+        for (const auto& url : record->URLs)
+            builder.addURL(url);
+        builder.addDetails(itemDetailsFromJSON(opvault->decryptDetails(*record)));
+        builder.finish(item, arena);
+        return item;
+    }
+
+    ItemFile item_file(itemPath(entry.uuid));
+    return decodeItem(entry, item_file.data(), item_file.size());
+}
 
-    item.title = item_json["title"];
-    item.uuid = uuid;
+KeychainItem Keychain::decodeItem(const KeychainIndexEntry& entry,
+                                  const char* data,
+                                  size_t size) const {
+    const auto envelope = checkedItemEnvelope(data, size);
+    const auto& key = envelope.securityLevel == "SL5" ? *level5_key : level3Key();
+    auto scratch = DecryptScratchPool::acquire();
+    const auto& plaintext = key.decrypt(envelope.encrypted, envelope.encryptedSize, *scratch);
+    return itemFromPlaintext(entry,
+                             envelope,
+                             reinterpret_cast<const char*>(plaintext.data()),
+                             plaintext.size(),
+                             arena);
+}
 
-    if (decrypted_item.find("notesPlain") != decrypted_item.end())
-        item.notes = decrypted_item["notesPlain"];
+std::vector<KeychainIndexEntry> Keychain::loadIndex() {
+    if (onepif)
+        return onepif->loadIndex();
+
+    // An OPVault has no separate index; its overviews play the same part. Items whose overview
+    // couldn't be read are still listed, so that storeItems reports them like any other item
+    // that fails to load.
+    if (opvault) {
+        std::vector<KeychainIndexEntry> index;
+        for (const auto& record : opvault->loadItems())
+            index.push_back(record.entry);
+        return index;
+    }
 
-    if (decrypted_item.find("URLs") != decrypted_item.end()) {
-        for (auto url_obj : decrypted_item["URLs"]) {
-            item.URLs.emplace_back(url_obj["url"].get<std::string>());
+    json contents_json;
+    {
+        std::stringstream contents_path;
+        contents_path << vault_path << "/data/default/contents.js";
+        auto contents_fp = std::ifstream(contents_path.str());
+        if (!contents_fp)
+            throw std::runtime_error("Cannot open keychain contents");
+        contents_json << contents_fp;
+    }
+
+    std::vector<KeychainIndexEntry> index;
+    index.reserve(contents_json.size());
+    for (const auto& contents_item : contents_json) {
+        auto entry = parseIndexEntry(contents_item);
+        if (entry.category != "system.Tombstone") {
+            index.push_back(std::move(entry));
         }
     }
+    return index;
+}
 
-    if (decrypted_item.find("password") != decrypted_item.end()) {
-        std::string value_str = decrypted_item["password"];
-        item.addField("", {"password", value_str, "P", true});
+std::string Keychain::itemPath(const std::string& uuid) const {
+    std::stringstream item_path;
+    item_path << vault_path << "/data/default/" << uuid << ".1password";
+    return item_path.str();
+}
+
+Keychain::ItemFileStamp Keychain::statItem(const std::string& uuid) const {
+    ItemFileStamp stamp;
+    // Band files hold many items each, so their stamps say nothing about a single item. The
+    // item's own transaction stamp does the same job.
+    if (onepif) {
+        if (const auto location = onepif->findRecord(uuid)) {
+            stamp.size = location->size;
+            stamp.inode = location->offset;
+        }
+        return stamp;
+    }
+    if (opvault) {
+        if (const auto record = opvault->findItem(uuid)) {
+            stamp.mtime = record->tx;
+            stamp.size = record->details.size();
+        }
+        return stamp;
     }
 
-    auto fields = decrypted_item.find("fields");
-    if (fields != decrypted_item.end()) {
-        for (const auto& field : *fields) {
-            if (!hasAllKeys(field, "designation", "value", "type"))
+    struct stat st;
+    if (::stat(itemPath(uuid).c_str(), &st) == 0) {
+        stamp.mtime = st.st_mtime;
+        stamp.size = st.st_size;
+        stamp.inode = st.st_ino;
+    }
+    return stamp;
+}
+
+std::vector<std::string> Keychain::storeItems(const std::vector<KeychainIndexEntry>& entries) {
+    std::vector<std::string> stored;
+    stored.reserve(entries.size());
+
+    if (load_mode == LoadMode::Lazy) {
+        for (const auto& entry : entries) {
+            const auto record = opvault ? opvault->findItem(entry.uuid) : nullptr;
+            if (record && !record->error.empty()) {
+                reportLoadError({entry.uuid, entry.title, record->error});
+                items.erase(entry.uuid);
                 continue;
-            auto typeStr = field["type"];
-            bool isPassword = typeStr == "P";
-            item.addField("", {field["designation"], field["value"], typeStr, isPassword});
+            }
+            items[entry.uuid] = itemFromIndex(entry);
+            stored.push_back(entry.uuid);
+        }
+        if (progress_callback && !progress_callback(entries.size(), entries.size()))
+            throw KeychainLoadCancelled();
+        return stored;
+    }
+
+    // Every item is independent, so decrypt them across all cores. Each worker writes only to
+    // its own slot and the results are merged in contents.js order afterwards so the outcome
+    // doesn't depend on how the work got scheduled.
+    //
+    // The files are read in batches, and the next batch is read while the current one is being
+    // decrypted. On a local disk that hardly matters, but on a network or FUSE filesystem the
+    // open and read round trips would otherwise dominate the whole load.
+    std::vector<KeychainItem> loaded_items(entries.size());
+    std::vector<std::string> load_errors(entries.size());
+    std::atomic<size_t> done(0);
+    std::atomic<bool> cancelled(false);
+
+    auto load = [&](size_t index, const std::function<KeychainItem()>& fn) {
+        if (cancelled.load(std::memory_order_relaxed))
+            return;
+        try {
+            loaded_items[index] = fn();
+        } catch (std::exception& e) {
+            load_errors[index] = e.what();
         }
+        if (progress_callback && !progress_callback(++done, entries.size()))
+            cancelled = true;
+    };
+
+    // An OPVault's bands have already been read in full by loadIndex, and a 1PIF export is a
+    // single file whose records are each read straight from their offsets.
+    if (opvault || onepif) {
+        auto load_entry = [&](size_t index) {
+            load(index, [&]() { return loadItem(entries[index]); });
+        };
+        parallelFor(entries.size(), load_entry, max_workers);
     }
 
-    auto sections = decrypted_item.find("sections");
-    if (sections != decrypted_item.end()) {
-        for (const auto& section : *sections) {
-            auto section_fields = section.find("fields");
-            if (section_fields == section.end()) {
+    // Setting up a reader can mean setting up an io_uring, so only do it if there are item
+    // files to read.
+    std::unique_ptr<ItemBatchReader> reader;
+    auto read_batch = [&](size_t start) {
+        std::vector<std::string> paths;
+        const auto stop = std::min(entries.size(), start + kItemReadBatchSize);
+        for (auto index = start; index < stop; ++index)
+            paths.push_back(itemPath(entries[index].uuid));
+        return reader->read(paths);
+    };
+
+    std::future<std::vector<ItemBuffer>> next_batch;
+    if (!opvault && !onepif && !entries.empty()) {
+        reader.reset(new ItemBatchReader());
+        next_batch = std::async(std::launch::async, read_batch, 0);
+    }
+    for (size_t start = 0; next_batch.valid() && !cancelled; start += kItemReadBatchSize) {
+        auto batch = next_batch.get();
+        if (start + kItemReadBatchSize < entries.size())
+            next_batch = std::async(std::launch::async, read_batch, start + kItemReadBatchSize);
+
+        // The whole batch is decrypted in one decryptItems call per security level, so the
+        // cipher contexts and buffers are shared across items, and each item is built straight
+        // from its plaintext while that's still in the worker's buffer.
+        std::vector<ItemEnvelope> envelopes(batch.size());
+        std::vector<std::string> errors(batch.size());
+        auto parse_envelope = [&](size_t offset) {
+            try {
+                if (batch[offset].error)
+                    throw std::runtime_error("Cannot load item file");
+                const auto& data = batch[offset].data;
+                envelopes[offset] = checkedItemEnvelope(data.data(), data.size());
+            } catch (std::exception& e) {
+                errors[offset] = e.what();
+            }
+        };
+        parallelFor(batch.size(), parse_envelope, max_workers);
+        for (const auto level : {"SL5", "SL3"}) {
+            std::vector<size_t> offsets;
+            std::vector<EncryptedPayload> payloads;
+            for (size_t offset = 0; offset < batch.size(); ++offset) {
+                const auto& envelope = envelopes[offset];
+                if (errors[offset].empty() && envelope.securityLevel == level) {
+                    offsets.push_back(offset);
+                    payloads.push_back({envelope.encrypted, envelope.encryptedSize});
+                }
+            }
+            if (payloads.empty())
                 continue;
+            try {
+                const auto& key = std::strcmp(level, "SL5") == 0 ? *level5_key : level3Key();
+                auto consume = [&](size_t i, const char* plaintext, size_t size) {
+                    const auto offset = offsets[i];
+                    load(start + offset, [&]() {
+                        return itemFromPlaintext(
+                            entries[start + offset], envelopes[offset], plaintext, size, arena);
+                    });
+                };
+                const auto decrypt_errors = key.decryptItems(payloads, consume, max_workers);
+                for (size_t i = 0; i < offsets.size(); ++i)
+                    errors[offsets[i]] = decrypt_errors[i];
+            } catch (std::exception& e) {
+                for (const auto offset : offsets)
+                    errors[offset] = e.what();
             }
+        }
 
-            std::string section_title;
-            if (section.find("title") != section.end())
-                section_title = section["title"];
+        // Whatever failed before it got to be built still has to be counted and reported.
+        for (size_t offset = 0; offset < batch.size(); ++offset) {
+            if (!errors[offset].empty())
+                load(start + offset,
+                     [&]() -> KeychainItem { throw std::runtime_error(errors[offset]); });
+        }
+    }
+    // Don't leave a read in flight that refers to the reader or the entries.
+    if (next_batch.valid())
+        next_batch.wait();
+    if (cancelled)
+        throw KeychainLoadCancelled();
+
+    for (size_t index = 0; index < entries.size(); ++index) {
+        if (!load_errors[index].empty()) {
+            reportLoadError({entries[index].uuid, entries[index].title, load_errors[index]});
+            items.erase(entries[index].uuid);
+            continue;
+        }
+        auto& item = loaded_items[index];
+        stored.push_back(item.uuid);
+        items[item.uuid] = std::move(item);
+    }
+    return stored;
+}
 
-            for (const auto& field : *section_fields) {
-                if (!hasAllKeys(field, "k", "t", "v"))
-                    continue;
-                std::string typeStr = field["k"];
-                std::string nameStr = field["t"];
-                auto value = field["v"];
-                std::string valueStr;
-                bool isPassword = typeStr == "concealed";
-
-                if (typeStr == "date") {
-                    char dateBuf[20] = {'\0'};
-                    time_t time_val = static_cast<time_t>(value);
-                    std::strftime(dateBuf, sizeof(dateBuf), "%x", std::localtime(&time_val));
-                    valueStr = dateBuf;
-                } else if (typeStr == "address") {
-                    std::stringstream ss;
-                    if (!value["street"].is_string())
-                        continue;
+void Keychain::reportLoadError(KeychainLoadError error) {
+    if (error_sink)
+        error_sink->itemFailed(std::move(error));
+    else
+        error_report.itemFailed(std::move(error));
+}
 
-                    ss << value["street"].get<std::string>() << " "
-                       << value["city"].get<std::string>() << ", "
-                       << value["state"].get<std::string>() << " "
-                       << value["zip"].get<std::string>();
-                    valueStr = ss.str();
-                } else if (typeStr == "monthYear") {
-                    auto stringVal = std::to_string(value.get<int>());
-                    std::stringstream ss;
-                    ss << stringVal.substr(0, 4) << "/" << stringVal.substr(4, 2);
-                    valueStr = ss.str();
-                } else {
-                    valueStr = value;
-                }
+void Keychain::reloadItems() {
+    items.clear();
+    index_entries.clear();
+    file_stamps.clear();
+    arena = std::make_shared<ItemArena>();
+    const auto to_load = loadIndex();
+    items.reserve(to_load.size());
+    for (const auto& entry : to_load) {
+        index_entries.insert({entry.uuid, entry});
+        file_stamps.insert({entry.uuid, statItem(entry.uuid)});
+    }
 
-                item.addField(section_title, {nameStr, valueStr, typeStr, isPassword});
+    try {
+        storeItems(to_load);
+    } catch (KeychainLoadCancelled&) {
+        unloadItems();
+        throw;
+    }
+    loaded = true;
+}
+
+KeychainChangeSet Keychain::refreshItems() {
+    return refreshItems(nullptr);
+}
+
+KeychainChangeSet Keychain::refreshItems(const std::unordered_set<std::string>& touched_uuids) {
+    return refreshItems(&touched_uuids);
+}
+
+KeychainChangeSet Keychain::refreshItems(const std::unordered_set<std::string>* touched_uuids) {
+    KeychainChangeSet changes;
+    if (!loaded) {
+        reloadItems();
+        for (const auto& item : items) {
+            changes.added.push_back(item.first);
+        }
+        return changes;
+    }
+
+    const auto new_index = loadIndex();
+    std::unordered_map<std::string, KeychainIndexEntry> new_entries;
+    std::unordered_map<std::string, ItemFileStamp> new_stamps;
+    std::vector<KeychainIndexEntry> to_load, to_reload;
+    new_entries.reserve(new_index.size());
+    new_stamps.reserve(new_index.size());
+
+    for (const auto& entry : new_index) {
+        auto old_entry = index_entries.find(entry.uuid);
+        auto old_stamp = file_stamps.find(entry.uuid);
+
+        // When the caller knows which files were touched, trust the old stamps for the rest
+        // rather than stat'ing the whole vault again.
+        ItemFileStamp stamp;
+        if (touched_uuids && !opvault && !onepif && old_stamp != file_stamps.end() &&
+            touched_uuids->find(entry.uuid) == touched_uuids->end()) {
+            stamp = old_stamp->second;
+        } else {
+            stamp = statItem(entry.uuid);
+        }
+        new_entries.insert({entry.uuid, entry});
+        new_stamps.insert({entry.uuid, stamp});
+
+        if (old_entry == index_entries.end()) {
+            to_load.push_back(entry);
+            continue;
+        }
+
+        if (old_entry->second.updatedAt != entry.updatedAt ||
+            old_entry->second.title != entry.title || old_entry->second.trashed != entry.trashed ||
+            old_stamp == file_stamps.end() || old_stamp->second != stamp) {
+            to_reload.push_back(entry);
+        }
+    }
+
+    // Anything that's gone from contents.js, or has been turned into a tombstone, gets dropped.
+    for (const auto& old_entry : index_entries) {
+        if (new_entries.find(old_entry.first) == new_entries.end()) {
+            items.erase(old_entry.first);
+            changes.removed.push_back(old_entry.first);
+        }
+    }
+
+    index_entries = std::move(new_entries);
+    file_stamps = std::move(new_stamps);
+
+    changes.added = storeItems(to_load);
+    changes.changed = storeItems(to_reload);
+
+    // Changed items that could no longer be loaded have been removed by storeItems.
+    for (const auto& entry : to_reload) {
+        if (items.find(entry.uuid) == items.end())
+            changes.removed.push_back(entry.uuid);
+    }
+    compactArena();
+    return changes;
+}
+
+void Keychain::compactArena() {
+    if (!arena)
+        return;
+    size_t live_bytes = 0;
+    for (const auto& item : items) {
+        if (item.second.arena == arena)
+            live_bytes += item.second.arena_bytes;
+    }
+    // Copying the live items only once at least as much is dead keeps the cost of this down to
+    // a constant per byte replaced, however often the vault is refreshed.
+    const auto dead_bytes = arena->bytesUsed() - live_bytes;
+    if (dead_bytes < kMinDeadArenaBytes || dead_bytes < live_bytes)
+        return;
+
+    auto new_arena = std::make_shared<ItemArena>();
+    for (auto& item : items) {
+        if (item.second.arena == arena)
+            item.second = moveItemData(item.second, new_arena);
+    }
+    arena = std::move(new_arena);
+}
+
+Keychain::ItemMap::iterator Keychain::findDecrypted(const std::string& key) {
+    auto it = find(key);
+    if (it == items.end() || it->second.decrypted)
+        return it;
+
+    auto entry = index_entries.find(key);
+    if (entry == index_entries.end())
+        throw std::runtime_error("Item is missing from keychain contents");
+    it->second = loadItem(entry->second);
+    return it;
+}
+
+bool Keychain::snapshotItemCurrent(const json& snapshot_item) const {
+    const std::string uuid = snapshot_item.at(0).at(0);
+    auto entry = index_entries.find(uuid);
+    auto stamp = file_stamps.find(uuid);
+    if (entry == index_entries.end() || stamp == file_stamps.end() ||
+        items.find(uuid) == items.end())
+        return false;
+
+    const auto& stamp_json = snapshot_item.at(1);
+    ItemFileStamp saved_stamp;
+    saved_stamp.mtime = stamp_json.at(0);
+    saved_stamp.size = stamp_json.at(1);
+    saved_stamp.inode = stamp_json.at(2);
+    return snapshot_item.at(0) == indexEntryToJSON(entry->second) && saved_stamp == stamp->second;
+}
+
+std::string Keychain::saveSnapshot(const std::string& previous) const {
+    if (readOnly())
+        return std::string();
+
+    json snapshot_index = json::array();
+    std::unordered_set<std::string> saved;
+    for (const auto& entry : index_entries) {
+        auto stamp = file_stamps.find(entry.first);
+        auto item = items.find(entry.first);
+        // Items that were never decrypted (or failed to load) aren't worth caching.
+        if (stamp == file_stamps.end() || item == items.end() || !item->second.decrypted)
+            continue;
+        snapshot_index.push_back({indexEntryToJSON(entry.second),
+                                  {stamp->second.mtime, stamp->second.size, stamp->second.inode},
+                                  itemToJSON(item->second)});
+        saved.insert(entry.first);
+    }
+
+    // The items this session never decrypted are carried over from the previous snapshot, for
+    // as long as neither their contents.js entry nor their file has changed since.
+    if (!previous.empty()) {
+        try {
+            const auto previous_json = decryptJSON(previous);
+            if (previous_json.at("version") == kSnapshotVersion) {
+                for (const auto& snapshot_item : previous_json.at("items")) {
+                    const std::string uuid = snapshot_item.at(0).at(0);
+                    if (saved.find(uuid) != saved.end() || !snapshotItemCurrent(snapshot_item))
+                        continue;
+                    snapshot_index.push_back(snapshot_item);
+                    saved.insert(uuid);
+                }
             }
+        } catch (std::exception& e) {
+            // An unusable previous snapshot is simply replaced.
         }
     }
 
-    items.insert({uuid, std::move(item)});
+    bool complete = loaded;
+    for (const auto& item : items)
+        complete = complete && saved.find(item.first) != saved.end();
+    return encryptJSON({{"version", kSnapshotVersion},
+                        {"complete", complete},
+                        {"items", std::move(snapshot_index)}});
 }
 
-void Keychain::reloadItems() {
-    items.clear();
-    json contents_json;
-    {
-        std::stringstream contents_path;
-        contents_path << vault_path << "/data/default/contents.js";
-        auto contents_fp = std::ifstream(contents_path.str());
-        if (!contents_fp)
-            throw std::runtime_error("Cannot open keychain contents");
-        contents_json << contents_fp;
+bool Keychain::loadSnapshot(const std::string& snapshot) {
+    json snapshot_json;
+    try {
+        snapshot_json = decryptJSON(snapshot);
+        if (snapshot_json.at("version") != kSnapshotVersion)
+            return false;
+    } catch (std::exception& e) {
+        return false;
     }
 
-    for (const auto& contents_item : contents_json) {
-        if(contents_item[1] != "system.Tombstone") {
+    // A lazy keychain lists the vault as usual and then takes whichever of the snapshot's
+    // items are still current, so even a snapshot of the few items one session opened saves
+    // decrypting those again. The rest are decrypted on demand, as always.
+    if (load_mode == LoadMode::Lazy) {
+        reloadItems();
+        for (const auto& snapshot_item : snapshot_json["items"]) {
             try {
-                loadItem(contents_item[0]);
+                if (!snapshotItemCurrent(snapshot_item))
+                    continue;
+                const auto& entry = index_entries.at(snapshot_item.at(0).at(0));
+                items[entry.uuid] = itemFromJSON(entry, snapshot_item.at(2), arena);
             } catch (std::exception& e) {
-                std::stringstream ss;
-                ss << "Error loading item " << contents_item[2] << ": " << e.what();
-                errorDialog(ss.str());
+                // Left to be decrypted when it's opened.
             }
         }
+        return true;
     }
 
+    std::unordered_map<std::string, KeychainIndexEntry> new_entries;
+    std::unordered_map<std::string, ItemFileStamp> new_stamps;
+    ItemMap new_items;
+    auto new_arena = std::make_shared<ItemArena>();
+    try {
+        // Restoring only the items one session happened to open would leave the rest to be
+        // found by the refresh afterwards, so it's no quicker than loading the vault in full.
+        if (!snapshot_json.at("complete").get<bool>())
+            return false;
+
+        const auto& snapshot_items = snapshot_json.at("items");
+        new_entries.reserve(snapshot_items.size());
+        new_stamps.reserve(snapshot_items.size());
+        new_items.reserve(snapshot_items.size());
+        for (const auto& snapshot_item : snapshot_items) {
+            auto entry = parseIndexEntry(snapshot_item.at(0));
+            const auto& stamp_json = snapshot_item.at(1);
+            ItemFileStamp stamp;
+            stamp.mtime = stamp_json.at(0);
+            stamp.size = stamp_json.at(1);
+            stamp.inode = stamp_json.at(2);
+
+            new_items.insert({entry.uuid, itemFromJSON(entry, snapshot_item.at(2), new_arena)});
+            new_stamps.insert({entry.uuid, stamp});
+            new_entries.insert({entry.uuid, std::move(entry)});
+        }
+    } catch (std::exception& e) {
+        return false;
+    }
+
+    items = std::move(new_items);
+    arena = std::move(new_arena);
+    index_entries = std::move(new_entries);
+    file_stamps = std::move(new_stamps);
     loaded = true;
+
+    // The snapshot may be stale; patch in whatever has changed in the vault since it was taken.
+    refreshItems();
+    return true;
+}
+
+bool Keychain::fullyDecrypted() const {
+    if (!loaded)
+        return false;
+    for (const auto& item : items) {
+        if (!item.second.decrypted)
+            return false;
+    }
+    return true;
 }
 
 void Keychain::unloadItems() {
     items.clear();
+    index_entries.clear();
+    file_stamps.clear();
+    arena.reset();
     loaded = false;
 }
@@ -1,57 +1,222 @@
 #pragma once
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "item_arena.h"
 #include "json.hpp"
+#include "session_key_cache.h"
+#include "totp.h"
 // for convenience
 using json = nlohmann::json;
 
 struct KeychainField {
-    std::string name;
-    std::string value;
-    std::string type;
+    ArenaString name;
+    ArenaString value;
+    ArenaString type;
     bool password;
+    // Whether value is an otpauth:// URI, worked out when the item is loaded so showing the
+    // field doesn't have to look.
+    bool otp;
+    // The parsed URI, in the same arena, or null if value isn't one we can compute codes for.
+    const TOTPDescriptor* totp;
 };
 
+struct KeychainSection {
+    ArenaString title;
+    ArenaArray<KeychainField> fields;
+};
+
+// One row of contents.js. This is stored unencrypted next to the items, so it's enough to
+// list a vault without decrypting anything.
+struct KeychainIndexEntry {
+    std::string uuid;
+    std::string category;
+    std::string title;
+    std::string location;
+    int64_t updatedAt = 0;
+    std::string folder;
+    bool trashed = false;
+};
+
+// The contents.js metadata is held in ordinary strings. Everything that comes out of
+// decryption lives in the ItemArena of the load that produced it, which the item keeps alive.
 struct KeychainItem {
     std::string title;
     std::string uuid;
     std::string category;
     std::string folder;
-    std::unordered_map<std::string, std::vector<KeychainField>> sections;
-    void addField(std::string section, KeychainField field) {
-        auto it = sections.find(section);
-        if (it == sections.end()) {
-            sections.emplace(std::make_pair(section, std::vector<KeychainField>{field}));
-        } else {
-            it->second.push_back(std::move(field));
+    // In the order they appear in the item; fields with the same section title are merged.
+    ArenaArray<KeychainSection> sections;
+    // Returns null if there's no section with this title.
+    const KeychainSection* findSection(const std::string& section_title) const {
+        for (const auto& section : sections) {
+            if (section.title == section_title)
+                return &section;
         }
+        return nullptr;
     }
-    std::vector<std::string> URLs;
+    ArenaArray<ArenaString> URLs;
     std::string website;
-    std::string notes;
+    ArenaString notes;
+    int64_t updatedAt = 0;
+    bool trashed = false;
+    // False if only the contents.js metadata above has been filled in so far.
+    bool decrypted = false;
+    std::shared_ptr<const ItemArena> arena;
+    // How much of arena this item's data takes up, all of it dead once the item is replaced.
+    size_t arena_bytes = 0;
+};
+
+// The result of Keychain::refreshItems, listed by uuid.
+struct KeychainChangeSet {
+    std::vector<std::string> added;
+    std::vector<std::string> changed;
+    std::vector<std::string> removed;
+
+    bool empty() const {
+        return added.empty() && changed.empty() && removed.empty();
+    }
+};
+
+// A base64 payload for AgileKeychainMasterKey::decryptItems, e.g. from an ItemEnvelope.
+struct EncryptedPayload {
+    const char* data;
+    size_t size;
+};
+
+class DigestContext;
+class EVPCipher;
+
+// The cipher context and buffers for decrypting items one after another, so that only the
+// first item has to allocate them. Not safe to share between threads.
+struct DecryptScratch {
+    DecryptScratch();
+    // Wipes the plaintext.
+    ~DecryptScratch();
+
+    // Overwrites the last plaintext decrypted into this scratch.
+    void wipe();
+
+    std::unique_ptr<EVPCipher> cipher;
+    std::vector<uint8_t> ciphertext;
+};
+
+struct DecryptedPayload {
+    json value;
+    // Set instead of value if the payload couldn't be decrypted or parsed.
+    std::string error;
 };
 
 class AgileKeychainMasterKey {
 public:
-    AgileKeychainMasterKey(const json& input, const std::string masterPassword);
+    // If key_cache is set, the decrypted key is looked up there before running PBKDF2, and
+    // stored there afterwards.
+    AgileKeychainMasterKey(const json& input,
+                           const std::string& masterPassword,
+                           const SessionKeyCache* key_cache = nullptr);
 
-    json decryptItem(const json& input);
-    json decryptJSON(const std::string& input);
-    std::string encryptJSON(const json& input);
+    // decryptItem and decryptJSON are safe to call from multiple threads at once.
+    json decryptItem(const json& input) const;
+    json decryptJSON(const std::string& input) const;
+    // Decrypts base64 data in place, e.g. straight out of a mapped item file. JSON-escaped
+    // slashes in the input are tolerated.
+    json decryptJSON(const char* input, size_t size) const;
+    // Same, but decodes and decrypts into scratch and parses straight out of it. The plaintext
+    // is wiped from scratch once it's been parsed.
+    json decryptJSON(const char* input, size_t size, DecryptScratch& scratch) const;
+    // Decodes and decrypts into scratch and returns the plaintext, which stays there until the
+    // scratch is wiped, reused or destroyed.
+    const std::vector<uint8_t>& decrypt(const char* input,
+                                        size_t size,
+                                        DecryptScratch& scratch) const;
+    std::string encryptJSON(const json& input) const;
+
+    // Decrypts many payloads at once, returning their results in the same order. The batch is
+    // split across all cores, and each worker reuses one cipher context and one set of buffers
+    // for all of its payloads, which for small items costs more than the decryption itself.
+    std::vector<DecryptedPayload> decryptItems(const std::vector<EncryptedPayload>& payloads) const;
+    // Same, but hands each plaintext to consume, on whichever worker decrypted it, instead of
+    // parsing it. The plaintext is wiped as soon as consume returns. Returns an error message
+    // for each payload, empty if it was decrypted and consumed without throwing. max_workers is
+    // passed on to parallelFor.
+    using PlaintextConsumer =
+        std::function<void(size_t index, const char* plaintext, size_t size)>;
+    std::vector<std::string> decryptItems(const std::vector<EncryptedPayload>& payloads,
+                                          const PlaintextConsumer& consume,
+                                          size_t max_workers = 0) const;
 
     std::string level;
     std::string id;
 
 private:
+    void derive(const json& input, const std::string& masterPassword);
+    void setKeyData(std::vector<uint8_t> data);
+    // Throws unless key_data decrypts the validation blob back to itself.
+    void validate(const json& input) const;
+
     std::vector<uint8_t> key_data;
+    // MD5 with key_data already fed in; only read after construction, so threads can share it.
+    std::shared_ptr<const DigestContext> key_digest;
+};
+
+struct KeychainLoadError {
+    std::string uuid;
+    std::string title;
+    std::string reason;
+};
+
+// Collects the items that failed to load so they can be reported all at once, rather than
+// interrupting the load for each one.
+class KeychainErrorSink {
+public:
+    virtual ~KeychainErrorSink() {}
+    virtual void itemFailed(KeychainLoadError error) = 0;
 };
 
+class KeychainErrorReport : public KeychainErrorSink {
+public:
+    void itemFailed(KeychainLoadError error) override {
+        errors.push_back(std::move(error));
+    }
+
+    bool empty() const {
+        return errors.empty();
+    }
+
+    std::vector<KeychainLoadError> errors;
+};
+
+// Thrown out of Keychain::reloadItems when the progress callback asks to stop.
+class KeychainLoadCancelled : public std::runtime_error {
+public:
+    KeychainLoadCancelled() : std::runtime_error("Loading the keychain was cancelled") {}
+};
+
+class OPVault;
+class OnePIFReader;
+
+// A vault in the agilekeychain or OPVault format, or a 1PIF export; which one is detected from
+// the files in path.
 class Keychain {
 public:
-    Keychain(std::string path, std::string masterPassword);
+    // Eager decrypts every item when the keychain is first iterated. Lazy only reads contents.js
+    // and decrypts a single item when findDecrypted asks for it.
+    enum class LoadMode { Eager, Lazy };
+
+    // If key_cache is set, agilekeychain master keys are taken from and saved to it rather
+    // than derived from the password every time.
+    Keychain(std::string path,
+             std::string masterPassword,
+             LoadMode mode = LoadMode::Eager,
+             std::shared_ptr<const SessionKeyCache> key_cache = nullptr);
+    ~Keychain();
 
     using ItemMap = std::unordered_map<std::string, KeychainItem>;
     ItemMap::iterator begin() {
@@ -72,27 +237,130 @@ public:
         return items.find(key);
     }
 
+    // Like find, but makes sure the returned item has been decrypted. Throws if the item
+    // can't be loaded.
+    ItemMap::iterator findDecrypted(const std::string& key);
+
     void reloadItems();
     void unloadItems();
 
+    // Item load failures go to the sink, if one is set, and otherwise pile up in an internal
+    // report until they're taken with takeErrorReport.
+    void setErrorSink(std::shared_ptr<KeychainErrorSink> sink) {
+        error_sink = std::move(sink);
+    }
+
+    KeychainErrorReport takeErrorReport() {
+        KeychainErrorReport ret;
+        std::swap(ret, error_report);
+        return ret;
+    }
+
+    // Called as items are loaded, possibly from several threads at once. Returning false
+    // cancels the load.
+    using ProgressCallback = std::function<bool(size_t done, size_t total)>;
+    void setProgressCallback(ProgressCallback callback) {
+        progress_callback = std::move(callback);
+    }
+
+    // Caps the threads an eager load decrypts on. Zero, the default, means one per core, and
+    // one loads every item on the calling thread.
+    void setMaxWorkers(size_t workers) {
+        max_workers = workers;
+    }
+
+    // Re-reads contents.js and only reloads the items that were added or whose update time or
+    // file (mtime, size, inode) changed since the last load. Removed and tombstoned items are
+    // dropped.
+    KeychainChangeSet refreshItems();
+    // Same as above, but only re-stats the item files listed in touched_uuids.
+    KeychainChangeSet refreshItems(const std::unordered_set<std::string>& touched_uuids);
+
+    // A snapshot is every decrypted item plus the contents.js entry and file stamp it was
+    // loaded from, encrypted with the SL5 key. Loading one is a single decrypt, after which
+    // anything that has changed in the vault since is reloaded incrementally. A read-only
+    // keychain has no key to encrypt one with, so its snapshot is always empty.
+    //
+    // A lazy session only decrypts the items that are opened, so saveSnapshot also keeps the
+    // items of the previous snapshot, if given, that haven't changed since. The snapshot is
+    // complete if that covers every item. An eager keychain only loads a complete snapshot;
+    // a lazy one takes whatever items are still current from any snapshot. loadSnapshot
+    // returns false, leaving the keychain untouched, if the snapshot can't be used.
+    std::string saveSnapshot(const std::string& previous = std::string()) const;
+    bool loadSnapshot(const std::string& snapshot);
+
+    // Whether every item has been loaded and decrypted.
+    bool fullyDecrypted() const;
+
     std::string getTitle() {
         return title;
     }
 
-    json decryptJSON(const std::string& input) {
-        return level5_key->decryptJSON(input);
-    }
+    // 1PIF exports are unencrypted and read-only; they have no key, so these throw for them.
+    json decryptJSON(const std::string& input) const;
+    std::string encryptJSON(const json& input) const;
 
-    std::string encryptJSON(const json& input) {
-        return level5_key->encryptJSON(input);
+    bool readOnly() const {
+        return static_cast<bool>(onepif);
     }
 
+    // The directory holding the vault's item files, which is what needs watching for changes.
+    std::string dataPath() const;
+
 private:
-    void loadItem(std::string uuid);
+    struct ItemFileStamp {
+        int64_t mtime = 0;
+        int64_t size = 0;
+        uint64_t inode = 0;
+
+        bool operator!=(const ItemFileStamp& other) const {
+            return mtime != other.mtime || size != other.size || inode != other.inode;
+        }
+        bool operator==(const ItemFileStamp& other) const {
+            return !(*this != other);
+        }
+    };
+
+    std::string itemPath(const std::string& uuid) const;
+    ItemFileStamp statItem(const std::string& uuid) const;
+    // Whether a snapshot's item still matches the index entry and file stamp loaded now.
+    bool snapshotItemCurrent(const json& snapshot_item) const;
+    std::vector<KeychainIndexEntry> loadIndex();
+    KeychainItem loadItem(const KeychainIndexEntry& entry) const;
+    KeychainItem decodeItem(const KeychainIndexEntry& entry,
+                            const char* data,
+                            size_t size) const;
+    std::vector<std::string> storeItems(const std::vector<KeychainIndexEntry>& entries);
+    KeychainChangeSet refreshItems(const std::unordered_set<std::string>* touched_uuids);
+    void compactArena();
+    void reportLoadError(KeychainLoadError error);
 
     ItemMap items;
-    std::unique_ptr<AgileKeychainMasterKey> level3_key, level5_key;
+    std::unordered_map<std::string, KeychainIndexEntry> index_entries;
+    std::unordered_map<std::string, ItemFileStamp> file_stamps;
+    // Derives the SL3 key the first time it's needed. Safe to call from multiple threads.
+    const AgileKeychainMasterKey& level3Key() const;
+    std::unique_ptr<AgileKeychainMasterKey> level5_key;
+    mutable std::unique_ptr<AgileKeychainMasterKey> level3_key;
+    mutable std::once_flag level3_once;
+    // Kept only until the SL3 key has been derived. The password is wiped then, or when the
+    // keychain goes away if it never is.
+    json level3_key_data;
+    mutable std::string level3_password;
+    std::shared_ptr<const SessionKeyCache> key_cache;
+    // Decrypted item data goes here. Items replaced by a refresh leave their old data behind,
+    // so once enough of it is dead, compactArena moves the live items to a new arena.
+    std::shared_ptr<ItemArena> arena;
+    // Only set for OPVaults.
+    std::unique_ptr<OPVault> opvault;
+    // Only set for 1PIF exports.
+    std::unique_ptr<OnePIFReader> onepif;
     std::string vault_path;
     std::string title;
+    LoadMode load_mode;
+    size_t max_workers = 0;
+    ProgressCallback progress_callback;
+    std::shared_ptr<KeychainErrorSink> error_sink;
+    KeychainErrorReport error_report;
     bool loaded = false;
 };
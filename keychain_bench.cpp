@@ -0,0 +1,1011 @@
+// Benchmarks for the vault loading paths. These are hidden from the default test run; use
+// `keychain_test [bench]` to run them.
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <openssl/bio.h>
+#include <openssl/crypto.h>
+#include <openssl/buffer.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "base64.h"
+#include "catch.hpp"
+#include "crypto_registry.h"
+#include "evp_cipher.h"
+#include "item_details.h"
+#include "item_file.h"
+#include "item_reader.h"
+#include "keychain.h"
+#include "parallel_for.h"
+#include "search_index.h"
+#include "thread_local_pool.h"
+#include "totp.h"
+
+namespace {
+std::atomic<size_t> allocation_count(0);
+std::atomic<size_t> allocated_bytes(0);
+std::atomic<size_t> free_count(0);
+// Allocations OpenSSL makes through its own CRYPTO_malloc, which operator new doesn't see.
+std::atomic<size_t> crypto_allocation_count(0);
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+void* countedCryptoMalloc(size_t size) {
+    crypto_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size);
+}
+void* countedCryptoRealloc(void* ptr, size_t size) {
+    crypto_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    return std::realloc(ptr, size);
+}
+void countedCryptoFree(void* ptr) {
+    std::free(ptr);
+}
+#else
+void* countedCryptoMalloc(size_t size, const char*, int) {
+    crypto_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size);
+}
+void* countedCryptoRealloc(void* ptr, size_t size, const char*, int) {
+    crypto_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    return std::realloc(ptr, size);
+}
+void countedCryptoFree(void* ptr, const char*, int) {
+    std::free(ptr);
+}
+#endif
+
+// OpenSSL only accepts allocators before it has allocated anything, so this has to happen
+// during static initialisation.
+const bool crypto_allocations_counted =
+    CRYPTO_set_mem_functions(countedCryptoMalloc, countedCryptoRealloc, countedCryptoFree) == 1;
+
+struct BenchCounters {
+    size_t allocations;
+    size_t read_syscalls;
+};
+
+size_t readSyscallCount() {
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    size_t value;
+    while (io >> key >> value) {
+        if (key == "syscr:")
+            return value;
+    }
+    return 0;
+}
+
+long currentRSSKilobytes() {
+    std::ifstream statm("/proc/self/statm");
+    long pages_total = 0, pages_resident = 0;
+    statm >> pages_total >> pages_resident;
+    return pages_resident * (::sysconf(_SC_PAGESIZE) / 1024);
+}
+
+long peakRSSKilobytes() {
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+BenchCounters sampleCounters() {
+    const auto read_syscalls = readSyscallCount();
+    return {allocation_count.load(), read_syscalls};
+}
+
+std::vector<std::string> demoItemPaths() {
+    std::vector<std::string> paths;
+    Keychain keychain("./demo.agilekeychain", "demo", Keychain::LoadMode::Lazy);
+    for (const auto& item : keychain) {
+        paths.push_back("./demo.agilekeychain/data/default/" + item.first + ".1password");
+    }
+    return paths;
+}
+
+// Runs fn over every path `rounds` times and prints the per-item cost. fn returns the number
+// of payload bytes it found so the work can't be optimized away.
+template <typename Fn>
+void benchItems(const char* name, const std::vector<std::string>& paths, int rounds, Fn&& fn) {
+    size_t payload_bytes = 0;
+    const auto before = sampleCounters();
+    const auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (const auto& path : paths)
+            payload_bytes += fn(path);
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const auto after = sampleCounters();
+
+    const double items = static_cast<double>(paths.size()) * rounds;
+    const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+              << std::setprecision(1) << std::setw(10) << nanos / items << " ns/item"
+              << std::setw(8) << (after.allocations - before.allocations) / items << " allocs/item"
+              << std::setw(8) << (after.read_syscalls - before.read_syscalls) / items
+              << " reads/item" << std::endl;
+    REQUIRE(payload_bytes > 0);
+}
+
+using ParallelFor = std::function<void(size_t, const std::function<void(size_t)>&)>;
+
+// What parallelFor used to do: start workers - 1 new threads for every call and join them at
+// the end, so nothing they kept in thread_local storage lived past the call.
+void freshThreadsFor(size_t count, const std::function<void(size_t)>& fn, size_t workers) {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (auto index = next++; index < count; index = next++)
+            fn(index);
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+        thread.join();
+}
+
+// The size of the batches an eager load reads and decrypts at a time, each with its own
+// parallelFor, and a worker count to use whatever the machine has, so the multi-threaded path
+// is what's measured even with a single core.
+const size_t kLoadBatchSize = 256;
+const size_t kBenchWorkers = 4;
+
+// With fewer cores than workers, one thread can get through a whole batch before the others
+// have even started, which would hide what starting them costs. So each thread's first item
+// in a batch waits until every worker has one.
+std::atomic<size_t> current_batch(0);
+std::atomic<size_t> arrived_workers(0);
+
+void startBatch() {
+    arrived_workers = 0;
+    ++current_batch;
+}
+
+void waitForAllWorkers() {
+    thread_local size_t seen_batch = 0;
+    const auto batch = current_batch.load();
+    if (seen_batch == batch)
+        return;
+    seen_batch = batch;
+    ++arrived_workers;
+    while (arrived_workers.load() < kBenchWorkers)
+        std::this_thread::yield();
+}
+
+// The way OPVault items are verified: each thread keeps one context, which only redoes the key
+// schedule when the key changes.
+void threadHMAC(const std::vector<uint8_t>& key,
+                const std::vector<uint8_t>& message,
+                uint8_t* out) {
+    thread_local HMACContext context(cryptoRegistry().sha256);
+    context.compute(key.data(), key.size(), message.data(), message.size(), out);
+}
+}  // namespace
+
+void* operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (auto ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr)
+        free_count.fetch_add(1, std::memory_order_relaxed);
+    std::free(ptr);
+}
+
+TEST_CASE("Item envelope reading", "[bench][.]") {
+    const auto paths = demoItemPaths();
+    const int rounds = 200;
+
+    benchItems("ifstream >> json", paths, rounds, [](const std::string& path) {
+        json item_json;
+        std::ifstream item_fp(path);
+        item_fp >> item_json;
+        std::string encrypted = item_json["encrypted"];
+        return encrypted.size();
+    });
+
+    benchItems("ItemFile + parseItemEnvelope", paths, rounds, [](const std::string& path) {
+        ItemFile item_file(path);
+        auto envelope = parseItemEnvelope(item_file.data(), item_file.size());
+        return envelope.encryptedSize;
+    });
+}
+
+TEST_CASE("Batched item reads", "[bench][.]") {
+    // Repeat the demo items to get something closer to a real vault's size.
+    const auto demo_paths = demoItemPaths();
+    std::vector<std::string> paths;
+    while (paths.size() < 1000)
+        paths.insert(paths.end(), demo_paths.begin(), demo_paths.end());
+
+    for (auto latency_us : {0, 1000, 5000}) {
+        for (auto backend : {ItemBatchReader::Backend::IoUring,
+                             ItemBatchReader::Backend::ThreadPool}) {
+            ItemBatchReader reader(backend);
+            if (reader.backend() != backend)
+                continue;
+            reader.setSimulatedLatency(std::chrono::microseconds(latency_us));
+
+            const auto start = std::chrono::steady_clock::now();
+            const auto buffers = reader.read(paths);
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+
+            size_t payload_bytes = 0;
+            for (const auto& buffer : buffers) {
+                REQUIRE(buffer.error == 0);
+                payload_bytes += buffer.data.size();
+            }
+            REQUIRE(payload_bytes > 0);
+
+            const auto millis =
+                std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1000.0;
+            std::cout << std::left << std::setw(12)
+                      << (backend == ItemBatchReader::Backend::IoUring ? "io_uring" : "threads")
+                      << std::right << std::setw(6) << latency_us << " us latency" << std::fixed
+                      << std::setprecision(1) << std::setw(10) << millis << " ms for "
+                      << paths.size() << " files" << std::endl;
+        }
+    }
+}
+
+TEST_CASE("Batch item decryption", "[bench][.]") {
+    json keys_json;
+    std::ifstream("./demo.agilekeychain/data/default/encryptionKeys.js") >> keys_json;
+    std::unique_ptr<AgileKeychainMasterKey> level5_key;
+    for (const auto& key : keys_json["list"]) {
+        if (key["level"] == "SL5")
+            level5_key.reset(new AgileKeychainMasterKey(key, "demo"));
+    }
+    REQUIRE(level5_key);
+
+    // Keep every SL5 item file in memory so only decryption is measured, and repeat them to
+    // get something closer to a real vault's size.
+    std::vector<std::string> files;
+    for (const auto& path : demoItemPaths()) {
+        ItemFile item_file(path);
+        if (parseItemEnvelope(item_file.data(), item_file.size()).securityLevel == "SL5")
+            files.emplace_back(item_file.data(), item_file.size());
+    }
+    std::vector<EncryptedPayload> payloads;
+    size_t payload_bytes = 0;
+    while (payloads.size() < 5000) {
+        for (const auto& file : files) {
+            // The envelope's pointer refers into file, which outlives the payloads.
+            const auto envelope = parseItemEnvelope(file.data(), file.size());
+            payloads.push_back({envelope.encrypted, envelope.encryptedSize});
+            payload_bytes += envelope.encryptedSize;
+        }
+    }
+
+    // Bytes are everything allocated along the way, including the parsed JSON that's kept.
+    const auto items = static_cast<double>(payloads.size());
+    auto measure = [&](const char* name, const std::function<void()>& fn) {
+        const auto allocations = allocation_count.load();
+        const auto crypto_allocations = crypto_allocation_count.load();
+        const auto bytes = allocated_bytes.load();
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        std::cout << std::left << std::setw(24) << name << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(10) << nanos / items << " ns/item"
+                  << std::setw(10) << payload_bytes * 1000.0 / nanos << " MB/s" << std::setw(8)
+                  << (allocation_count.load() - allocations) / items << " allocs/item"
+                  << std::setw(8) << (crypto_allocation_count.load() - crypto_allocations) / items
+                  << " CRYPTO_malloc/item" << std::setw(10)
+                  << (allocated_bytes.load() - bytes) / items << " bytes/item" << std::endl;
+    };
+
+    std::vector<json> expected;
+    expected.reserve(payloads.size());
+    measure("decryptJSON", [&]() {
+        for (const auto& payload : payloads)
+            expected.push_back(level5_key->decryptJSON(payload.data, payload.size));
+    });
+
+    std::vector<json> reused;
+    reused.reserve(payloads.size());
+    measure("decryptJSON + scratch", [&]() {
+        DecryptScratch scratch;
+        for (const auto& payload : payloads)
+            reused.push_back(level5_key->decryptJSON(payload.data, payload.size, scratch));
+    });
+    REQUIRE(reused == expected);
+
+    std::vector<DecryptedPayload> results;
+    measure("decryptItems", [&]() { results = level5_key->decryptItems(payloads); });
+
+    for (size_t index = 0; index < payloads.size(); ++index) {
+        REQUIRE(results[index].error.empty());
+        REQUIRE(results[index].value == expected[index]);
+    }
+
+    // Batch by batch, the way an eager load goes, with each worker taking a scratch (and its
+    // cipher context) from its own thread's pool for every chunk like decryptItems does. Only
+    // long-lived workers find the pool full of what they set up for the last batch.
+    std::atomic<size_t> decrypted(0);
+    auto decrypt_in_batches = [&](const ParallelFor& parallel) {
+        const size_t chunks = kBenchWorkers * 4;
+        for (size_t start = 0; start < payloads.size(); start += kLoadBatchSize) {
+            const auto size = std::min(kLoadBatchSize, payloads.size() - start);
+            startBatch();
+            parallel(chunks, [&](size_t chunk) {
+                waitForAllWorkers();
+                auto scratch = ThreadLocalPool<DecryptScratch>::acquire();
+                for (auto index = start + size * chunk / chunks;
+                     index < start + size * (chunk + 1) / chunks;
+                     ++index) {
+                    decrypted += level5_key->decrypt(payloads[index].data, payloads[index].size,
+                                                     *scratch).size();
+                    scratch->wipe();
+                }
+            });
+        }
+    };
+    measure("batches, fresh threads", [&]() {
+        decrypt_in_batches([](size_t count, const std::function<void(size_t)>& fn) {
+            freshThreadsFor(count, fn, kBenchWorkers);
+        });
+    });
+    measure("batches, worker pool", [&]() {
+        decrypt_in_batches([](size_t count, const std::function<void(size_t)>& fn) {
+            parallelFor(count, fn, kBenchWorkers);
+        });
+    });
+    REQUIRE(decrypted > 0);
+}
+
+// The BIO chain base64Encode and base64Decode used to build for every call, for comparison.
+std::string bioEncode(const std::vector<uint8_t>& data) {
+    auto b64 = BIO_push(BIO_new(BIO_f_base64()), BIO_new(BIO_s_mem()));
+    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+    BIO_write(b64, data.data(), data.size());
+    BIO_flush(b64);
+    BUF_MEM* bptr;
+    BIO_get_mem_ptr(b64, &bptr);
+    std::string ret(bptr->data, bptr->length);
+    BIO_free_all(b64);
+    return ret;
+}
+
+std::vector<uint8_t> bioDecode(const std::string& data) {
+    auto b64 = BIO_push(BIO_new(BIO_f_base64()), BIO_new_mem_buf(data.data(), data.size()));
+    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+    std::vector<uint8_t> ret(data.size() / 4 * 3);
+    ret.resize(std::max(BIO_read(b64, ret.data(), ret.size()), 0));
+    BIO_free_all(b64);
+    return ret;
+}
+
+TEST_CASE("Base64 codec", "[bench][.]") {
+    std::mt19937 rng(20161017);
+    std::uniform_int_distribution<int> byte(0, 255);
+    const char* names[] = {"scalar", "sse4.1", "avx2"};
+
+    std::cout << std::setw(8) << "bytes" << std::setw(10) << "codec" << std::setw(14)
+              << "decode MB/s" << std::setw(14) << "escaped MB/s" << std::setw(14)
+              << "encode MB/s" << std::endl;
+    for (size_t size : {64, 256, 1024, 4096, 65536, 1 << 20}) {
+        std::vector<uint8_t> data(size);
+        for (auto& value : data)
+            value = byte(rng);
+        const auto encoded = base64Encode(data);
+        std::string escaped;
+        for (char ch : encoded) {
+            if (ch == '/')
+                escaped += '\\';
+            escaped += ch;
+        }
+
+        // About 64 MB of input per measurement.
+        const size_t rounds = std::max<size_t>(1, (64 << 20) / size);
+        auto rate = [&](const std::function<size_t()>& fn) {
+            size_t checksum = 0;
+            const auto start = std::chrono::steady_clock::now();
+            for (size_t round = 0; round < rounds; ++round)
+                checksum += fn();
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            const auto nanos =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+            REQUIRE(checksum > 0);
+            return static_cast<double>(size) * rounds * 1000.0 / nanos;
+        };
+
+        std::cout << std::fixed << std::setprecision(0);
+        std::cout << std::setw(8) << size << std::setw(10) << "BIO" << std::setw(14)
+                  << rate([&]() { return bioDecode(encoded).size(); }) << std::setw(14) << "-"
+                  << std::setw(14) << rate([&]() { return bioEncode(data).size(); })
+                  << std::endl;
+
+        std::vector<uint8_t> decoded;
+        for (auto backend : {Base64Backend::Scalar, Base64Backend::SSE41, Base64Backend::AVX2}) {
+            if (!base64BackendSupported(backend))
+                continue;
+            const auto decode = rate([&]() {
+                base64Decode(encoded.data(), encoded.size(), decoded, backend);
+                return decoded.size();
+            });
+            REQUIRE(decoded == data);
+            const auto decode_escaped = rate([&]() {
+                base64Decode(escaped.data(), escaped.size(), decoded, backend);
+                return decoded.size();
+            });
+            REQUIRE(decoded == data);
+            const auto encode =
+                rate([&]() { return base64Encode(data.data(), data.size(), backend).size(); });
+            std::cout << std::setw(8) << size << std::setw(10)
+                      << names[static_cast<int>(backend)] << std::setw(14) << decode
+                      << std::setw(14) << decode_escaped << std::setw(14) << encode
+                      << std::endl;
+        }
+    }
+}
+
+TEST_CASE("Cipher context reuse", "[bench][.]") {
+    json keys_json;
+    std::ifstream("./demo.agilekeychain/data/default/encryptionKeys.js") >> keys_json;
+    AgileKeychainMasterKey key(keys_json["list"][0], "demo");
+    const json item = {{"notesPlain", std::string(600, 'x')},
+                       {"fields", {{{"name", "password"}, {"value", "hunter2"}}}}};
+    const auto encrypted = key.encryptJSON(item);
+    const std::vector<uint8_t> message(1024, 0x5a);
+    EVPKey cipher_key;
+    EVPIv cipher_iv;
+    cipher_key.fill(0x11);
+    cipher_iv.fill(0x22);
+
+    if (!crypto_allocations_counted)
+        std::cout << "(OpenSSL's own allocations can't be counted with this build)" << std::endl;
+    const int rounds = 20000;
+    auto measure = [&](const char* name, const std::function<void()>& fn) {
+        // Warm up this thread's pools first; only the steady state is of interest.
+        fn();
+        const auto allocations = allocation_count.load();
+        const auto crypto_allocations = crypto_allocation_count.load();
+        const auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; ++round)
+            fn();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(10) << nanos / rounds << " ns/msg"
+                  << std::setw(8) << (allocation_count.load() - allocations) / double(rounds)
+                  << " new/msg" << std::setw(8)
+                  << (crypto_allocation_count.load() - crypto_allocations) / double(rounds)
+                  << " CRYPTO_malloc/msg" << std::endl;
+    };
+
+    measure("EVPCipher per message", [&]() {
+        EVPCipher cipher(EVP_aes_128_cbc(), cipher_key, cipher_iv, true);
+        cipher.update(message);
+        cipher.finalize();
+    });
+    measure("leaseCipher", [&]() {
+        auto cipher = leaseCipher(EVP_aes_128_cbc(), cipher_key, cipher_iv, true);
+        cipher->update(message);
+        cipher->finalize();
+    });
+    DecryptScratch scratch;
+    measure("decrypt into scratch", [&]() {
+        key.decrypt(encrypted.data(), encrypted.size(), scratch);
+        scratch.wipe();
+    });
+    // These two also count the allocations for the JSON and the base64 text.
+    measure("decryptJSON", [&]() { REQUIRE(key.decryptJSON(encrypted) == item); });
+    measure("encryptJSON", [&]() { key.encryptJSON(item); });
+}
+
+TEST_CASE("Digest and HMAC contexts", "[bench][.]") {
+    std::vector<uint8_t> key(32, 0x11), other_key(32, 0x22), message(512, 0x5a), password(1024, 7);
+    uint8_t out[EVP_MAX_MD_SIZE];
+    const int rounds = 50000;
+    auto measure = [&](const char* name, const std::function<void()>& fn) {
+        fn();
+        const auto crypto_allocations = crypto_allocation_count.load();
+        const auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; ++round)
+            fn();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(10) << nanos / rounds << " ns/msg"
+                  << std::setw(8)
+                  << (crypto_allocation_count.load() - crypto_allocations) / double(rounds)
+                  << " CRYPTO_malloc/msg" << std::endl;
+    };
+
+    measure("HMAC() one-shot", [&]() {
+        unsigned int size;
+        HMAC(EVP_sha256(), key.data(), key.size(), message.data(), message.size(), out, &size);
+    });
+    HMACContext hmac(cryptoRegistry().sha256);
+    measure("HMACContext, same key", [&]() {
+        hmac.compute(key.data(), key.size(), message.data(), message.size(), out);
+    });
+    bool flip = false;
+    measure("HMACContext, new key", [&]() {
+        flip = !flip;
+        const auto& current = flip ? key : other_key;
+        hmac.compute(current.data(), current.size(), message.data(), message.size(), out);
+    });
+
+    // The two MD5s behind every agilekeychain item key, over a 1 KB master key.
+    const uint8_t salt[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    measure("fresh context, EVP_md5()", [&]() {
+        for (int i = 0; i < 2; ++i) {
+            DigestContext ctx;
+            ctx.init(EVP_md5());
+            ctx.update(password.data(), password.size());
+            ctx.update(salt, sizeof(salt));
+            ctx.final(out);
+        }
+    });
+    DigestContext prefix, digest;
+    prefix.init(cryptoRegistry().md5);
+    prefix.update(password.data(), password.size());
+    measure("DigestContext with prefix", [&]() {
+        digest.initFrom(prefix);
+        digest.update(salt, sizeof(salt));
+        digest.final(out);
+        digest.init(cryptoRegistry().md5);
+        digest.update(out, 16);
+        digest.update(password.data(), password.size());
+        digest.update(salt, sizeof(salt));
+        digest.final(out);
+    });
+
+    // An eager load gives each batch its own parallel call, with the same key for every item.
+    // A thread's context only keeps its key schedule from one batch to the next if the thread
+    // is still there for it.
+    const size_t batches = 20;
+    auto measure_batches = [&](const char* name, const ParallelFor& parallel) {
+        auto run = [&]() {
+            for (size_t batch = 0; batch < batches; ++batch) {
+                startBatch();
+                parallel(kLoadBatchSize, [&](size_t) {
+                    waitForAllWorkers();
+                    uint8_t item_out[EVP_MAX_MD_SIZE];
+                    threadHMAC(key, message, item_out);
+                });
+            }
+        };
+        run();
+        const auto crypto_allocations = crypto_allocation_count.load();
+        const auto start = std::chrono::steady_clock::now();
+        run();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        const double items = batches * kLoadBatchSize;
+        // Per batch, since setting up a thread's context is spread over the whole batch.
+        std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(10) << nanos / items << " ns/msg"
+                  << std::setw(8)
+                  << (crypto_allocation_count.load() - crypto_allocations) / double(batches)
+                  << " CRYPTO_malloc/batch" << std::endl;
+    };
+    measure_batches("HMAC batches, fresh threads",
+                    [](size_t count, const std::function<void(size_t)>& fn) {
+                        freshThreadsFor(count, fn, kBenchWorkers);
+                    });
+    measure_batches("HMAC batches, worker pool",
+                    [](size_t count, const std::function<void(size_t)>& fn) {
+                        parallelFor(count, fn, kBenchWorkers);
+                    });
+}
+
+// How fields were checked for otpauth URIs, and their codes worked out, before they were parsed
+// into TOTPDescriptors at load time; SHA-1 only, which is all the benchmark uses.
+const std::regex kOldURIRegex(
+    "otpauth://(totp|hotp)/(?:[^\\?]+)\\?((?:(?:[^=]+)=(?:[^\\&]+)\\&?)+)",
+    std::regex::ECMAScript | std::regex::optimize);
+const std::regex kOldQueryComponentRegex("([^=]+)=([^\\&]+)&?",
+                                         std::regex::ECMAScript | std::regex::optimize);
+
+std::string regexTOTP(const std::string& uri, time_t now) {
+    std::smatch match;
+    if (!std::regex_match(uri, match, kOldURIRegex))
+        throw std::runtime_error("Error parsing OTP URI");
+    const auto query = match[2].str();
+    std::unordered_map<std::string, std::string> params;
+    for (std::sregex_iterator it(query.begin(), query.end(), kOldQueryComponentRegex), end;
+         it != end;
+         ++it)
+        params.emplace((*it)[1], (*it)[2]);
+
+    std::vector<uint8_t> key;
+    unsigned int bits_value = 0;
+    int bits = 0;
+    for (auto ch : params["secret"]) {
+        ch = ch >= 'A' && ch <= 'Z' ? ch - 'A' : ch - '2' + 26;
+        bits_value = (bits_value << 5) | ch;
+        bits += 5;
+        if (bits >= 8) {
+            key.push_back((bits_value >> (bits - 8)) & 255);
+            bits -= 8;
+        }
+    }
+
+    uint64_t counter = now / 30;
+    std::vector<uint8_t> counter_bytes(8);
+    for (int i = 7; i >= 0; i--, counter >>= 8)
+        counter_bytes[i] = counter & 0xff;
+    HMACContext hmac(cryptoRegistry().sha1);
+    std::vector<uint8_t> mac(hmac.size());
+    hmac.compute(key.data(), key.size(), counter_bytes.data(), counter_bytes.size(), mac.data());
+    const auto offset = mac[19] & 0xf;
+    const uint32_t truncated = (mac[offset] & 0x7f) << 24 | mac[offset + 1] << 16 |
+        mac[offset + 2] << 8 | mac[offset + 3];
+    std::stringstream ss;
+    ss << std::setw(6) << std::setfill('0') << truncated % 1000000;
+    return ss.str();
+}
+
+TEST_CASE("TOTP fields", "[bench][.]") {
+    // Roughly what a vault's field values look like: one in fifty is an otpauth URI.
+    std::mt19937 rng(20161017);
+    std::vector<std::string> values;
+    for (int i = 0; i < 1000; ++i) {
+        std::stringstream value;
+        switch (i % 50) {
+            case 0:
+                value << "otpauth://totp/Example:user" << i
+                      << "?secret=JBSWY3DPEHPK3PXPJBSWY3DPEHPK3PXP&issuer=Example";
+                break;
+            case 1:
+                value << "https://example.com/login?user=" << i;
+                break;
+            default:
+                for (int j = 0, size = 8 + rng() % 24; j < size; ++j)
+                    value << static_cast<char>('a' + rng() % 26);
+        }
+        values.push_back(value.str());
+    }
+    const auto uri = values[0];
+    const auto descriptor = parseTOTPURI(uri);
+    REQUIRE(regexTOTP(uri, 1234567890) == descriptor.code(1234567890));
+
+    auto measure = [&](const char* name, const char* unit, int rounds, std::function<void()> fn) {
+        fn();
+        const auto allocations = allocation_count.load();
+        const auto crypto_allocations = crypto_allocation_count.load();
+        const auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; ++round)
+            fn();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(10) << nanos / double(rounds) << " ns/"
+                  << unit << std::setw(8)
+                  << (allocation_count.load() - allocations) / double(rounds) << " new"
+                  << std::setw(8)
+                  << (crypto_allocation_count.load() - crypto_allocations) / double(rounds)
+                  << " CRYPTO_malloc" << std::endl;
+    };
+
+    // Detection is what every field of every item shown paid for.
+    size_t found = 0, next = 0;
+    const int fields = 200 * values.size();
+    measure("detect, regex", "field", fields, [&]() {
+        found += std::regex_match(values[next++ % values.size()], kOldURIRegex);
+    });
+    measure("detect, isTOTPURI", "field", fields, [&]() {
+        found += isTOTPURI(values[next++ % values.size()]);
+    });
+    REQUIRE(found > 0);
+
+    time_t now = 1234567890;
+    measure("code, regex and map", "code", 20000, [&]() { regexTOTP(uri, now++); });
+    char code[TOTPDescriptor::kMaxDigits + 1];
+    measure("code, TOTPDescriptor", "code", 20000, [&]() { descriptor.code(now++, code); });
+    measure("parseTOTPURI", "uri", 20000, [&]() { parseTOTPURI(uri); });
+}
+
+// How a code was worked out from a decoded key before there were TOTPDescriptors: a new HMAC
+// context every time, formatted through a stringstream.
+std::string legacyTOTPCode(const TOTPDescriptor& totp, time_t now) {
+    const EVP_MD* algorithms[] = {
+        cryptoRegistry().sha1, cryptoRegistry().sha256, cryptoRegistry().sha512};
+    const std::vector<uint8_t> key(totp.key, totp.key + totp.key_size);
+    uint64_t counter = now / totp.period;
+    std::vector<uint8_t> counter_bytes(8);
+    for (int i = 7; i >= 0; i--, counter >>= 8)
+        counter_bytes[i] = counter & 0xff;
+    HMACContext hmac(algorithms[totp.algorithm]);
+    std::vector<uint8_t> mac(hmac.size());
+    hmac.compute(key.data(), key.size(), counter_bytes.data(), counter_bytes.size(), mac.data());
+    const auto offset = mac.back() & 0xf;
+    const uint32_t truncated = (mac[offset] & 0x7f) << 24 | mac[offset + 1] << 16 |
+        mac[offset + 2] << 8 | mac[offset + 3];
+    std::stringstream ss;
+    const int digits_pow = pow(10, totp.digits);
+    ss << std::setw(totp.digits) << std::setfill('0') << truncated % digits_pow;
+    return ss.str();
+}
+
+TEST_CASE("TOTP batch", "[bench][.]") {
+    // A few hundred service accounts, mostly on SHA-1 like most issuers.
+    std::mt19937 rng(20161017);
+    std::vector<TOTPDescriptor> descriptors(500);
+    for (auto& totp : descriptors) {
+        totp = TOTPDescriptor();
+        const auto pick = rng() % 10;
+        totp.algorithm = pick < 8 ? TOTPDescriptor::SHA1
+                                  : (pick == 8 ? TOTPDescriptor::SHA256 : TOTPDescriptor::SHA512);
+        totp.key_size = 20;
+        for (size_t i = 0; i < totp.key_size; ++i)
+            totp.key[i] = rng();
+        totp.digits = 6;
+        totp.period = 30;
+    }
+    const time_t now = 1234567890;
+    for (const auto& totp : descriptors)
+        REQUIRE(legacyTOTPCode(totp, now) == totp.code(now));
+
+    std::vector<char> out(descriptors.size() * 5 * TOTPDescriptor::kCodeSize);
+    auto measure = [&](const char* name, size_t codes_per_round, const std::function<void()>& fn) {
+        fn();
+        const auto allocations = allocation_count.load();
+        const auto crypto_allocations = crypto_allocation_count.load();
+        const int rounds = 20;
+        const auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; ++round)
+            fn();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        const double codes = double(codes_per_round) * rounds;
+        std::cout << std::left << std::setw(32) << name << std::right << std::fixed
+                  << std::setprecision(0) << std::setw(10) << codes * 1e9 / nanos << " codes/s"
+                  << std::setprecision(1) << std::setw(8)
+                  << (allocation_count.load() - allocations) / codes << " new" << std::setw(8)
+                  << (crypto_allocation_count.load() - crypto_allocations) / codes
+                  << " CRYPTO_malloc" << std::endl;
+    };
+
+    measure("per code, legacy", descriptors.size(), [&]() {
+        for (const auto& totp : descriptors)
+            legacyTOTPCode(totp, now);
+    });
+    measure("per code, TOTPDescriptor", descriptors.size(), [&]() {
+        for (size_t index = 0; index < descriptors.size(); ++index)
+            descriptors[index].code(now, &out[index * TOTPDescriptor::kCodeSize]);
+    });
+    measure("calculateTOTPCodes", descriptors.size(), [&]() {
+        calculateTOTPCodes(descriptors.data(), descriptors.size(), now, 0, out.data());
+    });
+    measure("calculateTOTPCodes, next 4", descriptors.size() * 5, [&]() {
+        calculateTOTPCodes(descriptors.data(), descriptors.size(), now, 4, out.data());
+    });
+}
+
+TEST_CASE("Search index", "[bench][.]") {
+    // Titles made of a few made-up words, like "Torvex Milan 1234", already folded.
+    std::mt19937 rng(20161017);
+    const char* syllables[] = {"ka", "to", "mi", "rex", "lan", "vo", "sun", "pe", "dri", "ox",
+                               "na", "bel", "qu", "is", "tor", "gen", "fa", "ly", "zu", "chi"};
+    std::vector<std::string> words(400);
+    for (auto& word : words) {
+        for (int i = 0, size = 2 + rng() % 3; i < size; ++i)
+            word += syllables[rng() % 20];
+    }
+    std::vector<std::string> titles(100000);
+    for (auto& title : titles) {
+        title = words[rng() % words.size()] + " " + words[rng() % words.size()] + " " +
+            std::to_string(rng() % 10000);
+    }
+
+    const auto build_start = std::chrono::steady_clock::now();
+    const SearchIndex index(titles);
+    const auto build_time = std::chrono::steady_clock::now() - build_start;
+    std::cout << "build, " << titles.size() << " titles: "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(build_time).count() << " ms"
+              << std::endl;
+
+    // Typing out one of the titles, then something that isn't there.
+    std::vector<std::string> queries;
+    for (const auto& typed : {titles[1234], std::string("zzyzx")}) {
+        for (size_t size = 1; size <= typed.size(); ++size)
+            queries.push_back(typed.substr(0, size));
+    }
+
+    std::vector<uint32_t> matches, expected;
+    double scan_total = 0, index_total = 0, index_worst = 0;
+    for (const auto& query : queries) {
+        auto start = std::chrono::steady_clock::now();
+        expected.clear();
+        for (uint32_t id = 0; id < titles.size(); ++id) {
+            if (titles[id].find(query) != std::string::npos)
+                expected.push_back(id);
+        }
+        const auto scan_micros =
+            std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start)
+                .count();
+
+        start = std::chrono::steady_clock::now();
+        index.find(query, matches);
+        const auto index_micros =
+            std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start)
+                .count();
+        REQUIRE(matches == expected);
+
+        scan_total += scan_micros;
+        index_total += index_micros;
+        index_worst = std::max(index_worst, index_micros);
+        std::cout << std::left << std::setw(24) << ("\"" + query + "\"") << std::right
+                  << std::setw(8) << matches.size() << " matches" << std::fixed
+                  << std::setprecision(1) << std::setw(10) << scan_micros << " us scan"
+                  << std::setw(10) << index_micros << " us index" << std::endl;
+    }
+    std::cout << "mean per keystroke: " << scan_total / queries.size() << " us scan, "
+              << index_total / queries.size() << " us index (worst " << index_worst << " us)"
+              << std::endl;
+}
+
+TEST_CASE("Item details parsing", "[bench][.]") {
+    json keys_json;
+    std::ifstream("./demo.agilekeychain/data/default/encryptionKeys.js") >> keys_json;
+    std::vector<std::unique_ptr<AgileKeychainMasterKey>> keys;
+    for (const auto& key : keys_json["list"])
+        keys.emplace_back(new AgileKeychainMasterKey(key, "demo"));
+
+    std::vector<std::string> plaintexts;
+    for (const auto& path : demoItemPaths()) {
+        ItemFile item_file(path);
+        const auto envelope = parseItemEnvelope(item_file.data(), item_file.size());
+        for (const auto& key : keys) {
+            if (key->level != envelope.securityLevel)
+                continue;
+            DecryptScratch scratch;
+            const auto& plaintext =
+                key->decrypt(envelope.encrypted, envelope.encryptedSize, scratch);
+            plaintexts.emplace_back(plaintext.begin(), plaintext.end());
+        }
+    }
+
+    const int rounds = 500;
+    const double items = static_cast<double>(plaintexts.size()) * rounds;
+    auto measure = [&](const char* name, const std::function<size_t(const std::string&)>& fn) {
+        size_t fields = 0;
+        const auto allocations = allocation_count.load();
+        const auto bytes = allocated_bytes.load();
+        const auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; ++round) {
+            for (const auto& plaintext : plaintexts)
+                fields += fn(plaintext);
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        std::cout << std::left << std::setw(24) << name << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(10) << nanos / items << " ns/item"
+                  << std::setw(8) << (allocation_count.load() - allocations) / items
+                  << " allocs/item" << std::setw(10) << (allocated_bytes.load() - bytes) / items
+                  << " bytes/item" << std::endl;
+        REQUIRE(fields > 0);
+    };
+
+    measure("json DOM", [](const std::string& plaintext) {
+        return itemDetailsFromJSON(json::parse(plaintext)).fields.size();
+    });
+    measure("single pass scan", [](const std::string& plaintext) {
+        return parseItemDetails(plaintext.data(), plaintext.size()).fields.size();
+    });
+}
+
+TEST_CASE("1PIF import throughput", "[bench][.]") {
+    // Build a large export out of the demo records, with fresh uuids so none collide.
+    const std::string bench_path = "./bench_import.1pif";
+    std::vector<json> records;
+    {
+        std::ifstream demo("./demo.1pif/data.1pif");
+        std::string line;
+        while (std::getline(demo, line)) {
+            if (!line.empty() && line.compare(0, 3, "***") != 0)
+                records.push_back(json::parse(line));
+        }
+    }
+    REQUIRE_FALSE(records.empty());
+    {
+        std::ofstream out(bench_path);
+        for (size_t i = 0; i < 200000; ++i) {
+            auto record = records[i % records.size()];
+            std::ostringstream uuid;
+            uuid << std::hex << std::uppercase << std::setw(32) << std::setfill('0') << i;
+            record["uuid"] = uuid.str();
+            out << record << "\n***5642bee8-a5ff-11dc-8314-0800200c9a66***\n";
+        }
+    }
+
+    struct stat st;
+    REQUIRE(::stat(bench_path.c_str(), &st) == 0);
+    const double megabytes = st.st_size / (1024.0 * 1024.0);
+
+    for (auto mode : {Keychain::LoadMode::Lazy, Keychain::LoadMode::Eager}) {
+        const auto rss_before = peakRSSKilobytes();
+        const auto start = std::chrono::steady_clock::now();
+        Keychain keychain(bench_path, "", mode);
+        const auto count = std::distance(keychain.begin(), keychain.end());
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        REQUIRE(count > 0);
+
+        const auto seconds = std::chrono::duration<double>(elapsed).count();
+        std::cout << std::left << std::setw(28)
+                  << (mode == Keychain::LoadMode::Lazy ? "1PIF index (lazy)" : "1PIF full (eager)")
+                  << std::right << std::fixed << std::setprecision(1) << std::setw(10)
+                  << megabytes / seconds << " MB/s" << std::setw(10) << megabytes << " MB"
+                  << std::setw(10) << (peakRSSKilobytes() - rss_before) / 1024.0
+                  << " MB peak RSS growth" << std::endl;
+    }
+
+    std::remove(bench_path.c_str());
+}
+
+TEST_CASE("Item storage", "[bench][.]") {
+    Keychain keychain("./demo.agilekeychain", "demo");
+    const auto count = std::distance(keychain.begin(), keychain.end());
+    REQUIRE(count > 0);
+
+    // What one load allocates, and how much of that stays allocated while the items are held.
+    keychain.unloadItems();
+    const auto allocs_before = allocation_count.load();
+    const auto live_before = allocation_count.load() - free_count.load();
+    keychain.reloadItems();
+    const auto allocs_during = allocation_count.load() - allocs_before;
+    const auto live_after = allocation_count.load() - free_count.load();
+
+    // Repeated reloads are where fragmentation would show up.
+    const int rounds = 500;
+    const auto rss_before = currentRSSKilobytes();
+    for (int round = 0; round < rounds; ++round)
+        keychain.reloadItems();
+    const auto rss_after = currentRSSKilobytes();
+
+    std::cout << std::fixed << std::setprecision(1) << "allocations per item during load: "
+              << static_cast<double>(allocs_during) / count << std::endl
+              << "allocations per item retained:    "
+              << static_cast<double>(live_after - live_before) / count << std::endl
+              << "RSS before " << rounds << " reloads: " << rss_before << " KiB, after: "
+              << rss_after << " KiB" << std::endl;
+}
+
+TEST_CASE("Unlock", "[bench][.]") {
+    const int rounds = 10;
+    auto time_unlocks = [rounds](const char* label,
+                                 std::shared_ptr<const SessionKeyCache> key_cache) {
+        const auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; ++round)
+            Keychain keychain("./demo.agilekeychain", "demo", Keychain::LoadMode::Lazy, key_cache);
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        std::cout << label << ": " << micros / rounds / 1000.0 << " ms" << std::endl;
+    };
+    time_unlocks("unlock", nullptr);
+
+    if (!SessionKeyCache::available())
+        return;
+    // The first unlock fills the cache, the rest are served from it.
+    auto key_cache = std::make_shared<SessionKeyCache>(60);
+    Keychain warm("./demo.agilekeychain", "demo", Keychain::LoadMode::Lazy, key_cache);
+    time_unlocks("cached unlock", key_cache);
+}
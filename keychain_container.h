@@ -1,18 +1,24 @@
 #pragma once
 
+#include <map>
+
 #include <gtkmm.h>
 
 #include "helper.h"
 #include "keychain_view.h"
 #include "lock_screen.h"
+#include "snapshot_cache.h"
+#include "unlock_task.h"
+#include "vault_watcher.h"
 
 class KeychainContainer : public Gtk::Bin {
 public:
     KeychainContainer(std::string path) : Gtk::Bin() {
-        lock_screen = std::unique_ptr<LockScreen>(
-            new LockScreen([this](std::string path, std::string master_password) {
+        lock_screen = std::unique_ptr<LockScreen>(new LockScreen(
+            [this](std::string path, std::string master_password) {
                 unlock_callback(path, master_password);
-            }));
+            },
+            [this]() { cancelUnlock(); }));
         if (!path.empty()) {
             lock_screen->setPath(path);
         }
@@ -21,15 +27,23 @@ public:
     }
 
     void refresh() {
-        keychain_object->reloadItems();
-        keychain_view = std::unique_ptr<KeychainView>(new KeychainView(keychain_object));
-        remove();
-        add(*keychain_view);
-        show_all_children();
+        if (!keychain_object)
+            return;
+        KeychainChangeSet changes;
+        try {
+            changes = keychain_object->refreshItems();
+        } catch (std::exception& e) {
+            errorDialog(e.what());
+            return;
+        }
+        keychain_view->applyChanges(changes);
     }
 
     void lock() {
+        cancelUnlock();
+        saveSnapshot();
         remove();
+        vault_watcher.reset();
         keychain_object.reset();
         keychain_view.reset();
         add(*lock_screen);
@@ -52,27 +66,146 @@ public:
         return lock_screen->getPath();
     }
 
+    // Master keys are cached here across launches, if set. Takes effect from the next unlock.
+    void setKeyCache(std::shared_ptr<const SessionKeyCache> cache) {
+        key_cache = std::move(cache);
+    }
+
+    // Whether unlocking decrypts every item up front. Takes effect from the next unlock.
+    void setLoadMode(Keychain::LoadMode mode) {
+        load_mode = mode;
+    }
+
 protected:
-    void unlock_impl(std::string path, std::string master_password) {
-        try {
-            keychain_object = std::make_shared<Keychain>(path, master_password);
-        } catch (std::exception& e) {
-            errorDialog(e.what());
+    // Unlocking happens on a worker thread; on_unlocked is called once the vault is shown.
+    void unlock_impl(std::string path,
+                     std::string master_password,
+                     std::function<void()> on_unlocked = nullptr) {
+        cancelUnlock();
+        lock_screen->setBusy(true);
+
+        const auto task_id = ++last_task_id;
+        auto progress_cb = [this, task_id](size_t done, size_t total) {
+            if (task_id == current_task_id)
+                lock_screen->setProgress(done, total);
+        };
+        auto done_cb = [this, task_id, path, on_unlocked](std::shared_ptr<Keychain> keychain,
+                                                          const std::string& error) {
+            unlockFinished(task_id, path, keychain, error, on_unlocked);
+        };
+        current_task_id = task_id;
+        unlock_tasks[task_id] =
+            std::make_shared<UnlockTask>(
+                path, master_password, load_mode, key_cache, progress_cb, done_cb);
+    }
+
+    // Key derivation can't be interrupted, so a cancelled task is left to finish in the
+    // background and its result is thrown away.
+    void cancelUnlock() {
+        if (current_task_id == 0)
+            return;
+        unlock_tasks[current_task_id]->cancel();
+        current_task_id = 0;
+        lock_screen->setBusy(false);
+    }
+
+    // The task is still on the stack when it reports back, so keep it alive until the main loop
+    // is idle again.
+    void releaseUnlockTask(unsigned int task_id) {
+        auto it = unlock_tasks.find(task_id);
+        if (it == unlock_tasks.end())
+            return;
+        auto finished_task = it->second;
+        unlock_tasks.erase(it);
+        Glib::signal_idle().connect_once([finished_task]() {});
+    }
+
+    void unlockFinished(unsigned int task_id,
+                        std::string path,
+                        std::shared_ptr<Keychain> keychain,
+                        const std::string& error,
+                        std::function<void()> on_unlocked) {
+        releaseUnlockTask(task_id);
+        if (task_id != current_task_id)
+            return;
+        current_task_id = 0;
+        lock_screen->setBusy(false);
+        if (!keychain) {
+            if (!error.empty())
+                errorDialog(error);
             return;
         }
+
+        keychain_object = keychain;
+        vault_path = path;
+
         remove();
         keychain_view = std::unique_ptr<KeychainView>(new KeychainView(keychain_object));
         add(*keychain_view);
         show_all_children();
+
+        try {
+            auto changed_cb = [this](const std::unordered_set<std::string>& uuids) {
+                vaultChanged(uuids);
+            };
+            vault_watcher = std::unique_ptr<VaultWatcher>(new VaultWatcher(keychain->dataPath(), changed_cb));
+        } catch (Glib::Error& e) {
+            // Without a watcher the vault can still be refreshed by hand.
+            vault_watcher.reset();
+        }
+
+        if (on_unlocked)
+            on_unlocked();
     }
+
+    void vaultChanged(const std::unordered_set<std::string>& uuids) {
+        if (!keychain_object)
+            return;
+        KeychainChangeSet changes;
+        try {
+            changes = keychain_object->refreshItems(uuids);
+        } catch (std::exception& e) {
+            // contents.js may be half-written mid-sync; the next event will retry.
+            return;
+        }
+        keychain_view->applyChanges(changes);
+    }
+
+    // A lazily loaded vault usually has only a few items decrypted, so the unchanged items of
+    // the previous snapshot are kept alongside them. A read-only keychain has no key to
+    // encrypt a snapshot with.
+    void saveSnapshot() {
+        if (!keychain_object || keychain_object->readOnly())
+            return;
+        try {
+            SnapshotCache cache(vault_path);
+            std::string previous;
+            if (!keychain_object->fullyDecrypted())
+                previous = cache.load();
+            cache.save(keychain_object->saveSnapshot(previous));
+        } catch (std::exception& e) {
+            errorDialog(e.what());
+        } catch (Glib::Error& e) {
+            errorDialog(e.what());
+        }
+    }
+
     void unlock_callback(std::string path, std::string master_password) {
-        unlock_impl(path, master_password);
-        parent_unlock_cb(path, lock_screen->getPassword());
-        lock_screen->clearPassword();
+        unlock_impl(path, master_password, [this, path, master_password]() {
+            parent_unlock_cb(path, master_password);
+            lock_screen->clearPassword();
+        });
     }
 
     std::unique_ptr<LockScreen> lock_screen;
     std::shared_ptr<Keychain> keychain_object;
     std::unique_ptr<KeychainView> keychain_view;
+    std::unique_ptr<VaultWatcher> vault_watcher;
+    std::shared_ptr<const SessionKeyCache> key_cache;
+    Keychain::LoadMode load_mode = Keychain::LoadMode::Lazy;
+    std::map<unsigned int, std::shared_ptr<UnlockTask>> unlock_tasks;
+    unsigned int last_task_id = 0;
+    unsigned int current_task_id = 0;
+    std::string vault_path;
     std::function<void(std::string title, std::string password)> parent_unlock_cb;
 };
@@ -1,5 +1,23 @@
 #include "keychain.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <random>
+#include <regex>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base64.h"
+#include "item_details.h"
+#include "item_file.h"
+#include "item_reader.h"
+#include "search_index.h"
+#include "totp.h"
 
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
@@ -12,10 +30,1156 @@ TEST_CASE("Keychain", "[keychain]") {
                   << "Notes: " << item.second.notes << std::endl;
 
         for (const auto& section : item.second.sections) {
-            std::cout << "Section: " << section.first << std::endl;
-            for (const auto& field : section.second) {
+            std::cout << "Section: " << section.title << std::endl;
+            for (const auto& field : section.fields) {
                 std::cout << "\t" << field.name << ": " << field.value << std::endl;
             }
         }
     }
 }
+
+TEST_CASE("Wrong master password is rejected", "[keychain]") {
+    REQUIRE_THROWS(Keychain("./demo.agilekeychain", "not the password"));
+}
+
+TEST_CASE("Session key cache skips key derivation", "[keychain]") {
+    if (!SessionKeyCache::available())
+        return;
+
+    json keys_json;
+    std::ifstream("./demo.agilekeychain/data/default/encryptionKeys.js") >> keys_json;
+    auto key_cache = std::make_shared<SessionKeyCache>(60);
+    for (const auto& key : keys_json["list"])
+        key_cache->forget(key["identifier"]);
+
+    Keychain uncached("./demo.agilekeychain", "demo", Keychain::LoadMode::Eager, key_cache);
+    Keychain cached("./demo.agilekeychain", "demo", Keychain::LoadMode::Eager, key_cache);
+    REQUIRE(std::distance(cached.begin(), cached.end()) ==
+            std::distance(uncached.begin(), uncached.end()));
+    for (const auto& item : uncached) {
+        REQUIRE(cached.find(item.first) != cached.end());
+        REQUIRE(cached.find(item.first)->second.notes == item.second.notes);
+    }
+
+    // Nothing is kept that could check the password, so until the keys are forgotten the
+    // vault opens whatever password is given.
+    Keychain("./demo.agilekeychain", "not the password", Keychain::LoadMode::Lazy, key_cache);
+    for (const auto& key : keys_json["list"])
+        key_cache->forget(key["identifier"]);
+    REQUIRE_THROWS(Keychain(
+        "./demo.agilekeychain", "not the password", Keychain::LoadMode::Lazy, key_cache));
+}
+
+TEST_CASE("Batch decryption matches per-item decryption", "[keychain]") {
+    json keys_json;
+    std::ifstream("./demo.agilekeychain/data/default/encryptionKeys.js") >> keys_json;
+    const auto& key_json = keys_json["list"][0];
+    AgileKeychainMasterKey key(key_json, "demo");
+
+    std::vector<std::string> encrypted;
+    for (int i = 0; i < 50; ++i)
+        encrypted.push_back(key.encryptJSON({{"index", i}, {"notesPlain", std::string(i, 'x')}}));
+    encrypted.push_back("not base64!");
+    encrypted.push_back(key.encryptJSON({"truncated"}).substr(0, 40));
+
+    std::vector<EncryptedPayload> payloads;
+    for (const auto& payload : encrypted)
+        payloads.push_back({payload.data(), payload.size()});
+    const auto results = key.decryptItems(payloads);
+
+    REQUIRE(results.size() == payloads.size());
+    for (int i = 0; i < 50; ++i) {
+        REQUIRE(results[i].error.empty());
+        REQUIRE(results[i].value == key.decryptJSON(encrypted[i]));
+    }
+    REQUIRE_FALSE(results[50].error.empty());
+    REQUIRE_FALSE(results[51].error.empty());
+}
+
+namespace {
+std::vector<std::string> listDirectory(const std::string& path) {
+    std::vector<std::string> names;
+    auto dir = ::opendir(path.c_str());
+    if (!dir)
+        return names;
+    while (auto entry = ::readdir(dir)) {
+        if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0)
+            names.push_back(entry->d_name);
+    }
+    ::closedir(dir);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+void copyTree(const std::string& from, const std::string& to) {
+    struct stat st;
+    REQUIRE(::stat(from.c_str(), &st) == 0);
+    if (S_ISDIR(st.st_mode)) {
+        REQUIRE(::mkdir(to.c_str(), 0700) == 0);
+        for (const auto& name : listDirectory(from))
+            copyTree(from + "/" + name, to + "/" + name);
+    } else {
+        std::ifstream in(from, std::ios::binary);
+        std::ofstream out(to, std::ios::binary);
+        out << in.rdbuf();
+        REQUIRE(out.good());
+    }
+}
+
+void removeTree(const std::string& path) {
+    struct stat st;
+    if (::lstat(path.c_str(), &st) != 0)
+        return;
+    if (S_ISDIR(st.st_mode)) {
+        for (const auto& name : listDirectory(path))
+            removeTree(path + "/" + name);
+        ::rmdir(path.c_str());
+    } else {
+        ::unlink(path.c_str());
+    }
+}
+
+// A copy of one of the demo vaults in a new temporary directory, for tests that change it. The
+// directory goes away with the copy, however the test ends.
+class TempVault {
+public:
+    explicit TempVault(const std::string& fixture) {
+        const char* tmpdir = std::getenv("TMPDIR");
+        std::string pattern = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/gonepass.XXXXXX";
+        REQUIRE(::mkdtemp(&pattern[0]) != nullptr);
+        dir = pattern;
+        vault_path = dir + "/" + fixture.substr(fixture.rfind('/') + 1);
+        copyTree(fixture, vault_path);
+    }
+    ~TempVault() {
+        removeTree(dir);
+    }
+
+    TempVault(const TempVault&) = delete;
+    TempVault& operator=(const TempVault&) = delete;
+
+    const std::string& path() const {
+        return vault_path;
+    }
+
+private:
+    std::string dir;
+    std::string vault_path;
+};
+
+void requireSameItem(const KeychainItem& item, const KeychainItem& expected) {
+    INFO(expected.uuid);
+    REQUIRE(item.uuid == expected.uuid);
+    REQUIRE(item.title == expected.title);
+    REQUIRE(item.category == expected.category);
+    REQUIRE(item.updatedAt == expected.updatedAt);
+    REQUIRE(item.trashed == expected.trashed);
+    REQUIRE(item.decrypted == expected.decrypted);
+    REQUIRE(item.notes == expected.notes);
+    REQUIRE(item.URLs == expected.URLs);
+    REQUIRE(item.sections.size() == expected.sections.size());
+    for (size_t i = 0; i < expected.sections.size(); ++i) {
+        const auto& section = item.sections[i];
+        const auto& expected_section = expected.sections[i];
+        REQUIRE(section.title == expected_section.title);
+        REQUIRE(section.fields.size() == expected_section.fields.size());
+        for (size_t j = 0; j < expected_section.fields.size(); ++j) {
+            REQUIRE(section.fields[j].name == expected_section.fields[j].name);
+            REQUIRE(section.fields[j].value == expected_section.fields[j].value);
+            REQUIRE(section.fields[j].password == expected_section.fields[j].password);
+        }
+    }
+}
+
+// Re-encrypts an item file of a copied demo vault with fn's changes to its contents.
+void editItem(const std::string& vault_path,
+              const std::string& uuid,
+              const std::function<void(json&)>& fn) {
+    json keys_json;
+    std::ifstream(vault_path + "/data/default/encryptionKeys.js") >> keys_json;
+    std::unique_ptr<AgileKeychainMasterKey> key;
+    for (const auto& key_json : keys_json["list"]) {
+        if (key_json["level"] == "SL5")
+            key.reset(new AgileKeychainMasterKey(key_json, "demo"));
+    }
+    REQUIRE(key);
+
+    const auto item_path = vault_path + "/data/default/" + uuid + ".1password";
+    json item_json;
+    std::ifstream(item_path) >> item_json;
+    REQUIRE(item_json["securityLevel"] == "SL5");
+    auto contents = key->decryptItem(item_json);
+    fn(contents);
+    item_json["encrypted"] = key->encryptJSON(contents);
+    std::ofstream(item_path) << item_json;
+}
+}  // namespace
+
+TEST_CASE("Item reader backends agree and recover from io_uring failures", "[keychain]") {
+    std::vector<std::string> paths;
+    for (const auto& name : listDirectory("./demo.agilekeychain/data/default"))
+        paths.push_back("./demo.agilekeychain/data/default/" + name);
+    paths.push_back("./demo.agilekeychain/data/default/missing.1password");
+
+    ItemBatchReader threads(ItemBatchReader::Backend::ThreadPool);
+    REQUIRE(threads.backend() == ItemBatchReader::Backend::ThreadPool);
+    const auto expected = threads.read(paths);
+    REQUIRE(expected.back().error == ENOENT);
+    REQUIRE(expected.front().error == 0);
+    REQUIRE_FALSE(expected.front().data.empty());
+
+    auto require_expected = [&](const std::vector<ItemBuffer>& buffers) {
+        REQUIRE(buffers.size() == expected.size());
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            REQUIRE(buffers[i].error == expected[i].error);
+            REQUIRE(buffers[i].data == expected[i].data);
+        }
+    };
+    ItemBatchReader ring;
+    require_expected(ring.read(paths));
+
+    // Failing in each round in turn, and then while closing, has to leave nothing open and
+    // still read everything, by falling back to the threads.
+    const auto open_fds = listDirectory("/proc/self/fd").size();
+    for (size_t after_waits = 0; after_waits < 4; ++after_waits) {
+        ItemBatchReader failing;
+        const bool had_ring = failing.backend() == ItemBatchReader::Backend::IoUring;
+        failing.simulateRingFailure(after_waits);
+        require_expected(failing.read(paths));
+        if (had_ring && after_waits < 3)
+            REQUIRE(failing.backend() == ItemBatchReader::Backend::ThreadPool);
+        require_expected(failing.read(paths));
+        REQUIRE(listDirectory("/proc/self/fd").size() == open_fds);
+    }
+}
+
+TEST_CASE("Base64 backends agree with the scalar codec", "[base64]") {
+    std::vector<Base64Backend> backends;
+    for (auto backend : {Base64Backend::Scalar, Base64Backend::SSE41, Base64Backend::AVX2}) {
+        if (base64BackendSupported(backend))
+            backends.push_back(backend);
+    }
+
+    std::mt19937 rng(20161017);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::vector<uint8_t> decoded;
+    for (size_t size = 0; size < 300; ++size) {
+        std::vector<uint8_t> data(size);
+        for (auto& value : data)
+            value = byte(rng);
+        const auto encoded = base64Encode(data.data(), data.size(), Base64Backend::Scalar);
+        REQUIRE(encoded.size() == (size + 2) / 3 * 4);
+
+        // The way 1Password writes it: slashes escaped, sometimes wrapped.
+        std::string escaped;
+        for (size_t i = 0; i < encoded.size(); ++i) {
+            if (encoded[i] == '/')
+                escaped += '\\';
+            escaped += encoded[i];
+            if (i % 61 == 60)
+                escaped += "\r\n";
+        }
+
+        for (auto backend : backends) {
+            INFO("size " << size << ", backend " << static_cast<int>(backend));
+            REQUIRE(base64Encode(data.data(), data.size(), backend) == encoded);
+            base64Decode(encoded.data(), encoded.size(), decoded, backend);
+            REQUIRE(decoded == data);
+            base64Decode(escaped.data(), escaped.size(), decoded, backend);
+            REQUIRE(decoded == data);
+        }
+    }
+
+    // Every byte that isn't in the alphabet, anywhere in a block the vector code would take.
+    const std::string clean(96, 'A');
+    for (int ch = 0; ch < 256; ++ch) {
+        for (size_t position : {0, 17, 40, 95}) {
+            auto text = clean;
+            text[position] = static_cast<char>(ch);
+            bool scalar_ok = true;
+            std::vector<uint8_t> expected;
+            try {
+                base64Decode(text.data(), text.size(), expected, Base64Backend::Scalar);
+            } catch (std::runtime_error&) {
+                scalar_ok = false;
+            }
+            for (auto backend : backends) {
+                INFO("char " << ch << " at " << position << ", backend "
+                             << static_cast<int>(backend));
+                bool ok = true;
+                try {
+                    base64Decode(text.data(), text.size(), decoded, backend);
+                } catch (std::runtime_error&) {
+                    ok = false;
+                }
+                REQUIRE(ok == scalar_ok);
+                if (ok)
+                    REQUIRE(decoded == expected);
+            }
+        }
+    }
+}
+
+namespace {
+// Both ways of reading an item's details must agree: either both fail, or both succeed with
+// the same result. Returns whether the single pass scanner handled it without the DOM.
+bool requireSameDetails(const std::string& text) {
+    ItemDetails from_dom, parsed;
+    bool dom_ok = true, parsed_ok = true;
+    try {
+        from_dom = itemDetailsFromJSON(json::parse(text));
+    } catch (std::exception&) {
+        dom_ok = false;
+    }
+    try {
+        parsed = parseItemDetails(text.data(), text.size());
+    } catch (std::exception&) {
+        parsed_ok = false;
+    }
+    INFO(text);
+    REQUIRE(parsed_ok == dom_ok);
+    REQUIRE(parsed == from_dom);
+
+    ItemDetails scanned;
+    bool handled = false;
+    try {
+        handled = scanItemDetails(text.data(), text.size(), scanned);
+    } catch (std::exception&) {
+        // Only allowed where the DOM would have thrown as well.
+        REQUIRE_FALSE(dom_ok);
+        return true;
+    }
+    if (handled)
+        REQUIRE(scanned == from_dom);
+    return handled;
+}
+
+// Writes items the way 1Password does, and also every way it doesn't: shuffled and repeated
+// keys, odd whitespace and escapes, wrong types, and the occasional broken document.
+class ItemGenerator {
+public:
+    explicit ItemGenerator(unsigned int seed) : rng(seed) {}
+
+    std::string item() {
+        std::vector<std::string> members;
+        if (chance(80))
+            members.push_back(member("notesPlain", chance(95) ? string() : scalar()));
+        if (chance(70))
+            members.push_back(member("URLs", urls()));
+        if (chance(50))
+            members.push_back(member("password", chance(95) ? string() : scalar()));
+        if (chance(50))
+            members.push_back(member("fields", fields()));
+        if (chance(80))
+            members.push_back(member("sections", sections()));
+        if (chance(30))
+            members.push_back(member("extra", junk(3)));
+        if (chance(10) && !members.empty())
+            members.push_back(members[pick(members.size())]);
+        std::string ret = object(members);
+        if (chance(3))
+            ret = ret.substr(0, pick(ret.size()));
+        if (chance(3))
+            ret += chance(50) ? " x" : "}";
+        if (chance(2))
+            ret = "[" + ret + "]";
+        return ret;
+    }
+
+private:
+    bool chance(int percent) {
+        return std::uniform_int_distribution<int>(0, 99)(rng) < percent;
+    }
+
+    size_t pick(size_t count) {
+        return std::uniform_int_distribution<size_t>(0, count - 1)(rng);
+    }
+
+    std::string space() {
+        static const char* spaces[] = {"", "", "", " ", "\n  ", "\t", "\r\n"};
+        return spaces[pick(7)];
+    }
+
+    std::string string() {
+        static const char* pieces[] = {"plain",
+                                       "with space",
+                                       "",
+                                       "\\\"quoted\\\"",
+                                       "https:\\/\\/example.com",
+                                       "line\\nbreak",
+                                       "tab\\t",
+                                       "back\\\\slash",
+                                       "\\u00e9t\\u00E9",
+                                       "\xc3\xa9",
+                                       "\\ud83d\\ude00",
+                                       "\\b\\f\\r",
+                                       "\\u0000",
+                                       "\\ud800",
+                                       "\\x",
+                                       "raw\ttab"};
+        std::string ret = "\"";
+        const auto count = pick(3);
+        // The last four pieces are ones the scanner leaves to the DOM.
+        for (size_t i = 0; i <= count; ++i)
+            ret += pieces[pick(sizeof(pieces) / sizeof(pieces[0]) - (chance(95) ? 4 : 0))];
+        return ret + "\"";
+    }
+
+    std::string scalar() {
+        static const char* scalars[] = {
+            "0", "-1", "42", "1461280000", "201604", "-0", "1.5", "2e3", "-1.25E-2",
+            "99999999999999999999", "true", "false", "null", "01", "1.", "tru"};
+        return scalars[pick(sizeof(scalars) / sizeof(scalars[0]) - (chance(97) ? 3 : 0))];
+    }
+
+    std::string junk(int depth) {
+        if (depth == 0 || chance(50))
+            return chance(50) ? string() : scalar();
+        std::vector<std::string> parts;
+        const bool as_object = chance(50);
+        const auto count = pick(4);
+        for (size_t i = 0; i < count; ++i) {
+            parts.push_back(as_object ? member("j" + std::to_string(i), junk(depth - 1))
+                                      : junk(depth - 1));
+        }
+        return as_object ? object(parts) : array(parts);
+    }
+
+    std::string member(const std::string& key, const std::string& value) {
+        return "\"" + key + "\"" + space() + ":" + space() + value;
+    }
+
+    std::string object(std::vector<std::string> members) {
+        std::shuffle(members.begin(), members.end(), rng);
+        std::string ret = "{";
+        for (size_t i = 0; i < members.size(); ++i)
+            ret += (i ? "," : "") + space() + members[i];
+        return ret + space() + "}";
+    }
+
+    std::string array(const std::vector<std::string>& elements) {
+        std::string ret = "[";
+        for (size_t i = 0; i < elements.size(); ++i)
+            ret += (i ? "," : "") + space() + elements[i];
+        return ret + space() + "]";
+    }
+
+    std::string urls() {
+        if (chance(3))
+            return chance(50) ? "null" : "{}";
+        std::vector<std::string> elements;
+        const auto count = pick(4);
+        for (size_t i = 0; i < count; ++i) {
+            std::vector<std::string> members;
+            if (chance(97))
+                members.push_back(member("url", chance(97) ? string() : scalar()));
+            if (chance(50))
+                members.push_back(member("label", string()));
+            elements.push_back(chance(98) ? object(members) : string());
+        }
+        return array(elements);
+    }
+
+    std::string fields() {
+        if (chance(3))
+            return "null";
+        std::vector<std::string> elements;
+        const auto count = pick(5);
+        for (size_t i = 0; i < count; ++i) {
+            std::vector<std::string> members;
+            static const char* types[] = {"\"T\"", "\"P\"", "\"E\"", "\"C\""};
+            if (chance(95))
+                members.push_back(member("designation", chance(97) ? string() : scalar()));
+            if (chance(95))
+                members.push_back(member("value", chance(97) ? string() : scalar()));
+            if (chance(95))
+                members.push_back(member("type", chance(97) ? types[pick(4)] : scalar()));
+            if (chance(30))
+                members.push_back(member("name", string()));
+            elements.push_back(chance(97) ? object(members) : scalar());
+        }
+        return array(elements);
+    }
+
+    std::string sectionFieldValue(const std::string& kind) {
+        if (chance(5))
+            return chance(50) ? string() : scalar();
+        if (kind == "date")
+            return std::to_string(1000000000 + pick(1000000000));
+        if (kind == "monthYear")
+            return std::to_string(200001 + pick(3000) * 100 + pick(12));
+        if (kind == "address") {
+            if (chance(5))
+                return "null";
+            std::vector<std::string> members;
+            for (const auto key : {"street", "city", "state", "zip", "country"}) {
+                if (chance(95))
+                    members.push_back(member(key, chance(95) ? string() : scalar()));
+            }
+            return object(members);
+        }
+        return string();
+    }
+
+    std::string sections() {
+        if (chance(3))
+            return "null";
+        std::vector<std::string> elements;
+        const auto count = pick(4);
+        for (size_t i = 0; i < count; ++i) {
+            std::vector<std::string> members;
+            if (chance(80))
+                members.push_back(member("title", chance(95) ? string() : scalar()));
+            if (chance(50))
+                members.push_back(member("name", string()));
+            if (chance(95)) {
+                std::vector<std::string> fields;
+                const auto field_count = pick(5);
+                for (size_t j = 0; j < field_count; ++j) {
+                    static const char* kinds[] = {
+                        "string", "concealed", "date", "address", "monthYear", "email", "menu"};
+                    const std::string kind = kinds[pick(7)];
+                    std::vector<std::string> field;
+                    if (chance(97))
+                        field.push_back(member("k", chance(98) ? "\"" + kind + "\"" : scalar()));
+                    if (chance(97))
+                        field.push_back(member("t", chance(98) ? string() : scalar()));
+                    if (chance(97))
+                        field.push_back(member("v", sectionFieldValue(kind)));
+                    if (chance(50))
+                        field.push_back(member("n", string()));
+                    if (chance(5) && !field.empty())
+                        field.push_back(field[pick(field.size())]);
+                    fields.push_back(chance(98) ? object(field) : scalar());
+                }
+                members.push_back(member("fields", chance(98) ? array(fields) : "null"));
+            }
+            elements.push_back(chance(98) ? object(members) : string());
+        }
+        return array(elements);
+    }
+
+    std::mt19937 rng;
+};
+}  // namespace
+
+TEST_CASE("Item details scanner matches the DOM on the demo vault", "[keychain]") {
+    json keys_json;
+    std::ifstream("./demo.agilekeychain/data/default/encryptionKeys.js") >> keys_json;
+    std::vector<std::unique_ptr<AgileKeychainMasterKey>> keys;
+    for (const auto& key : keys_json["list"])
+        keys.emplace_back(new AgileKeychainMasterKey(key, "demo"));
+
+    size_t checked = 0;
+    Keychain keychain("./demo.agilekeychain", "demo", Keychain::LoadMode::Lazy);
+    for (const auto& item : keychain) {
+        ItemFile item_file("./demo.agilekeychain/data/default/" + item.first + ".1password");
+        const auto envelope = parseItemEnvelope(item_file.data(), item_file.size());
+        for (const auto& key : keys) {
+            if (key->level != envelope.securityLevel)
+                continue;
+            DecryptScratch scratch;
+            const auto& plaintext =
+                key->decrypt(envelope.encrypted, envelope.encryptedSize, scratch);
+            // Every real item should take the single pass path.
+            REQUIRE(requireSameDetails(std::string(plaintext.begin(), plaintext.end())));
+            checked++;
+        }
+    }
+    REQUIRE(checked == std::distance(keychain.begin(), keychain.end()));
+}
+
+TEST_CASE("Item details scanner matches the DOM on a synthetic corpus", "[keychain]") {
+    ItemGenerator generator(20161017);
+    const int count = 5000;
+    int handled = 0;
+    for (int i = 0; i < count; ++i) {
+        if (requireSameDetails(generator.item()))
+            handled++;
+    }
+    // The odd shapes should go to the DOM, but most items still shouldn't need it.
+    REQUIRE(handled > count / 4);
+    REQUIRE(handled < count);
+}
+
+TEST_CASE("Lazy keychain only decrypts requested items", "[keychain]") {
+    Keychain eager("./demo.agilekeychain", "demo");
+    Keychain lazy("./demo.agilekeychain", "demo", Keychain::LoadMode::Lazy);
+
+    size_t count = 0;
+    for (const auto& item : lazy) {
+        REQUIRE_FALSE(item.second.decrypted);
+        REQUIRE(eager.find(item.first) != eager.end());
+        REQUIRE(item.second.title == eager.find(item.first)->second.title);
+        count++;
+    }
+    REQUIRE(count == std::distance(eager.begin(), eager.end()));
+
+    const auto& expected = eager.begin()->second;
+    auto it = lazy.findDecrypted(expected.uuid);
+    REQUIRE(it != lazy.end());
+    REQUIRE(it->second.decrypted);
+    REQUIRE(it->second.notes == expected.notes);
+    REQUIRE(it->second.URLs == expected.URLs);
+    REQUIRE(it->second.sections.size() == expected.sections.size());
+}
+
+TEST_CASE("Parallel eager loads match a serial one", "[keychain]") {
+    const std::vector<std::pair<std::string, std::string>> vaults = {
+        {"./demo.agilekeychain", "demo"}, {"./demo.opvault", "demo"}, {"./demo.1pif", ""}};
+    for (const auto& vault : vaults) {
+        INFO(vault.first);
+        Keychain serial(vault.first, vault.second);
+        serial.setMaxWorkers(1);
+        std::vector<std::string> serial_order;
+        for (const auto& item : serial)
+            serial_order.push_back(item.first);
+        REQUIRE_FALSE(serial_order.empty());
+
+        // More workers than this machine may have cores, so the work really is spread out.
+        for (const size_t workers : {2, 4, 16}) {
+            INFO(workers);
+            Keychain parallel(vault.first, vault.second);
+            parallel.setMaxWorkers(workers);
+            std::vector<std::string> order;
+            for (const auto& item : parallel) {
+                order.push_back(item.first);
+                requireSameItem(item.second, serial.find(item.first)->second);
+            }
+            // Items are stored in contents.js order whatever the scheduling, so even the map's
+            // iteration order comes out the same.
+            REQUIRE(order == serial_order);
+            REQUIRE(parallel.takeErrorReport().errors.size() ==
+                    serial.takeErrorReport().errors.size());
+        }
+    }
+}
+
+TEST_CASE("Items that fail to load are reported in contents.js order", "[keychain]") {
+    TempVault vault("./demo.agilekeychain");
+    json contents;
+    std::ifstream(vault.path() + "/data/default/contents.js") >> contents;
+    REQUIRE(contents.size() > 8);
+    std::vector<std::string> broken_uuids, broken_titles;
+    for (const size_t index : {1, 4, 7}) {
+        broken_uuids.push_back(contents[index][0]);
+        broken_titles.push_back(contents[index][2]);
+        std::ofstream(vault.path() + "/data/default/" + broken_uuids.back() + ".1password")
+            << "not an item";
+    }
+
+    Keychain original("./demo.agilekeychain", "demo");
+    const auto count = std::distance(original.begin(), original.end());
+
+    Keychain keychain(vault.path(), "demo");
+    keychain.setMaxWorkers(4);
+    REQUIRE(std::distance(keychain.begin(), keychain.end()) == count - 3);
+    const auto report = keychain.takeErrorReport();
+    REQUIRE(report.errors.size() == 3);
+    for (size_t i = 0; i < report.errors.size(); ++i) {
+        REQUIRE(report.errors[i].uuid == broken_uuids[i]);
+        REQUIRE(report.errors[i].title == broken_titles[i]);
+        REQUIRE_FALSE(report.errors[i].reason.empty());
+        REQUIRE(keychain.find(broken_uuids[i]) == keychain.end());
+    }
+    REQUIRE(keychain.takeErrorReport().empty());
+
+    // With a sink set, failures go there instead of piling up in the keychain.
+    auto sink = std::make_shared<KeychainErrorReport>();
+    Keychain with_sink(vault.path(), "demo");
+    with_sink.setErrorSink(sink);
+    with_sink.reloadItems();
+    REQUIRE(sink->errors.size() == 3);
+    REQUIRE(with_sink.takeErrorReport().empty());
+}
+
+TEST_CASE("Refreshing touched items leaves the others alone", "[keychain]") {
+    TempVault vault("./demo.agilekeychain");
+    Keychain keychain(vault.path(), "demo");
+    auto it = keychain.begin();
+    const auto touched = it->first;
+    const auto untouched = (++it)->first;
+    const std::string old_notes = keychain.find(untouched)->second.notes;
+
+    for (const auto& uuid : {touched, untouched}) {
+        editItem(vault.path(), uuid, [&](json& contents) {
+            contents["notesPlain"] = "Edited elsewhere: " + uuid;
+        });
+    }
+
+    // The watcher only passes on the files it saw change, and the rest are taken as they were.
+    auto changes = keychain.refreshItems(std::unordered_set<std::string>{touched});
+    REQUIRE(changes.added.empty());
+    REQUIRE(changes.removed.empty());
+    REQUIRE(changes.changed == std::vector<std::string>{touched});
+    REQUIRE(keychain.find(touched)->second.notes == "Edited elsewhere: " + touched);
+    REQUIRE(keychain.find(untouched)->second.notes == old_notes);
+
+    changes = keychain.refreshItems();
+    REQUIRE(changes.changed == std::vector<std::string>{untouched});
+    REQUIRE(keychain.find(untouched)->second.notes == "Edited elsewhere: " + untouched);
+    REQUIRE(keychain.refreshItems(std::unordered_set<std::string>{touched}).empty());
+}
+
+TEST_CASE("Items replaced by refreshes don't pile up in the arena", "[keychain]") {
+    TempVault vault("./demo.agilekeychain");
+    Keychain original("./demo.agilekeychain", "demo");
+    Keychain keychain(vault.path(), "demo");
+    const auto edited = keychain.begin()->first;
+
+    // Without compaction every round would leave another 64KB of dead notes behind.
+    for (size_t round = 0; round < 32; ++round) {
+        // Each edit changes the file's size, so the refresh notices it within the same second.
+        const std::string notes(64 * 1024 + round * 64, 'x');
+        editItem(vault.path(), edited, [&](json& contents) { contents["notesPlain"] = notes; });
+        REQUIRE(keychain.refreshItems().changed == std::vector<std::string>{edited});
+        REQUIRE(keychain.find(edited)->second.notes == notes);
+        REQUIRE(keychain.find(edited)->second.arena->bytesUsed() < 512 * 1024);
+    }
+    for (const auto& item : original) {
+        if (item.first != edited)
+            requireSameItem(keychain.find(item.first)->second, item.second);
+    }
+}
+
+TEST_CASE("SL3 key is only derived once an SL3 item needs it", "[keychain]") {
+    TempVault vault("./demo.agilekeychain");
+    const auto data_path = vault.path() + "/data/default/";
+    json keys_json;
+    std::ifstream(data_path + "encryptionKeys.js") >> keys_json;
+    std::unique_ptr<AgileKeychainMasterKey> level3_key, level5_key;
+    for (const auto& key : keys_json["list"]) {
+        std::unique_ptr<AgileKeychainMasterKey> master_key(new AgileKeychainMasterKey(key, "demo"));
+        (master_key->level == "SL3" ? level3_key : level5_key) = std::move(master_key);
+    }
+    REQUIRE(level3_key);
+    REQUIRE(level5_key);
+
+    // The demo vault is all SL5, so move one of its items to SL3.
+    Keychain original("./demo.agilekeychain", "demo");
+    const auto& expected = original.begin()->second;
+    const auto item_path = data_path + expected.uuid + ".1password";
+    json item_json;
+    std::ifstream(item_path) >> item_json;
+    item_json["encrypted"] = level3_key->encryptJSON(level5_key->decryptItem(item_json));
+    item_json["securityLevel"] = "SL3";
+    std::ofstream(item_path) << item_json;
+
+    // Keys are put in the session key cache as they're derived, which shows when that happens.
+    std::shared_ptr<SessionKeyCache> key_cache;
+    if (SessionKeyCache::available()) {
+        key_cache = std::make_shared<SessionKeyCache>(60);
+        key_cache->forget(level3_key->id);
+        key_cache->forget(level5_key->id);
+    }
+
+    Keychain lazy(vault.path(), "demo", Keychain::LoadMode::Lazy, key_cache);
+    if (key_cache) {
+        REQUIRE_FALSE(key_cache->fetch(level5_key->id).empty());
+        REQUIRE(key_cache->fetch(level3_key->id).empty());
+    }
+
+    auto it = lazy.findDecrypted(expected.uuid);
+    REQUIRE(it != lazy.end());
+    REQUIRE(it->second.decrypted);
+    REQUIRE(it->second.notes == expected.notes);
+    REQUIRE(it->second.sections.size() == expected.sections.size());
+    if (key_cache) {
+        REQUIRE_FALSE(key_cache->fetch(level3_key->id).empty());
+        key_cache->forget(level3_key->id);
+        key_cache->forget(level5_key->id);
+    }
+}
+
+TEST_CASE("Refresh only reports changed items", "[keychain]") {
+    TempVault vault("./demo.agilekeychain");
+    Keychain keychain(vault.path(), "demo");
+    const auto count = std::distance(keychain.begin(), keychain.end());
+
+    REQUIRE(keychain.refreshItems().empty());
+
+    const auto contents_path = vault.path() + "/data/default/contents.js";
+    json contents;
+    {
+        std::ifstream contents_fp(contents_path);
+        contents_fp >> contents;
+    }
+    const std::string removed_uuid = contents[0][0];
+    const std::string changed_uuid = contents[1][0];
+    contents.erase(0);
+    contents[0][4] = contents[0][4].get<int64_t>() + 1;
+    {
+        std::ofstream contents_fp(contents_path);
+        contents_fp << contents;
+    }
+
+    auto changes = keychain.refreshItems();
+    REQUIRE(changes.added.empty());
+    REQUIRE(changes.removed == std::vector<std::string>{removed_uuid});
+    REQUIRE(changes.changed == std::vector<std::string>{changed_uuid});
+    REQUIRE(std::distance(keychain.begin(), keychain.end()) == count - 1);
+    REQUIRE(keychain.find(removed_uuid) == keychain.end());
+}
+
+TEST_CASE("Snapshots round trip", "[keychain]") {
+    Keychain original("./demo.agilekeychain", "demo");
+    const auto count = std::distance(original.begin(), original.end());
+    REQUIRE(original.fullyDecrypted());
+    const auto snapshot = original.saveSnapshot();
+
+    Keychain restored("./demo.agilekeychain", "demo");
+    REQUIRE(restored.loadSnapshot(snapshot));
+    REQUIRE(std::distance(restored.begin(), restored.end()) == count);
+    for (const auto& item : original) {
+        auto it = restored.find(item.first);
+        REQUIRE(it != restored.end());
+        REQUIRE(it->second.decrypted);
+        REQUIRE(it->second.title == item.second.title);
+        REQUIRE(it->second.notes == item.second.notes);
+        REQUIRE(it->second.URLs == item.second.URLs);
+        REQUIRE(it->second.sections.size() == item.second.sections.size());
+        for (const auto& section : item.second.sections) {
+            auto restored_section = it->second.findSection(section.title);
+            REQUIRE(restored_section != nullptr);
+            REQUIRE(restored_section->fields.size() == section.fields.size());
+            for (size_t i = 0; i < section.fields.size(); ++i) {
+                REQUIRE(restored_section->fields[i].value == section.fields[i].value);
+            }
+        }
+    }
+
+    REQUIRE_FALSE(restored.loadSnapshot("not a snapshot"));
+
+    // A lazy keychain's snapshot only has the items that were opened. An eager load turns it
+    // down, but a lazy one takes those items and leaves the rest to be decrypted on demand.
+    auto it = original.begin();
+    const auto first = it->first;
+    const auto second = (++it)->first;
+    Keychain lazy("./demo.agilekeychain", "demo", Keychain::LoadMode::Lazy);
+    lazy.findDecrypted(first);
+    REQUIRE_FALSE(lazy.fullyDecrypted());
+    const auto partial = lazy.saveSnapshot();
+    Keychain eager_from_partial("./demo.agilekeychain", "demo");
+    REQUIRE_FALSE(eager_from_partial.loadSnapshot(partial));
+    Keychain from_partial("./demo.agilekeychain", "demo", Keychain::LoadMode::Lazy);
+    REQUIRE(from_partial.loadSnapshot(partial));
+    REQUIRE(std::distance(from_partial.begin(), from_partial.end()) == count);
+    REQUIRE(from_partial.find(first)->second.decrypted);
+    REQUIRE(from_partial.find(first)->second.notes == original.find(first)->second.notes);
+    REQUIRE_FALSE(from_partial.find(second)->second.decrypted);
+
+    // The next session's snapshot keeps the items it didn't open from the one before.
+    from_partial.findDecrypted(second);
+    Keychain merged("./demo.agilekeychain", "demo", Keychain::LoadMode::Lazy);
+    REQUIRE(merged.loadSnapshot(from_partial.saveSnapshot(partial)));
+    REQUIRE(merged.find(first)->second.decrypted);
+    REQUIRE(merged.find(second)->second.decrypted);
+
+    // A lazy session that opens nothing keeps a complete snapshot complete, so an eager load
+    // can still use it.
+    Keychain unopened("./demo.agilekeychain", "demo", Keychain::LoadMode::Lazy);
+    unopened.begin();
+    Keychain eager_from_merged("./demo.agilekeychain", "demo");
+    REQUIRE(eager_from_merged.loadSnapshot(unopened.saveSnapshot(snapshot)));
+    REQUIRE(std::distance(eager_from_merged.begin(), eager_from_merged.end()) == count);
+    REQUIRE(eager_from_merged.fullyDecrypted());
+    REQUIRE_FALSE(eager_from_partial.loadSnapshot(unopened.saveSnapshot(partial)));
+
+    // Once everything has been opened it's as good as an eager load's.
+    for (const auto& item : original)
+        lazy.findDecrypted(item.first);
+    REQUIRE(lazy.fullyDecrypted());
+    REQUIRE(eager_from_partial.loadSnapshot(lazy.saveSnapshot()));
+    REQUIRE(std::distance(eager_from_partial.begin(), eager_from_partial.end()) == count);
+}
+
+TEST_CASE("OPVault items load through the keychain", "[keychain][opvault]") {
+    REQUIRE_THROWS(Keychain("./demo.opvault", "wrong password"));
+
+    Keychain keychain("./demo.opvault", "demo");
+    REQUIRE(keychain.takeErrorReport().empty());
+    // The tombstone is left out.
+    REQUIRE(std::distance(keychain.begin(), keychain.end()) == 4);
+
+    auto login = keychain.find("0EDE7D0C2C9A4F8A8B4A2C6B1F3C5D01");
+    REQUIRE(login != keychain.end());
+    REQUIRE(login->second.decrypted);
+    REQUIRE(login->second.title == "Example Login");
+    REQUIRE(login->second.category == "webforms.WebForm");
+    REQUIRE(login->second.notes == "A login item");
+    REQUIRE(login->second.URLs.size() == 2);
+    REQUIRE(login->second.findSection("") != nullptr);
+    const auto& fields = login->second.findSection("")->fields;
+    REQUIRE(fields.size() == 2);
+    REQUIRE(fields[1].value == "hunter2");
+    REQUIRE(fields[1].password);
+
+    // This item's HMAC was worked out outside this code, with its trashed flag written as 1 the
+    // way 1Password writes booleans, so it only verifies if that's what we do too.
+    auto trashed = keychain.find("A0B1C2D3E4F5061728394A5B6C7D8E9F");
+    REQUIRE(trashed != keychain.end());
+    REQUIRE(trashed->second.trashed);
+
+    // Lazy loading only needs the overviews.
+    Keychain lazy("./demo.opvault", "demo", Keychain::LoadMode::Lazy);
+    auto card = lazy.find("7C0FFEE0123445678899AABBCCDDEEFF");
+    REQUIRE(card != lazy.end());
+    REQUIRE_FALSE(card->second.decrypted);
+    REQUIRE(card->second.title == "Demo Visa");
+    card = lazy.findDecrypted("7C0FFEE0123445678899AABBCCDDEEFF");
+    REQUIRE(card->second.decrypted);
+    REQUIRE(card->second.findSection("")->fields.size() == 3);
+
+    Keychain restored("./demo.opvault", "demo", Keychain::LoadMode::Lazy);
+    REQUIRE(restored.loadSnapshot(keychain.saveSnapshot()));
+    REQUIRE(restored.find("0EDE7D0C2C9A4F8A8B4A2C6B1F3C5D01")->second.decrypted);
+}
+
+TEST_CASE("OPVault items that fail their HMAC are reported", "[keychain][opvault]") {
+    TempVault vault("./demo.opvault");
+    const auto band_path = vault.path() + "/default/band_0.js";
+    std::string band;
+    {
+        std::ifstream band_fp(band_path);
+        band.assign(std::istreambuf_iterator<char>(band_fp), std::istreambuf_iterator<char>());
+    }
+    const std::string tx = "\"tx\": 1420000200";
+    const auto tx_pos = band.find(tx);
+    REQUIRE(tx_pos != std::string::npos);
+    band.replace(tx_pos, tx.size(), "\"tx\": 1420000299");
+    {
+        std::ofstream band_fp(band_path);
+        band_fp << band;
+    }
+
+    Keychain keychain(vault.path(), "demo");
+    REQUIRE(std::distance(keychain.begin(), keychain.end()) == 3);
+    auto report = keychain.takeErrorReport();
+    REQUIRE(report.errors.size() == 1);
+    REQUIRE(report.errors[0].uuid == "0EDE7D0C2C9A4F8A8B4A2C6B1F3C5D01");
+}
+
+TEST_CASE("1PIF exports load through the keychain", "[keychain][1pif]") {
+    Keychain keychain("./demo.1pif", "");
+    REQUIRE(keychain.readOnly());
+    // The tombstone is left out.
+    REQUIRE(std::distance(keychain.begin(), keychain.end()) == 3);
+
+    auto login = keychain.find("5A1C3E0B9F6E4C1D8E2A7B3C4D5E6F70");
+    REQUIRE(login != keychain.end());
+    REQUIRE(login->second.decrypted);
+    REQUIRE(login->second.title == "Example Login");
+    REQUIRE(login->second.notes == "Imported from a 1PIF export");
+    REQUIRE(login->second.URLs.size() == 1);
+    REQUIRE(login->second.URLs[0] == "https://example.com");
+    REQUIRE(login->second.findSection("")->fields.size() == 2);
+    REQUIRE_FALSE(login->second.findSection("")->fields[0].otp);
+    const auto& totp_field = login->second.findSection("Security")->fields[0];
+    REQUIRE(totp_field.otp);
+    REQUIRE(totp_field.totp != nullptr);
+    REQUIRE(totp_field.totp->code(59) == "287082");
+    REQUIRE(keychain.find("7C3E502DB1806E3FA04C9D5E6F708192")->second.trashed);
+
+    Keychain lazy("./demo.1pif/data.1pif", "", Keychain::LoadMode::Lazy);
+    auto card = lazy.find("6B2D4F1CA07F5D2E9F3B8C4D5E6F7081");
+    REQUIRE_FALSE(card->second.decrypted);
+    card = lazy.findDecrypted("6B2D4F1CA07F5D2E9F3B8C4D5E6F7081");
+    REQUIRE(card->second.findSection("")->fields.size() == 3);
+    // There's no key to encrypt a snapshot with, so none is made.
+    REQUIRE(lazy.saveSnapshot().empty());
+    REQUIRE_FALSE(lazy.loadSnapshot(keychain.saveSnapshot()));
+}
+
+TEST_CASE("1PIF records with fields of the wrong type still load", "[keychain][1pif]") {
+    TempVault vault("./demo.1pif");
+    {
+        std::ofstream data(vault.path() + "/data.1pif", std::ios::app);
+        data << R"({"uuid": "9E5A724FD3A281511C26BF708192A3B4", "updatedAt": "yesterday", )"
+             << R"("typeName": "securenotes.SecureNote", "title": 42, "trashed": "1", )"
+             << R"("secureContents": {"notesPlain": "Odd types"}})" << "\n"
+             << "***5642bee8-a5ff-11dc-8314-0800200c9a66***\n";
+    }
+
+    Keychain keychain(vault.path(), "");
+    REQUIRE(std::distance(keychain.begin(), keychain.end()) == 4);
+    auto odd = keychain.find("9E5A724FD3A281511C26BF708192A3B4");
+    REQUIRE(odd != keychain.end());
+    REQUIRE(odd->second.title == "");
+    REQUIRE(odd->second.updatedAt == 0);
+    REQUIRE_FALSE(odd->second.trashed);
+    REQUIRE(odd->second.notes == "Odd types");
+    REQUIRE(keychain.find("5A1C3E0B9F6E4C1D8E2A7B3C4D5E6F70")->second.title == "Example Login");
+}
+
+TEST_CASE("TOTP descriptors match RFC 6238", "[totp]") {
+    // The test secrets from the RFC: "12345678901234567890" repeated out to the size of each
+    // digest.
+    const std::string sha1 =
+        "otpauth://totp/RFC6238?digits=8&secret=GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+    const std::string sha256 =
+        "otpauth://totp/RFC6238?secret=GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZA&"
+        "digits=8&algorithm=SHA256";
+    const std::string sha512 =
+        "otpauth://totp/RFC6238?secret=GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3T"
+        "QOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNA&digits=8&algorithm=SHA512&period=30";
+    const struct {
+        time_t time;
+        const char* sha1;
+        const char* sha256;
+        const char* sha512;
+    } vectors[] = {
+        {59, "94287082", "46119246", "90693936"},
+        {1111111109, "07081804", "68084774", "25091201"},
+        {1111111111, "14050471", "67062674", "99943326"},
+        {1234567890, "89005924", "91819424", "93441116"},
+        {2000000000, "69279037", "90698825", "38618901"},
+        {20000000000, "65353130", "77737706", "47863826"},
+    };
+
+    const auto sha1_totp = parseTOTPURI(sha1);
+    const auto sha256_totp = parseTOTPURI(sha256);
+    const auto sha512_totp = parseTOTPURI(sha512);
+    for (const auto& vector : vectors) {
+        REQUIRE(sha1_totp.code(vector.time) == vector.sha1);
+        REQUIRE(sha256_totp.code(vector.time) == vector.sha256);
+        REQUIRE(sha512_totp.code(vector.time) == vector.sha512);
+    }
+
+    // All three at once, with the codes for the next two periods too.
+    const TOTPDescriptor batch[] = {sha1_totp, sha256_totp, sha512_totp};
+    const size_t following = 2;
+    std::vector<char> codes(3 * (following + 1) * TOTPDescriptor::kCodeSize);
+    calculateTOTPCodes(batch, 3, 1111111109, following, codes.data());
+    for (size_t index = 0; index < 3; ++index) {
+        for (size_t offset = 0; offset <= following; ++offset) {
+            const auto slot = (index * (following + 1) + offset) * TOTPDescriptor::kCodeSize;
+            REQUIRE(std::string(&codes[slot]) == batch[index].code(1111111109 + offset * 30));
+        }
+    }
+
+    const auto six_digits = parseTOTPURI("otpauth://totp/x?secret=GEZDGNBVGY3TQOJQ&period=60");
+    REQUIRE(six_digits.digits == 6);
+    REQUIRE(six_digits.period == 60);
+    REQUIRE(six_digits.key_size == 10);
+    REQUIRE(six_digits.counter(119) == 1);
+    REQUIRE(six_digits.counter(120) == 2);
+    REQUIRE(six_digits.secondsRemaining(119) == 1);
+    REQUIRE(six_digits.secondsRemaining(120) == 60);
+    // The first of a repeated parameter wins.
+    REQUIRE(parseTOTPURI("otpauth://totp/x?digits=8&secret=GEZDGNBV&digits=7").digits == 8);
+    REQUIRE(calculateTOTP("otpauth://totp/x?secret=GEZDGNBVGY3TQOJQ").size() == 6);
+
+    REQUIRE_THROWS(parseTOTPURI("otpauth://hotp/x?secret=GEZDGNBVGY3TQOJQ&counter=1"));
+    REQUIRE_THROWS(parseTOTPURI("otpauth://totp/x?issuer=nobody"));
+    REQUIRE_THROWS(parseTOTPURI("otpauth://totp/x?secret=GEZDGNBV&algorithm=MD5"));
+    REQUIRE_THROWS(parseTOTPURI("otpauth://totp/x?secret=GEZDGNBV&digits=10"));
+    REQUIRE_THROWS(parseTOTPURI("otpauth://totp/x?secret=GEZDGNBV&period=0"));
+    REQUIRE_THROWS(parseTOTPURI("https://example.com/?secret=GEZDGNBV"));
+}
+
+TEST_CASE("TOTP URI detection matches the URI pattern", "[totp]") {
+    // The regular expression fields used to be matched against before they were parsed up
+    // front.
+    const std::regex pattern(
+        "otpauth://(totp|hotp)/(?:[^\\?]+)\\?((?:(?:[^=]+)=(?:[^\\&]+)\\&?)+)");
+    const std::vector<std::string> prefixes = {
+        "", "otpauth://", "otpauth://totp/", "otpauth://hotp/", "otpauth://totp", "otpauth:/totp/"};
+    const char alphabet[] = "a=&?/";
+    std::mt19937 rng(1234);
+    for (int i = 0; i < 20000; ++i) {
+        auto uri = prefixes[rng() % prefixes.size()];
+        const auto size = rng() % 10;
+        for (size_t j = 0; j < size; ++j)
+            uri += alphabet[rng() % (sizeof(alphabet) - 1)];
+        INFO(uri);
+        REQUIRE(isTOTPURI(uri) == std::regex_match(uri, pattern));
+    }
+}
+
+TEST_CASE("Search index matches a plain substring search", "[search]") {
+    // A small alphabet, with some multi-byte UTF-8, so there are plenty of trigram hits that
+    // aren't real matches.
+    const std::vector<std::string> pieces = {"a", "b", "c", "ab", " ", "\xc3\xa9", "\xc3\xa8"};
+    std::mt19937 rng(42);
+    std::vector<std::string> texts;
+    for (int i = 0; i < 500; ++i) {
+        std::string text;
+        for (int j = 0, size = rng() % 12; j < size; ++j)
+            text += pieces[rng() % pieces.size()];
+        texts.push_back(text);
+    }
+    const SearchIndex index(texts);
+    REQUIRE(index.size() == texts.size());
+
+    std::vector<uint32_t> matches;
+    for (int i = 0; i < 2000; ++i) {
+        std::string needle;
+        for (int j = 0, size = rng() % 6; j < size; ++j)
+            needle += pieces[rng() % pieces.size()];
+        INFO(needle);
+        index.find(needle, matches);
+        std::vector<uint32_t> expected;
+        for (uint32_t id = 0; id < texts.size(); ++id) {
+            if (texts[id].find(needle) != std::string::npos)
+                expected.push_back(id);
+        }
+        REQUIRE(matches == expected);
+    }
+
+    index.find("zzz", matches);
+    REQUIRE(matches.empty());
+    SearchIndex().find("a", matches);
+    REQUIRE(matches.empty());
+}
+
+TEST_CASE("Search index stays right as strings are replaced, added and erased", "[search]") {
+    const std::vector<std::string> pieces = {"a", "b", "c", "ab", " ", "\xc3\xa9", "\xc3\xa8"};
+    std::mt19937 rng(7);
+    auto randomText = [&](size_t max_pieces) {
+        std::string text;
+        for (size_t j = 0, size = rng() % max_pieces; j < size; ++j)
+            text += pieces[rng() % pieces.size()];
+        return text;
+    };
+    // What the index should hold, with erased strings marked as missing.
+    std::vector<std::string> texts;
+    std::vector<bool> present;
+    for (int i = 0; i < 600; ++i) {
+        texts.push_back(randomText(12));
+        present.push_back(true);
+    }
+    SearchIndex index(texts);
+
+    std::vector<uint32_t> matches;
+    // Enough changes that the index rebuilds itself along the way.
+    for (int i = 0; i < 3000; ++i) {
+        const uint32_t id = rng() % (texts.size() + 1);
+        if (id < texts.size() && rng() % 4 == 0) {
+            index.erase(id);
+            present[id] = false;
+        } else {
+            const auto text = randomText(12);
+            index.set(id, text);
+            if (id == texts.size()) {
+                texts.push_back(text);
+                present.push_back(true);
+            } else {
+                texts[id] = text;
+                present[id] = true;
+            }
+        }
+        REQUIRE(index.size() == texts.size());
+
+        const auto needle = randomText(5);
+        INFO(needle);
+        index.find(needle, matches);
+        std::vector<uint32_t> expected;
+        for (uint32_t id = 0; id < texts.size(); ++id) {
+            if (present[id] && texts[id].find(needle) != std::string::npos)
+                expected.push_back(id);
+        }
+        REQUIRE(matches == expected);
+    }
+    REQUIRE_THROWS(index.set(index.size() + 1, "a"));
+    REQUIRE_THROWS(index.erase(index.size()));
+}
@@ -1,38 +1,79 @@
 #pragma once
+#include <algorithm>
 #include <gtkmm.h>
 #include <memory>
 
+#include "error_panel.h"
 #include "item_view.h"
 #include "search_list.h"
 
-class KeychainView : public Gtk::HPaned {
+class KeychainView : public Gtk::Box {
 public:
     KeychainView(const std::shared_ptr<Keychain>& _keychain)
-        : Gtk::HPaned(),
+        : Gtk::Box(Gtk::ORIENTATION_VERTICAL),
           keychain(_keychain),
           placeHolderWidget("Select an item...", Gtk::ALIGN_CENTER),
           scroller() {
         searchList = std::unique_ptr<SearchList>(new SearchList(
             [this](const Glib::ustring& uuid) { selectionChangedFn(uuid); }, *keychain));
 
-        add1(*searchList);
-        add2(scroller);
+        pack_start(error_panel, false, true, 0);
+        pack_start(paned, true, true, 0);
+        paned.add1(*searchList);
+        paned.add2(scroller);
         scroller.add(placeHolderWidget);
 
         show_all_children();
+        showLoadErrors();
     }
     virtual ~KeychainView(){};
 
+    // Moves any item load failures the keychain has collected into the error panel.
+    void showLoadErrors() {
+        error_panel.addErrors(keychain->takeErrorReport().errors);
+    }
+
+    void applyChanges(const KeychainChangeSet& changes) {
+        showLoadErrors();
+        if (changes.empty())
+            return;
+        searchList->applyChanges(changes, *keychain);
+
+        if (cur_uuid.empty())
+            return;
+        auto isCurrent = [this](const std::string& uuid) { return uuid == cur_uuid; };
+        if (std::any_of(changes.removed.begin(), changes.removed.end(), isCurrent)) {
+            cur_uuid.clear();
+            scroller.remove_with_viewport();
+            cur_view.reset();
+            scroller.add(placeHolderWidget);
+            show_all_children();
+        } else if (std::any_of(changes.changed.begin(), changes.changed.end(), isCurrent)) {
+            selectionChangedFn(cur_uuid);
+        }
+    }
+
 protected:
     std::shared_ptr<Keychain> keychain;
     std::unique_ptr<SearchList> searchList = nullptr;
     void selectionChangedFn(const Glib::ustring& uuid) {
-        auto newItemIter = keychain->find(uuid);
+        Keychain::ItemMap::iterator newItemIter;
+        try {
+            newItemIter = keychain->findDecrypted(uuid.raw());
+        } catch (std::exception& e) {
+            std::string title;
+            auto item = keychain->find(uuid.raw());
+            if (item != keychain->end())
+                title = item->second.title;
+            error_panel.addErrors({{uuid.raw(), title, e.what()}});
+            return;
+        }
         // If this isn't in the keychain (weird!) return early
         if (newItemIter == keychain->end())
             return;
 
         const KeychainItem& newItem = newItemIter->second;
+        cur_uuid = uuid.raw();
         cur_view = std::unique_ptr<ItemView>(new ItemView(newItem));
         scroller.remove_with_viewport();
         scroller.add(*cur_view);
@@ -40,7 +81,10 @@ protected:
         show_all_children();
     };
 
+    ErrorPanel error_panel;
+    Gtk::Paned paned;
     Gtk::Label placeHolderWidget;
     Gtk::ScrolledWindow scroller;
     std::unique_ptr<ItemView> cur_view = nullptr;
+    std::string cur_uuid;
 };
@@ -1,19 +1,23 @@
 #pragma once
 
 #include <functional>
+#include <sstream>
 
 #include <gtkmm.h>
 
 using UnlockCallback = std::function<void(std::string path, std::string masterPassword)>;
+using CancelCallback = std::function<void()>;
 
 class LockScreen : public Gtk::Box {
 public:
-    LockScreen(UnlockCallback _unlock_callback)
+    LockScreen(UnlockCallback _unlock_callback, CancelCallback _cancel_callback)
         : Gtk::Box(Gtk::ORIENTATION_VERTICAL),
           file_chooser(Gtk::FILE_CHOOSER_ACTION_SELECT_FOLDER),
           password_field(),
           unlock_button("Unlock"),
-          unlock_callback(_unlock_callback) {
+          cancel_button("_Cancel", true),
+          unlock_callback(_unlock_callback),
+          cancel_callback(_cancel_callback) {
         set_halign(Gtk::ALIGN_CENTER);
         set_valign(Gtk::ALIGN_CENTER);
         set_spacing(5);
@@ -39,12 +43,46 @@ public:
             unlock_callback(vault_path, password_text);
         });
 
+        progress_bar.set_show_text(true);
+        pack_start(progress_bar, false, true, 0);
+        pack_start(cancel_button, false, true, 0);
+        cancel_button.signal_clicked().connect([this]() { cancel_callback(); });
+
         password_field.signal_activate().connect([this]() { unlock_button.clicked(); });
 
         show_all_children();
+        progress_bar.hide();
+        cancel_button.hide();
         password_field.grab_focus();
     };
 
+    // While busy the inputs are disabled and a progress bar and cancel button are shown instead
+    // of the unlock button.
+    void setBusy(bool busy) {
+        file_chooser.set_sensitive(!busy);
+        password_field.set_sensitive(!busy);
+        unlock_button.set_visible(!busy);
+        progress_bar.set_visible(busy);
+        cancel_button.set_visible(busy);
+        if (busy) {
+            progress_bar.set_text("Unlocking...");
+            progress_bar.pulse();
+        } else {
+            password_field.grab_focus();
+        }
+    }
+
+    void setProgress(size_t done, size_t total) {
+        if (total == 0) {
+            progress_bar.pulse();
+            return;
+        }
+        std::stringstream ss;
+        ss << "Loading items " << done << " / " << total;
+        progress_bar.set_text(ss.str());
+        progress_bar.set_fraction(static_cast<double>(done) / total);
+    }
+
     std::string getPassword() {
         return password_field.get_text();
     }
@@ -67,6 +105,9 @@ protected:
     Gtk::FileChooserButton file_chooser;
     Gtk::Entry password_field;
     Gtk::Button unlock_button;
+    Gtk::ProgressBar progress_bar;
+    Gtk::Button cancel_button;
 
     UnlockCallback unlock_callback;
+    CancelCallback cancel_callback;
 };
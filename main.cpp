@@ -1,4 +1,5 @@
 #include "app_window.h"
+#include "crypto_registry.h"
 #include "item_view.h"
 #include "keychain_view.h"
 #include "search_list.h"
@@ -17,6 +18,8 @@ void errorDialog(const std::string& msg) {
 
 int main(int argc, char** argv) {
     OpenSSL_add_all_algorithms();
+    // Look the algorithms up now rather than on the first unlock.
+    cryptoRegistry();
     auto app = Gtk::Application::create(argc, argv);
     auto mainWindow = getMainWindow();
     return app->run(*mainWindow);
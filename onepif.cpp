@@ -0,0 +1,94 @@
+#include <fstream>
+#include <sys/stat.h>
+
+#include "json_util.h"
+#include "onepif.h"
+
+namespace {
+const std::string kDataFileName = "data.1pif";
+
+bool isDirectory(const std::string& path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+bool endsWith(const std::string& str, const std::string& suffix) {
+    return str.size() >= suffix.size() &&
+           str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+std::string dataFilePath(const std::string& path) {
+    return isDirectory(path) ? path + "/" + kDataFileName : path;
+}
+}  // namespace
+
+OnePIFReader::OnePIFReader(const std::string& path) : file_path(dataFilePath(path)) {
+    if (!std::ifstream(file_path))
+        throw std::runtime_error("Cannot open 1PIF export");
+}
+
+bool OnePIFReader::isOnePIF(const std::string& path) {
+    if (isDirectory(path))
+        return static_cast<bool>(std::ifstream(path + "/" + kDataFileName));
+    return endsWith(path, ".1pif");
+}
+
+std::vector<KeychainIndexEntry> OnePIFReader::loadIndex() {
+    std::ifstream file(file_path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Cannot open 1PIF export");
+
+    locations.clear();
+    bytes_read = 0;
+    std::vector<KeychainIndexEntry> index;
+    std::string line;
+    while (std::getline(file, line)) {
+        const auto offset = bytes_read;
+        bytes_read += line.size() + 1;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty() || line.compare(0, 3, "***") == 0)
+            continue;
+
+        json record;
+        try {
+            record = json::parse(line);
+        } catch (std::exception& e) {
+            throw std::runtime_error("Malformed record in 1PIF export");
+        }
+
+        KeychainIndexEntry entry;
+        entry.uuid = valueOr<std::string>(record, "uuid", "");
+        entry.category = valueOr<std::string>(record, "typeName", "");
+        if (entry.uuid.empty() || entry.category == "system.Tombstone")
+            continue;
+        entry.title = valueOr<std::string>(record, "title", "");
+        entry.location = valueOr<std::string>(record, "location", "");
+        entry.updatedAt = valueOr<int64_t>(record, "updatedAt", 0);
+        entry.folder = valueOr<std::string>(record, "folderUuid", "");
+        entry.trashed = valueOr<bool>(record, "trashed", false);
+
+        auto& location = locations[entry.uuid];
+        location.offset = offset;
+        location.size = line.size();
+        index.push_back(std::move(entry));
+    }
+    return index;
+}
+
+const OnePIFReader::RecordLocation* OnePIFReader::findRecord(const std::string& uuid) const {
+    auto it = locations.find(uuid);
+    return it == locations.end() ? nullptr : &it->second;
+}
+
+json OnePIFReader::readRecord(const std::string& uuid) const {
+    const auto location = findRecord(uuid);
+    if (!location)
+        throw std::runtime_error("Item is missing from the 1PIF export");
+
+    std::ifstream file(file_path, std::ios::binary);
+    std::string line(location->size, '\0');
+    if (!file.seekg(location->offset) || !file.read(&line[0], line.size()))
+        throw std::runtime_error("Cannot read item from 1PIF export");
+    return json::parse(line);
+}
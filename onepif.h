@@ -0,0 +1,51 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+#include "keychain.h"
+
+// Reads 1Password Interchange Format exports. These hold one unencrypted JSON record per line,
+// with a "***<uuid>***" marker line between records, and can be far larger than any vault.
+// Records are streamed one line at a time through a single reused buffer, so memory use
+// depends on the largest record rather than on the size of the file. Only the position of
+// each record is kept; its contents are read again when they're asked for.
+class OnePIFReader {
+public:
+    // path is either the .1pif file itself or the directory a 1Password export creates
+    // around it.
+    explicit OnePIFReader(const std::string& path);
+
+    // True if path looks like a 1PIF export rather than a vault.
+    static bool isOnePIF(const std::string& path);
+
+    // Streams every record in the file, skipping tombstones, and remembers where each one is.
+    std::vector<KeychainIndexEntry> loadIndex();
+
+    // Reads and parses a single record found by the last loadIndex. Safe to call from multiple
+    // threads at once, but not while loadIndex is running.
+    json readRecord(const std::string& uuid) const;
+
+    struct RecordLocation {
+        uint64_t offset = 0;
+        uint64_t size = 0;
+    };
+
+    // Returns null if the record wasn't in the file at the last loadIndex.
+    const RecordLocation* findRecord(const std::string& uuid) const;
+
+    const std::string& filePath() const {
+        return file_path;
+    }
+
+    // The number of bytes the last loadIndex got through.
+    uint64_t bytesRead() const {
+        return bytes_read;
+    }
+
+private:
+    std::string file_path;
+    std::unordered_map<std::string, RecordLocation> locations;
+    uint64_t bytes_read = 0;
+};
@@ -0,0 +1,372 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <sstream>
+
+#include "base64.h"
+#include "crypto_registry.h"
+#include "evp_cipher.h"
+#include "json_util.h"
+#include "opvault.h"
+#include "parallel_for.h"
+
+namespace {
+using HMACDigest = std::array<uint8_t, 32>;
+
+const size_t kBandCount = 16;
+const char kOpdataHeader[] = "opdata01";
+const size_t kOpdataHeaderSize = 8;
+const size_t kAESBlockSize = 16;
+
+// OPVault files are JSONP: a single object wrapped in something like "ld(...);".
+json readWrappedJSON(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Cannot open " + path);
+    const std::string contents((std::istreambuf_iterator<char>(file)),
+                               std::istreambuf_iterator<char>());
+    const auto first = contents.find('{');
+    const auto last = contents.rfind('}');
+    if (first == std::string::npos || last == std::string::npos || last < first)
+        throw std::runtime_error("Malformed vault file " + path);
+    return json::parse(contents.begin() + first, contents.begin() + last + 1);
+}
+
+// Items are verified with the same overview or master key over and over, so each thread keeps
+// a context that only redoes the key schedule when the key changes.
+HMACDigest hmacSHA256(const std::array<uint8_t, 32>& key, const uint8_t* data, size_t size) {
+    thread_local HMACContext context(cryptoRegistry().sha256);
+    HMACDigest digest;
+    context.compute(key.data(), key.size(), data, size, digest.data());
+    return digest;
+}
+
+bool digestMatches(const HMACDigest& digest, const uint8_t* expected) {
+    return CRYPTO_memcmp(digest.data(), expected, digest.size()) == 0;
+}
+
+// AES-256-CBC without padding; OPVault pads its plaintexts itself.
+std::vector<uint8_t> aesCBC(const std::array<uint8_t, 32>& key,
+                            const uint8_t* iv,
+                            const uint8_t* data,
+                            size_t size,
+                            bool encrypt) {
+    EVPKey cipher_key;
+    EVPIv cipher_iv;
+    cipher_key.fill(0);
+    std::copy(key.begin(), key.end(), cipher_key.begin());
+    std::copy_n(iv, kAESBlockSize, cipher_iv.begin());
+
+    try {
+        auto cipher =
+            leaseCipher(cryptoRegistry().aes256CBC, cipher_key, cipher_iv, encrypt, false);
+        cipher->update(data, size);
+        return std::vector<uint8_t>(cipher->cbegin(), cipher->cend());
+    } catch (EVPCipherException& e) {
+        throw std::runtime_error(encrypt ? "Couldn't encrypt vault data"
+                                         : "Couldn't decrypt vault data");
+    }
+}
+
+// opdata01 is "opdata01", the plaintext length as a little-endian uint64, the IV, the
+// ciphertext and finally an HMAC-SHA256 of everything before it. The plaintext is prefixed
+// with random padding up to a whole number of blocks.
+std::vector<uint8_t> opdataDecrypt(const std::vector<uint8_t>& data, const OPVault::KeyPair& key) {
+    const size_t overhead = kOpdataHeaderSize + 8 + kAESBlockSize + HMACDigest().size();
+    if (data.size() < overhead ||
+        !std::equal(data.begin(), data.begin() + kOpdataHeaderSize, kOpdataHeader))
+        throw std::runtime_error("Malformed opdata");
+
+    const auto mac_offset = data.size() - HMACDigest().size();
+    if (!digestMatches(hmacSHA256(key.mac, data.data(), mac_offset), data.data() + mac_offset))
+        throw std::runtime_error("Data failed HMAC verification");
+
+    uint64_t plaintext_size = 0;
+    for (int i = 7; i >= 0; --i)
+        plaintext_size = (plaintext_size << 8) | data[kOpdataHeaderSize + i];
+
+    const auto iv = data.data() + kOpdataHeaderSize + 8;
+    const auto ciphertext = iv + kAESBlockSize;
+    const size_t ciphertext_size = data.data() + mac_offset - ciphertext;
+    if (ciphertext_size % kAESBlockSize != 0 || plaintext_size > ciphertext_size)
+        throw std::runtime_error("Malformed opdata");
+
+    auto plaintext = aesCBC(key.encryption, iv, ciphertext, ciphertext_size, false);
+    plaintext.erase(plaintext.begin(), plaintext.end() - plaintext_size);
+    return plaintext;
+}
+
+std::vector<uint8_t> opdataEncrypt(const std::string& plaintext, const OPVault::KeyPair& key) {
+    const size_t padding_size = kAESBlockSize - plaintext.size() % kAESBlockSize;
+    std::vector<uint8_t> padded(padding_size);
+    std::array<uint8_t, kAESBlockSize> iv;
+    if (RAND_bytes(padded.data(), padded.size()) != 1 || RAND_bytes(iv.data(), iv.size()) != 1)
+        throw std::runtime_error("Couldn't generate random data");
+    padded.insert(padded.end(), plaintext.begin(), plaintext.end());
+
+    std::vector<uint8_t> ret(kOpdataHeader, kOpdataHeader + kOpdataHeaderSize);
+    uint64_t plaintext_size = plaintext.size();
+    for (int i = 0; i < 8; ++i)
+        ret.push_back((plaintext_size >> (i * 8)) & 0xff);
+    ret.insert(ret.end(), iv.begin(), iv.end());
+    const auto ciphertext = aesCBC(key.encryption, iv.data(), padded.data(), padded.size(), true);
+    ret.insert(ret.end(), ciphertext.begin(), ciphertext.end());
+    const auto digest = hmacSHA256(key.mac, ret.data(), ret.size());
+    ret.insert(ret.end(), digest.begin(), digest.end());
+    return ret;
+}
+
+// The master and overview keys are stored as opdata-encrypted random bytes; the actual keys
+// are the SHA-512 of those bytes.
+OPVault::KeyPair decryptProfileKey(const std::string& encrypted, const OPVault::KeyPair& key) {
+    const auto raw_key = opdataDecrypt(base64Decode(encrypted), key);
+    std::array<uint8_t, EVP_MAX_MD_SIZE> digest;
+    DigestContext sha512;
+    sha512.init(cryptoRegistry().sha512);
+    sha512.update(raw_key.data(), raw_key.size());
+    sha512.final(digest.data());
+
+    OPVault::KeyPair ret;
+    std::copy_n(digest.begin(), 32, ret.encryption.begin());
+    std::copy_n(digest.begin() + 32, 32, ret.mac.begin());
+    return ret;
+}
+
+// Appends value the way 1Password writes it into an item's HMAC message: strings as they are,
+// booleans as 1 or 0 and numbers in plain decimal. Returns false for anything else, which an
+// item never has at the top level.
+bool appendHMACValue(const json& value, std::string& message) {
+    if (value.is_string()) {
+        message += value.get_ref<const std::string&>();
+    } else if (value.is_boolean()) {
+        message += value.get<bool>() ? '1' : '0';
+    } else if (value.is_number_unsigned()) {
+        message += std::to_string(value.get<uint64_t>());
+    } else if (value.is_number_integer()) {
+        message += std::to_string(value.get<int64_t>());
+    } else if (value.is_number_float()) {
+        // Timestamps that went through a double still have to come out without a fraction.
+        const auto number = value.get<double>();
+        if (std::trunc(number) == number && std::fabs(number) < 1e18)
+            message += std::to_string(static_cast<int64_t>(number));
+        else
+            message += value.dump();
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// An item's HMAC covers every key and value except the HMAC itself, in key order. The JSON
+// objects here are ordered maps, so iteration order is already sorted.
+bool verifyItemHMAC(const json& item, const OPVault::KeyPair& key) {
+    auto hmac = item.find("hmac");
+    if (hmac == item.end() || !hmac->is_string())
+        return false;
+    const auto expected = base64Decode(hmac->get<std::string>());
+    if (expected.size() != HMACDigest().size())
+        return false;
+
+    std::string message;
+    for (auto it = item.begin(); it != item.end(); ++it) {
+        if (it.key() == "hmac")
+            continue;
+        message += it.key();
+        if (!appendHMACValue(it.value(), message))
+            return false;
+    }
+    const auto digest =
+        hmacSHA256(key.mac, reinterpret_cast<const uint8_t*>(message.data()), message.size());
+    return digestMatches(digest, expected.data());
+}
+
+// OPVault uses numeric categories; map them onto the agilekeychain type names so the rest of
+// the program doesn't need to care which kind of vault an item came from.
+std::string categoryName(const std::string& category) {
+    static const std::unordered_map<std::string, std::string> names = {
+        {"001", "webforms.WebForm"},
+        {"002", "wallet.financial.CreditCard"},
+        {"003", "securenotes.SecureNote"},
+        {"004", "identities.Identity"},
+        {"005", "passwords.Password"},
+        {"099", "system.Tombstone"},
+        {"100", "wallet.computer.License"},
+        {"101", "wallet.financial.BankAccountUS"},
+        {"102", "wallet.computer.Database"},
+        {"103", "wallet.government.DriversLicense"},
+        {"104", "wallet.government.HuntingLicense"},
+        {"105", "wallet.membership.Membership"},
+        {"106", "wallet.government.Passport"},
+        {"107", "wallet.membership.RewardProgram"},
+        {"108", "wallet.government.SsnUS"},
+        {"109", "wallet.computer.Router"},
+        {"110", "wallet.computer.UnixServer"},
+        {"111", "wallet.onlineservices.Email"},
+    };
+    auto it = names.find(category);
+    return it == names.end() ? category : it->second;
+}
+
+OPVaultItem parseItem(const json& item_json, const OPVault::KeyPair& overview_key) {
+    OPVaultItem item;
+    item.entry.uuid = valueOr<std::string>(item_json, "uuid", "");
+    item.entry.category = categoryName(valueOr<std::string>(item_json, "category", ""));
+    item.entry.updatedAt = valueOr<int64_t>(item_json, "updated", 0);
+    item.entry.folder = valueOr<std::string>(item_json, "folder", "");
+    item.entry.trashed = valueOr<bool>(item_json, "trashed", false);
+    item.tx = valueOr<int64_t>(item_json, "tx", 0);
+
+    if (!verifyItemHMAC(item_json, overview_key))
+        throw std::runtime_error("Item failed HMAC verification");
+
+    item.key = valueOr<std::string>(item_json, "k", "");
+    item.details = valueOr<std::string>(item_json, "d", "");
+    const auto overview_data =
+        opdataDecrypt(base64Decode(valueOr<std::string>(item_json, "o", "")), overview_key);
+    const auto overview = json::parse(overview_data.begin(), overview_data.end());
+    item.entry.title = valueOr<std::string>(overview, "title", "");
+    item.entry.location = valueOr<std::string>(overview, "url", "");
+
+    auto urls = overview.find("URLs");
+    if (urls != overview.end() && urls->is_array()) {
+        for (const auto& url : *urls) {
+            if (url.is_object() && url.find("u") != url.end())
+                item.URLs.push_back(url["u"]);
+        }
+    }
+    return item;
+}
+}  // namespace
+
+OPVault::OPVault(const std::string& path, const std::string& masterPassword)
+    : data_path(path + "/default") {
+    const auto profile = readWrappedJSON(data_path + "/profile.js");
+    for (const auto key : {"salt", "iterations", "masterKey", "overviewKey"}) {
+        if (profile.find(key) == profile.end())
+            throw std::runtime_error("Vault profile does not have required fields");
+    }
+
+    const auto salt = base64Decode(profile["salt"].get<std::string>());
+    std::array<uint8_t, 64> derived_key;
+    if (PKCS5_PBKDF2_HMAC(masterPassword.data(),
+                          masterPassword.size(),
+                          salt.data(),
+                          salt.size(),
+                          profile["iterations"],
+                          cryptoRegistry().sha512,
+                          derived_key.size(),
+                          derived_key.data()) != 1)
+        throw std::runtime_error("Couldn't derive key from master password");
+
+    KeyPair password_key;
+    std::copy_n(derived_key.begin(), 32, password_key.encryption.begin());
+    std::copy_n(derived_key.begin() + 32, 32, password_key.mac.begin());
+
+    // A wrong password shows up as the master key failing its HMAC.
+    try {
+        master_key = decryptProfileKey(profile["masterKey"], password_key);
+        overview_key = decryptProfileKey(profile["overviewKey"], password_key);
+    } catch (std::runtime_error& e) {
+        throw std::runtime_error("Couldn't decrypt master key!");
+    }
+
+    profile_name = valueOr<std::string>(profile, "profileName", "");
+}
+
+bool OPVault::isOPVault(const std::string& path) {
+    return static_cast<bool>(std::ifstream(path + "/default/profile.js"));
+}
+
+const std::vector<OPVaultItem>& OPVault::loadItems() {
+    // Bands are independent files, so read and parse them all at once. A missing band just
+    // means no item uuids happen to start with that character.
+    std::vector<json> bands(kBandCount);
+    std::vector<std::string> band_errors(kBandCount);
+    parallelFor(kBandCount,
+                [&](size_t index) {
+                    std::stringstream band_path;
+                    band_path << data_path << "/band_" << std::uppercase << std::hex << index
+                              << ".js";
+                    if (!std::ifstream(band_path.str()))
+                        return;
+                    try {
+                        bands[index] = readWrappedJSON(band_path.str());
+                    } catch (std::exception& e) {
+                        band_errors[index] = e.what();
+                    }
+                },
+                kBandCount);
+    for (const auto& error : band_errors) {
+        if (!error.empty())
+            throw std::runtime_error(error);
+    }
+
+    std::vector<const json*> records;
+    for (const auto& band : bands) {
+        for (auto it = band.begin(); it != band.end(); ++it)
+            records.push_back(&it.value());
+    }
+
+    // Verifying and decrypting the overviews is all CPU, so spread it over every core.
+    items.clear();
+    items.resize(records.size());
+    parallelFor(records.size(), [&](size_t index) {
+        try {
+            items[index] = parseItem(*records[index], overview_key);
+        } catch (std::exception& e) {
+            items[index].entry.uuid = valueOr<std::string>(*records[index], "uuid", "");
+            items[index].error = e.what();
+        }
+    });
+
+    items.erase(std::remove_if(items.begin(),
+                               items.end(),
+                               [](const OPVaultItem& item) {
+                                   return item.error.empty() &&
+                                          item.entry.category == "system.Tombstone";
+                               }),
+                items.end());
+
+    item_indexes.clear();
+    for (size_t index = 0; index < items.size(); ++index)
+        item_indexes[items[index].entry.uuid] = index;
+    return items;
+}
+
+const OPVaultItem* OPVault::findItem(const std::string& uuid) const {
+    auto it = item_indexes.find(uuid);
+    return it == item_indexes.end() ? nullptr : &items[it->second];
+}
+
+json OPVault::decryptDetails(const OPVaultItem& item) const {
+    // The item key is the IV, 64 bytes of encrypted key material, and an HMAC of both made
+    // with the master key.
+    const auto key_data = base64Decode(item.key);
+    const size_t encrypted_size = kAESBlockSize + 64;
+    if (key_data.size() != encrypted_size + HMACDigest().size())
+        throw std::runtime_error("Malformed item key");
+    if (!digestMatches(hmacSHA256(master_key.mac, key_data.data(), encrypted_size),
+                       key_data.data() + encrypted_size))
+        throw std::runtime_error("Item key failed HMAC verification");
+
+    const auto raw_key = aesCBC(
+        master_key.encryption, key_data.data(), key_data.data() + kAESBlockSize, 64, false);
+    KeyPair item_key;
+    std::copy_n(raw_key.begin(), 32, item_key.encryption.begin());
+    std::copy_n(raw_key.begin() + 32, 32, item_key.mac.begin());
+
+    const auto details = opdataDecrypt(base64Decode(item.details), item_key);
+    return json::parse(details.begin(), details.end());
+}
+
+std::string OPVault::encryptJSON(const json& input) const {
+    return base64Encode(opdataEncrypt(input.dump(), master_key));
+}
+
+json OPVault::decryptJSON(const std::string& input) const {
+    const auto plaintext = opdataDecrypt(base64Decode(input), master_key);
+    return json::parse(plaintext.begin(), plaintext.end());
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "keychain.h"
+
+// One item from a band file, with its overview already verified and decrypted. The details
+// stay encrypted until OPVault::decryptDetails is asked for them.
+struct OPVaultItem {
+    KeychainIndexEntry entry;
+    std::vector<std::string> URLs;
+    // The transaction stamp of the item's last change.
+    int64_t tx = 0;
+    // The base64 item key and details, exactly as stored in the band file.
+    std::string key;
+    std::string details;
+    // Set instead of the fields above if the item failed verification or couldn't be decrypted.
+    std::string error;
+};
+
+// Reads OPVault vaults. The profile holds the master and overview keys, each encrypted with a
+// key derived from the master password using PBKDF2-SHA512, and the items are spread across
+// up to 16 band files keyed by the first character of their uuid. Everything is encrypted with
+// AES-256-CBC and authenticated with HMAC-SHA256.
+//
+// Each item has an overview (title, URLs) encrypted with the overview key, and details
+// encrypted with a per-item key, so a vault can be listed without touching any details.
+class OPVault {
+public:
+    OPVault(const std::string& path, const std::string& masterPassword);
+
+    // True if path looks like an OPVault rather than an agilekeychain.
+    static bool isOPVault(const std::string& path);
+
+    // Re-reads every band file, verifies every item's HMAC and decrypts every overview, all in
+    // parallel. Items that fail are returned with their error set rather than thrown, and
+    // tombstones are left out. The items stay valid until the next call.
+    const std::vector<OPVaultItem>& loadItems();
+
+    // Returns null if the item wasn't in the bands at the last loadItems.
+    const OPVaultItem* findItem(const std::string& uuid) const;
+
+    // Decrypts the details of an item from loadItems. Safe to call from multiple threads at
+    // once, but not while loadItems is running.
+    json decryptDetails(const OPVaultItem& item) const;
+
+    // Encrypts data that isn't part of the vault itself, like snapshots, with the master key.
+    std::string encryptJSON(const json& input) const;
+    json decryptJSON(const std::string& input) const;
+
+    const std::string& profileName() const {
+        return profile_name;
+    }
+
+    struct KeyPair {
+        std::array<uint8_t, 32> encryption;
+        std::array<uint8_t, 32> mac;
+    };
+
+private:
+    KeyPair master_key;
+    KeyPair overview_key;
+    std::string data_path;
+    std::string profile_name;
+    std::vector<OPVaultItem> items;
+    std::unordered_map<std::string, size_t> item_indexes;
+};
@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Returns the number of worker threads to use for a job of the given size. This is never
+// more than max_workers (the number of cores if zero) and never more than the number of items.
+inline size_t parallelWorkerCount(size_t count, size_t max_workers = 0) {
+    if (max_workers == 0)
+        max_workers = std::thread::hardware_concurrency();
+    if (max_workers == 0)
+        max_workers = 1;
+    return std::max<size_t>(1, std::min(max_workers, count));
+}
+
+// The threads parallelFor runs on. They're started as they're first needed and then kept, so
+// whatever a worker keeps in thread_local storage (cipher contexts, HMAC key schedules, scratch
+// buffers) is still there for the next call instead of being set up again for every batch.
+// There are only ever as many as the most work that has been asked for at once.
+class WorkerPool {
+public:
+    // Work shared between the thread that started it and the workers that come to help. work
+    // has to return once there's nothing left to do, however many threads are running it.
+    class Job {
+    public:
+        explicit Job(std::function<void()> _work) : work(std::move(_work)) {}
+
+        // Runs the work, unless the job has already finished.
+        void help() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (finished)
+                    return;
+                ++helpers;
+            }
+            work();
+            std::lock_guard<std::mutex> guard(lock);
+            if (--helpers == 0)
+                done.notify_all();
+        }
+
+        // Keeps any more workers from starting on the job and waits for those that have.
+        void finish() {
+            std::unique_lock<std::mutex> guard(lock);
+            finished = true;
+            done.wait(guard, [this]() { return helpers == 0; });
+        }
+
+    private:
+        std::function<void()> work;
+        std::mutex lock;
+        std::condition_variable done;
+        size_t helpers = 0;
+        bool finished = false;
+    };
+
+    static WorkerPool& get() {
+        // Never destroyed, since workers may still be waiting for work when the process exits.
+        static WorkerPool* pool = new WorkerPool;
+        return *pool;
+    }
+
+    // Offers job to up to count workers, starting new ones if there aren't enough idle.
+    void post(const std::shared_ptr<Job>& job, size_t count) {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.insert(queue.end(), count, job);
+        while (idle < queue.size()) {
+            std::thread([this]() { run(); }).detach();
+            ++idle;
+        }
+        wake.notify_all();
+    }
+
+    // Takes back whatever of job no worker has picked up yet.
+    void withdraw(const std::shared_ptr<Job>& job) {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.erase(std::remove(queue.begin(), queue.end(), job), queue.end());
+    }
+
+private:
+    WorkerPool() = default;
+
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            wake.wait(guard, [this]() { return !queue.empty(); });
+            auto job = std::move(queue.front());
+            queue.pop_front();
+            --idle;
+            guard.unlock();
+            job->help();
+            job.reset();
+            guard.lock();
+            ++idle;
+        }
+    }
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::shared_ptr<Job>> queue;
+    size_t idle = 0;
+};
+
+// Calls fn(index) for every index in [0, count) spread across all available cores. Work is
+// handed out in small batches from a shared counter so that slow items (big files, SL3 items)
+// don't leave other threads idle. fn must not throw; callers should catch per-item errors
+// and record them by index so results stay deterministic regardless of scheduling.
+//
+// CPU-bound work should leave max_workers at zero, which means one thread per core. Work that
+// mostly waits on I/O can ask for more. The calling thread does its share, and the rest runs on
+// WorkerPool's threads, so calling this for every batch of a large job costs no new threads.
+inline void parallelFor(size_t count,
+                        const std::function<void(size_t)>& fn,
+                        size_t max_workers = 0) {
+    const auto workerCount = parallelWorkerCount(count, max_workers);
+    if (workerCount <= 1) {
+        for (size_t i = 0; i < count; ++i)
+            fn(i);
+        return;
+    }
+
+    const size_t batchSize = std::max<size_t>(1, count / (workerCount * 16));
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (;;) {
+            const auto start = next.fetch_add(batchSize);
+            if (start >= count)
+                return;
+            const auto stop = std::min(count, start + batchSize);
+            for (auto i = start; i < stop; ++i)
+                fn(i);
+        }
+    };
+
+    // Whatever the workers don't get to, this thread does, so it never waits on one that's
+    // busy with something else.
+    auto& pool = WorkerPool::get();
+    auto job = std::make_shared<WorkerPool::Job>(worker);
+    pool.post(job, workerCount - 1);
+    worker();
+    pool.withdraw(job);
+    job->finish();
+}
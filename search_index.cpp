@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+#include "search_index.h"
+
+namespace {
+const size_t kMaxGramSize = 3;
+// Changed strings are checked one at a time, so once there are more than this, or more than a
+// sixteenth of the index, it's rebuilt.
+const size_t kMinOverrides = 256;
+
+// The bytes of the n-gram at str, with n itself in the top byte so grams of different sizes
+// don't collide.
+uint32_t gramAt(const char* str, size_t n) {
+    uint32_t gram = n;
+    for (size_t i = 0; i < n; ++i)
+        gram = gram << 8 | static_cast<uint8_t>(str[i]);
+    return gram << (kMaxGramSize - n) * 8;
+}
+
+// lower_bound for a list that's being walked forwards: the answer is usually close, so look
+// at exponentially growing steps before searching the last one.
+const uint32_t* gallop(const uint32_t* begin, const uint32_t* end, uint32_t value) {
+    size_t step = 1;
+    while (begin + step < end && begin[step] < value) {
+        begin += step;
+        step *= 2;
+    }
+    return std::lower_bound(begin, std::min(begin + step, end), value);
+}
+
+// One n-gram's strings, narrowed from the front as the intersection moves along.
+struct PostingList {
+    const uint32_t* begin;
+    const uint32_t* end;
+
+    size_t size() const {
+        return end - begin;
+    }
+};
+
+bool containsBytes(const char* str, size_t size, const std::string& needle) {
+    if (needle.empty())
+        return true;
+    // Titles are short, so finding the first byte with memchr and comparing the rest beats
+    // std::search's general purpose loop.
+    if (size < needle.size())
+        return false;
+    auto begin = str;
+    const auto last = begin + (size - needle.size());
+    while (begin <= last) {
+        const auto found =
+            static_cast<const char*>(std::memchr(begin, needle[0], last - begin + 1));
+        if (!found)
+            return false;
+        if (std::memcmp(found + 1, needle.data() + 1, needle.size() - 1) == 0)
+            return true;
+        begin = found + 1;
+    }
+    return false;
+}
+}  // namespace
+
+SearchIndex::SearchIndex(const std::vector<std::string>& texts) {
+    size_t text_size = 0;
+    for (const auto& str : texts)
+        text_size += str.size();
+    text.reserve(text_size);
+    offsets.reserve(texts.size() + 1);
+    replaced.assign(texts.size(), false);
+
+    // Every n-gram paired with the string it's in, packed so that sorting them lists each
+    // n-gram's strings together and in order.
+    std::vector<uint64_t> pairs;
+    pairs.reserve(text_size * kMaxGramSize);
+    for (uint32_t id = 0; id < texts.size(); ++id) {
+        const auto& str = texts[id];
+        offsets.push_back(text.size());
+        text += str;
+        for (size_t pos = 0; pos < str.size(); ++pos) {
+            for (size_t n = 1; n <= kMaxGramSize && pos + n <= str.size(); ++n)
+                pairs.push_back(static_cast<uint64_t>(gramAt(&str[pos], n)) << 32 | id);
+        }
+    }
+    offsets.push_back(text.size());
+
+    // The pairs are already in string order, so a stable sort by n-gram is enough, and a
+    // radix sort on its four bytes is much quicker than comparing.
+    std::vector<uint64_t> sorted(pairs.size());
+    for (int shift = 32; shift < 64; shift += 8) {
+        size_t starts[257] = {};
+        for (auto pair : pairs)
+            ++starts[(pair >> shift & 0xff) + 1];
+        for (size_t digit = 1; digit < 257; ++digit)
+            starts[digit] += starts[digit - 1];
+        for (auto pair : pairs)
+            sorted[starts[pair >> shift & 0xff]++] = pair;
+        pairs.swap(sorted);
+    }
+    // An n-gram that comes up more than once in a string only lists it once.
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+    postings.reserve(pairs.size());
+    for (auto pair : pairs) {
+        const auto gram = static_cast<uint32_t>(pair >> 32);
+        if (grams.empty() || grams.back() != gram) {
+            grams.push_back(gram);
+            posting_starts.push_back(postings.size());
+        }
+        postings.push_back(static_cast<uint32_t>(pair));
+    }
+    posting_starts.push_back(postings.size());
+}
+
+void SearchIndex::find(const std::string& needle, std::vector<uint32_t>& matches) const {
+    findIndexed(needle, matches);
+    if (!edited)
+        return;
+    matches.erase(std::remove_if(matches.begin(),
+                                 matches.end(),
+                                 [this](uint32_t id) { return replaced[id]; }),
+                  matches.end());
+    const auto indexed = matches.size();
+    for (const auto& entry : overrides) {
+        if (containsBytes(entry.second.data(), entry.second.size(), needle))
+            matches.push_back(entry.first);
+    }
+    std::inplace_merge(matches.begin(), matches.begin() + indexed, matches.end());
+}
+
+void SearchIndex::set(uint32_t id, const std::string& str) {
+    if (id > size())
+        throw std::out_of_range("Search index id out of range");
+    if (id == size())
+        replaced.push_back(true);
+    replaced[id] = true;
+    overrides[id] = str;
+    edited = true;
+    if (overrides.size() > std::max(kMinOverrides, indexedSize() / 16))
+        compact();
+}
+
+void SearchIndex::erase(uint32_t id) {
+    if (id >= size())
+        throw std::out_of_range("Search index id out of range");
+    replaced[id] = true;
+    overrides.erase(id);
+    edited = true;
+}
+
+void SearchIndex::compact() {
+    // Erased ids are indexed as empty strings and stay marked as replaced, so they still never
+    // match.
+    std::vector<std::string> texts(size());
+    auto erased = replaced;
+    for (uint32_t id = 0; id < indexedSize(); ++id) {
+        if (!replaced[id])
+            texts[id].assign(text, offsets[id], offsets[id + 1] - offsets[id]);
+    }
+    for (auto& entry : overrides) {
+        texts[entry.first].swap(entry.second);
+        erased[entry.first] = false;
+    }
+    *this = SearchIndex(texts);
+    edited = std::find(erased.begin(), erased.end(), true) != erased.end();
+    replaced.swap(erased);
+}
+
+void SearchIndex::findIndexed(const std::string& needle, std::vector<uint32_t>& matches) const {
+    matches.clear();
+    if (needle.empty()) {
+        matches.resize(indexedSize());
+        std::iota(matches.begin(), matches.end(), 0);
+        return;
+    }
+    // A needle no longer than the largest n-gram is one itself; a longer one is looked for by
+    // each of its trigrams.
+    const auto gram_size = std::min(needle.size(), kMaxGramSize);
+    std::vector<PostingList> lists;
+    for (size_t pos = 0; pos + gram_size <= needle.size(); ++pos) {
+        const auto gram = gramAt(&needle[pos], gram_size);
+        const auto found = std::lower_bound(grams.begin(), grams.end(), gram);
+        if (found == grams.end() || *found != gram)
+            return;
+        const auto index = found - grams.begin();
+        lists.push_back({postings.data() + posting_starts[index],
+                         postings.data() + posting_starts[index + 1]});
+    }
+    // Walking the shortest list and looking its strings up in the others keeps the work in
+    // proportion to the rarest trigram.
+    std::sort(lists.begin(), lists.end(), [](const PostingList& a, const PostingList& b) {
+        return a.size() < b.size();
+    });
+
+    // Having the needle's only n-gram is the same as containing it.
+    if (needle.size() <= kMaxGramSize) {
+        matches.assign(lists[0].begin, lists[0].end);
+        return;
+    }
+    for (auto candidate = lists[0].begin; candidate != lists[0].end; ++candidate) {
+        const auto id = *candidate;
+        bool in_all = true;
+        for (size_t index = 1; index < lists.size() && in_all; ++index) {
+            auto& list = lists[index];
+            list.begin = gallop(list.begin, list.end, id);
+            // Nothing after this string can be in every list either.
+            if (list.begin == list.end)
+                return;
+            in_all = *list.begin == id;
+        }
+        const auto size = offsets[id + 1] - offsets[id];
+        if (in_all && containsBytes(text.data() + offsets[id], size, needle))
+            matches.push_back(id);
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Answers "which of these strings contain this one" without looking at every string. Every one,
+// two and three byte sequence that appears anywhere is listed with the strings it appears in.
+// A search of up to three bytes is then just a lookup, and a longer one only has to check the
+// strings that have every three byte sequence of the search text for the real thing. The lists
+// come to about three times the size of the text, in 32-bit ids.
+//
+// Matching is byte for byte, so both sides should be folded the same way first, e.g. with
+// Glib::ustring::casefold. That's still right for UTF-8: a valid UTF-8 string can only match
+// another at a character boundary.
+//
+// Strings can be replaced, added and erased afterwards without rebuilding. Changed strings are
+// kept to one side and checked one by one on each search, until there are enough of them that
+// rebuilding is worth it; ids never change either way.
+class SearchIndex {
+public:
+    SearchIndex() = default;
+    explicit SearchIndex(const std::vector<std::string>& texts);
+
+    // How many ids there are, erased ones included.
+    size_t size() const {
+        return replaced.size();
+    }
+
+    // Sets matches to the ids of every string containing needle, in increasing order. An id is
+    // the string's position in the vector the index was built from, or the one it was added
+    // at. An empty needle matches every string that hasn't been erased.
+    void find(const std::string& needle, std::vector<uint32_t>& matches) const;
+
+    // Replaces the string at id, or adds one when id is size().
+    void set(uint32_t id, const std::string& str);
+    // Leaves id out of every search from now on. The ids after it stay as they are.
+    void erase(uint32_t id);
+
+private:
+    size_t indexedSize() const {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+    // find, for the strings as they were when the index was built.
+    void findIndexed(const std::string& needle, std::vector<uint32_t>& matches) const;
+    // Rebuilds with every change folded in.
+    void compact();
+
+    // Every string, one after another.
+    std::string text;
+    // Where each string starts in text, plus one past the end of the last.
+    std::vector<uint32_t> offsets;
+    // The distinct n-grams in increasing order, each with its strings at
+    // postings[posting_starts[i]] up to posting_starts[i + 1].
+    std::vector<uint32_t> grams;
+    std::vector<uint32_t> posting_starts;
+    std::vector<uint32_t> postings;
+
+    // Whether each id's indexed string is out of date; ids added since the build always are.
+    std::vector<bool> replaced;
+    // The current strings of the replaced ids that haven't been erased since.
+    std::map<uint32_t, std::string> overrides;
+    // Whether any id is replaced, so an index that's never changed can skip checking.
+    bool edited = false;
+};
@@ -1,8 +1,14 @@
 #pragma once
+#include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <gtkmm.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "keychain.h"
+#include "search_index.h"
 
 class SearchList : public Gtk::VBox {
 public:
@@ -31,18 +37,15 @@ public:
 
         item_list_model->set_sort_column(columns.name, Gtk::SORT_ASCENDING);
 
+        buildIndex();
+
         item_list_filter_model = Gtk::TreeModelFilter::create(item_list_model);
         item_list_filter_model->set_visible_func(
             [this](const Gtk::TreeModel::const_iterator& iter) -> bool {
                 if (!iter)
                     return true;
-                auto row = *iter;
-                Glib::ustring itemName = row[columns.name];
-                auto searchText = search_entry.get_text();
-
-                if (itemName.casefold().find(searchText.casefold()) != Glib::ustring::npos)
-                    return true;
-                return false;
+                const unsigned int id = (*iter)[columns.id];
+                return id >= visible.size() || visible[id];
             });
 
         item_list.set_model(item_list_filter_model);
@@ -52,30 +55,134 @@ public:
         item_list_selector = item_list.get_selection();
         item_list_selector->set_mode(Gtk::SELECTION_BROWSE);
         item_list_selector->signal_changed().connect([this]() {
-            auto row = *item_list.get_selection()->get_selected();
+            auto selected = item_list.get_selection()->get_selected();
+            if (!selected)
+                return;
+            auto row = *selected;
             auto itemUUID = row[columns.uuid];
 
             selectionChangedCb(itemUUID);
         });
 
-        search_entry.signal_search_changed().connect(
-            [this]() { item_list_filter_model->refilter(); });
+        search_entry.signal_search_changed().connect([this]() { searchChanged(); });
     };
 
     virtual ~SearchList(){};
 
+    // Updates the rows and the index in place, so that the selection and scroll position survive
+    // a refresh and only the titles that changed are looked at again.
+    void applyChanges(const KeychainChangeSet& changes, Keychain& keychain) {
+        for (const auto& uuid : changes.removed) {
+            auto found = ids_by_uuid.find(uuid);
+            if (found == ids_by_uuid.end())
+                continue;
+            const auto id = found->second;
+            item_list_model->erase(rows[id]);
+            rows[id] = Gtk::TreeModel::iterator();
+            visible[id] = false;
+            search_index.erase(id);
+            ids_by_uuid.erase(found);
+        }
+
+        for (const auto& uuid : changes.changed) {
+            auto found = ids_by_uuid.find(uuid);
+            auto item = keychain.find(uuid);
+            if (found == ids_by_uuid.end() || item == keychain.end())
+                continue;
+            const Glib::ustring title = item->second.title;
+            (*rows[found->second])[columns.name] = title;
+            search_index.set(found->second, title.casefold().raw());
+        }
+
+        for (const auto& uuid : changes.added) {
+            auto item = keychain.find(uuid);
+            if (item == keychain.end() || ids_by_uuid.count(uuid))
+                continue;
+            // Hidden until searchChanged finds it matches, so the filter has an answer for it
+            // as soon as its id is set.
+            const uint32_t id = rows.size();
+            visible.push_back(false);
+            auto iter = item_list_model->append();
+            rows.push_back(iter);
+            auto new_row = *iter;
+            new_row[columns.id] = id;
+            new_row[columns.uuid] = uuid;
+            const Glib::ustring title = item->second.title;
+            new_row[columns.name] = title;
+            ids_by_uuid[uuid] = id;
+            search_index.set(id, title.casefold().raw());
+        }
+
+        // Removed rows are already gone from the model, so searchChanged mustn't look at them.
+        matches.erase(std::remove_if(matches.begin(),
+                                     matches.end(),
+                                     [this](uint32_t id) { return !rows[id]; }),
+                      matches.end());
+        searchChanged();
+    }
+
 protected:
     class SearchListColumns : public Gtk::TreeModel::ColumnRecord {
     public:
         SearchListColumns() {
             add(uuid);
             add(name);
+            add(id);
         }
 
         Gtk::TreeModelColumn<Glib::ustring> uuid;
         Gtk::TreeModelColumn<Glib::ustring> name;
+        // Where the row is in rows and the search index.
+        Gtk::TreeModelColumn<unsigned int> id;
     };
 
+    // Indexes the casefolded titles, so searching never has to fold them again. applyChanges
+    // keeps it up to date from then on.
+    void buildIndex() {
+        rows.clear();
+        ids_by_uuid.clear();
+        std::vector<std::string> titles;
+        for (auto iter = item_list_model->children().begin(); iter; ++iter) {
+            auto row = *iter;
+            row[columns.id] = rows.size();
+            Glib::ustring uuid = row[columns.uuid];
+            ids_by_uuid[uuid.raw()] = rows.size();
+            rows.push_back(iter);
+            Glib::ustring name = row[columns.name];
+            titles.push_back(name.casefold().raw());
+        }
+        search_index = SearchIndex(titles);
+        search_index.find(search_entry.get_text().casefold().raw(), matches);
+        visible.assign(rows.size(), false);
+        for (auto id : matches)
+            visible[id] = true;
+    }
+
+    // Both match lists are sorted, so walking them together finds the rows that appeared or
+    // disappeared; only those are passed to the filter to look at again.
+    void searchChanged() {
+        search_index.find(search_entry.get_text().casefold().raw(), next_matches);
+        auto old_match = matches.begin();
+        auto new_match = next_matches.begin();
+        while (old_match != matches.end() || new_match != next_matches.end()) {
+            uint32_t id;
+            if (new_match == next_matches.end() ||
+                (old_match != matches.end() && *old_match < *new_match)) {
+                id = *old_match++;
+            } else if (old_match == matches.end() || *new_match < *old_match) {
+                id = *new_match++;
+            } else {
+                ++old_match;
+                ++new_match;
+                continue;
+            }
+            visible[id] = !visible[id];
+            const auto& iter = rows[id];
+            item_list_model->row_changed(item_list_model->get_path(iter), iter);
+        }
+        matches.swap(next_matches);
+    }
+
     SearchListColumns columns;
 
     Gtk::ScrolledWindow viewport;
@@ -84,5 +191,15 @@ protected:
     Glib::RefPtr<Gtk::TreeSelection> item_list_selector;
     Glib::RefPtr<Gtk::ListStore> item_list_model;
     Glib::RefPtr<Gtk::TreeModelFilter> item_list_filter_model;
+
+    SearchIndex search_index;
+    // Indexed by the id column. A ListStore's iterators stay valid until their row is removed;
+    // a removed row's id keeps an empty iterator, and isn't used again.
+    std::vector<Gtk::TreeModel::iterator> rows;
+    std::unordered_map<std::string, uint32_t> ids_by_uuid;
+    std::vector<bool> visible;
+    // The ids of the rows matching the current search, in increasing order.
+    std::vector<uint32_t> matches;
+    std::vector<uint32_t> next_matches;
     std::function<void(const Glib::ustring&)> selectionChangedCb;
 };
@@ -0,0 +1,89 @@
+#include <cerrno>
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+
+#include "session_key_cache.h"
+
+namespace {
+const char kKeyType[] = "user";
+// KEY_POS_ALL from keyutils.h: every permission for possessors, none for anyone else.
+const uint32_t kPossessorOnly = 0x3f000000;
+
+std::string keyDescription(const std::string& id) {
+    return "gonepass:" + id;
+}
+
+long findKey(long keyring, const std::string& id) {
+    if (keyring < 0)
+        return -1;
+    const auto description = keyDescription(id);
+    return ::syscall(SYS_keyctl, KEYCTL_SEARCH, keyring, kKeyType, description.c_str(), 0);
+}
+}  // namespace
+
+// Keys are used from the unlock worker threads, and credentials are per thread, so a session
+// keyring the kernel created lazily on one of them wouldn't be seen by the others. Resolving
+// (and if need be creating) it here, up front, pins down the one keyring they all use.
+SessionKeyCache::SessionKeyCache(unsigned int _timeout_seconds)
+    : timeout_seconds(_timeout_seconds),
+      keyring(::syscall(SYS_keyctl, KEYCTL_GET_KEYRING_ID, KEY_SPEC_SESSION_KEYRING, 1)) {}
+
+bool SessionKeyCache::available() {
+    // Fails if the kernel was built without keyrings or a seccomp filter blocks keyctl.
+    long res = ::syscall(SYS_keyctl, KEYCTL_GET_KEYRING_ID, KEY_SPEC_SESSION_KEYRING, 0);
+    return res >= 0;
+}
+
+std::vector<uint8_t> SessionKeyCache::fetch(const std::string& id) const {
+    std::vector<uint8_t> key_data;
+    long key = findKey(keyring, id);
+    if (key < 0)
+        return key_data;
+
+    key_data.resize(64);
+    for (;;) {
+        long size = ::syscall(SYS_keyctl, KEYCTL_READ, key, key_data.data(), key_data.size());
+        if (size < 0) {
+            OPENSSL_cleanse(key_data.data(), key_data.size());
+            key_data.clear();
+            return key_data;
+        }
+        if (static_cast<size_t>(size) <= key_data.size()) {
+            key_data.resize(size);
+            return key_data;
+        }
+        // Too small; growing it mustn't leave a copy of what was read behind.
+        OPENSSL_cleanse(key_data.data(), key_data.size());
+        key_data.assign(size, 0);
+    }
+}
+
+void SessionKeyCache::store(const std::string& id, const std::vector<uint8_t>& key_data) const {
+    if (keyring < 0 || key_data.empty())
+        return;
+
+    const auto description = keyDescription(id);
+    // Adding a key with the same description replaces the old one in place.
+    long key = ::syscall(SYS_add_key,
+                         kKeyType,
+                         description.c_str(),
+                         key_data.data(),
+                         key_data.size(),
+                         keyring);
+    if (key < 0)
+        return;
+
+    // Only this user's processes that hold the session keyring may read the key.
+    ::syscall(SYS_keyctl, KEYCTL_SETPERM, key, kPossessorOnly);
+    if (::syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, key, timeout_seconds) != 0)
+        ::syscall(SYS_keyctl, KEYCTL_UNLINK, key, keyring);
+}
+
+void SessionKeyCache::forget(const std::string& id) const {
+    long key = findKey(keyring, id);
+    if (key >= 0)
+        ::syscall(SYS_keyctl, KEYCTL_UNLINK, key, keyring);
+}
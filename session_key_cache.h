@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Keeps decrypted master keys in the kernel's session keyring (keyctl @s), so relaunching
+// within the timeout can skip PBKDF2. The keys never touch the disk and expire on their own;
+// logging out throws the whole session keyring away.
+//
+// Nothing derived from the master password is stored with a key. Any check cheap enough to
+// skip PBKDF2 would also let whoever can read the key try passwords far faster than PBKDF2
+// allows. So while its key is cached, a vault unlocks without its password being checked, as
+// if it had never been locked; the key itself is still checked against the vault's validation
+// data. Caching is best effort: if the keyring can't be used, fetch finds nothing and store
+// does nothing.
+class SessionKeyCache {
+public:
+    explicit SessionKeyCache(unsigned int _timeout_seconds);
+
+    // False if the kernel doesn't have keyrings, or the process isn't allowed to use them.
+    static bool available();
+
+    // Returns an empty vector if there's no unexpired key for id.
+    std::vector<uint8_t> fetch(const std::string& id) const;
+    void store(const std::string& id, const std::vector<uint8_t>& key_data) const;
+    void forget(const std::string& id) const;
+
+private:
+    unsigned int timeout_seconds;
+    // The session keyring's serial, or negative if there isn't one.
+    long keyring;
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <gtkmm.h>
+
+// Stores a vault's encrypted item snapshot (see Keychain::saveSnapshot) in the user's cache
+// directory, next to ConfigCache's cache.json. Snapshots are keyed by a hash of the vault path.
+class SnapshotCache {
+public:
+    SnapshotCache(const std::string& vault_path) {
+        auto cache_dir_path =
+            Glib::build_filename(Glib::get_user_cache_dir(), Glib::get_prgname(), "snapshots");
+        auto cache_dir = Gio::File::create_for_path(cache_dir_path);
+        if (!cache_dir->query_exists()) {
+            cache_dir->make_directory_with_parents();
+        }
+
+        auto vault_hash = Glib::Checksum::compute_checksum(Glib::Checksum::CHECKSUM_SHA256,
+                                                           vault_path);
+        snapshot_file_path = Glib::build_filename(cache_dir_path, vault_hash + ".snapshot");
+    }
+
+    // Returns an empty string if there's no snapshot for this vault yet.
+    std::string load() {
+        auto snapshot_file = Gio::File::create_for_path(snapshot_file_path);
+        if (!snapshot_file->query_exists()) {
+            return std::string();
+        }
+
+        char* contents = nullptr;
+        gsize length = 0;
+        if (!snapshot_file->load_contents(contents, length)) {
+            return std::string();
+        }
+
+        std::string ret(contents, length);
+        g_free(contents);
+        return ret;
+    }
+
+    void save(const std::string& snapshot) {
+        auto snapshot_file = Gio::File::create_for_path(snapshot_file_path);
+        std::string empty;
+        snapshot_file->replace_contents(
+            snapshot.c_str(), snapshot.size(), empty, empty, false, Gio::FILE_CREATE_PRIVATE);
+    }
+
+private:
+    std::string snapshot_file_path;
+};
@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Keeps objects that are expensive to set up, like cipher contexts and their buffers, so the
+// thread that's done with one can hand it to the next job it runs instead of allocating a
+// fresh one. Each thread has its own free list, so nothing here takes a lock.
+//
+// T must be default constructible and have a wipe() method, which is called on the way back
+// into the pool so nothing sensitive sits there between uses.
+template <typename T>
+class ThreadLocalPool {
+public:
+    // Owns one pooled object and gives it back to the current thread's pool when it goes away.
+    class Lease {
+    public:
+        Lease() : object(new T) {}
+        explicit Lease(std::unique_ptr<T> _object) : object(std::move(_object)) {}
+        Lease(Lease&& other) = default;
+        Lease& operator=(Lease&& other) = default;
+        ~Lease() {
+            if (object)
+                release(std::move(object));
+        }
+
+        T& operator*() const {
+            return *object;
+        }
+        T* operator->() const {
+            return object.get();
+        }
+
+    private:
+        std::unique_ptr<T> object;
+    };
+
+    // Takes an object from this thread's pool, or makes a new one if it's empty.
+    static Lease acquire() {
+        auto& objects = freeList();
+        if (objects.empty())
+            return Lease();
+        Lease lease(std::move(objects.back()));
+        objects.pop_back();
+        return lease;
+    }
+
+private:
+    // Leases rarely nest more than a couple deep; anything past this is just freed.
+    static const size_t kMaxPooled = 8;
+
+    static void release(std::unique_ptr<T> object) {
+        object->wipe();
+        auto& objects = freeList();
+        if (objects.size() < kMaxPooled)
+            objects.push_back(std::move(object));
+    }
+
+    static std::vector<std::unique_ptr<T>>& freeList() {
+        thread_local std::vector<std::unique_ptr<T>> objects;
+        return objects;
+    }
+};
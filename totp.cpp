@@ -1,25 +1,108 @@
 #include <algorithm>
-#include <cmath>
-#include <iomanip>
-#include <iostream>
-#include <sstream>
-#include <regex>
+#include <cstring>
+#include <stdexcept>
 #include <string>
-#include <unordered_map>
-#include <vector>
 
-#include <openssl/crypto.h>
 #include <openssl/evp.h>
-#include <openssl/hmac.h>
+
+#include "crypto_registry.h"
+#include "totp.h"
 
 namespace {
-std::vector<uint8_t> base32Decode(const std::string& encoded) {
-    std::vector<uint8_t> ret;
+const char kScheme[] = "otpauth://";
+const size_t kSchemeSize = sizeof(kScheme) - 1;
+// "totp/" or "hotp/"
+const size_t kTypeSize = 5;
+
+const uint32_t kPowersOfTen[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+struct Param {
+    const char* begin = nullptr;
+    const char* end = nullptr;
+
+    bool found() const {
+        return begin != nullptr;
+    }
+    bool operator==(const char* str) const {
+        const auto size = std::strlen(str);
+        return static_cast<size_t>(end - begin) == size && std::memcmp(begin, str, size) == 0;
+    }
+    std::string str() const {
+        return std::string(begin, end);
+    }
+};
+
+// Calls fn(name, value) for each parameter in the query, in order. Returns false if the query
+// isn't a list of name=value pairs, each optionally followed by a '&'. Names run up to the next
+// '=' and values up to the next '&', and neither can be empty. This accepts exactly what the
+// regular expression fields used to be matched against did.
+template <typename Fn>
+bool forEachParam(const char* it, const char* end, Fn fn) {
+    if (it == end)
+        return false;
+    while (it != end) {
+        Param name, value;
+        name.begin = it;
+        name.end = std::find(it, end, '=');
+        if (name.end == name.begin || name.end == end)
+            return false;
+        value.begin = name.end + 1;
+        value.end = std::find(value.begin, end, '&');
+        if (value.end == value.begin)
+            return false;
+        fn(name, value);
+        if (value.end == end) {
+            it = end;
+        } else if (value.end + 1 != end && value.end[1] == '=') {
+            // A '&' after a value is normally just a separator, but it can also start the next
+            // name, which is the only way to read "a=b&=c".
+            it = value.end;
+        } else {
+            it = value.end + 1;
+        }
+    }
+    return true;
+}
+
+struct URIParts {
+    bool totp;
+    const char* query;
+    const char* end;
+};
 
+// Checks uri is otpauth://<totp|hotp>/<label>?<query> without looking inside the label.
+bool splitURI(const char* uri, size_t size, URIParts& parts) {
+    if (size < kSchemeSize + kTypeSize || std::memcmp(uri, kScheme, kSchemeSize) != 0)
+        return false;
+    const auto type = uri + kSchemeSize;
+    if (std::memcmp(type, "totp/", kTypeSize) == 0) {
+        parts.totp = true;
+    } else if (std::memcmp(type, "hotp/", kTypeSize) == 0) {
+        parts.totp = false;
+    } else {
+        return false;
+    }
+
+    const auto label = type + kTypeSize;
+    parts.end = uri + size;
+    const auto label_end = std::find(label, parts.end, '?');
+    if (label_end == label || label_end == parts.end)
+        return false;
+    parts.query = label_end + 1;
+    return forEachParam(parts.query, parts.end, [](const Param&, const Param&) {});
+}
+
+// Decodes into key, which has room for kMaxKeySize bytes, and returns the decoded size.
+// Characters outside the base32 alphabet aren't rejected; their raw values are shifted in like
+// any other.
+size_t base32Decode(const Param& encoded, uint8_t* key) {
+    size_t size = 0;
     unsigned int curByte = 0;
     int bits = 0;
 
-    for (auto ch : encoded) {
+    for (auto it = encoded.begin; it != encoded.end; ++it) {
+        auto ch = *it;
         if (ch >= 'A' && ch <= 'Z') {
             ch -= 'A';
         } else if (ch >= '2' && ch <= '7') {
@@ -31,145 +114,146 @@ std::vector<uint8_t> base32Decode(const std::string& encoded) {
         bits += 5;
 
         if (bits >= 8) {
-            ret.push_back((curByte >> (bits - 8)) & 255);
+            if (size == TOTPDescriptor::kMaxKeySize)
+                throw std::runtime_error("OTP key is too long");
+            key[size++] = (curByte >> (bits - 8)) & 255;
             bits -= 8;
         }
     }
 
-    return std::move(ret);
+    return size;
 }
 
-class HMACWrapper {
-private:
-    std::function<void(HMAC_CTX*)> hmacFreeFn = [](HMAC_CTX* ptr) {
-#if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
-        abort();
-#else
-        HMAC_CTX_free(ptr);
-#endif
-    };
-
-public:
-    HMACWrapper(const EVP_MD* digest, const std::vector<uint8_t>& key) {
-#if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
-        ctx = std::unique_ptr<HMAC_CTX>(new HMAC_CTX);
-        HMAC_CTX_init(ctx.get());
-#else
-        ctx = std::unique_ptr<HMAC_CTX, decltype(hmacFreeFn)>(HMAC_CTX_new(), hmacFreeFn);
-#endif
-        HMAC_Init_ex(ctx.get(), key.data(), key.size(), digest, nullptr);
-    }
-
-    void update(const std::vector<uint8_t>& s) {
-        HMAC_Update(ctx.get(),
-                    reinterpret_cast<const unsigned char*>(s.data()),
-                    static_cast<unsigned int>(s.size()));
-    }
-
-    std::vector<uint8_t> finalize() {
-        std::vector<uint8_t> finalHash(HMAC_size(ctx.get()));
-        unsigned int size;
-        HMAC_Final(ctx.get(), finalHash.data(), &size);
-        if (size != finalHash.size()) {
-            throw std::runtime_error("Overflow while finalizing HMAC");
-        }
-        return std::move(finalHash);
+// Keeps one context per algorithm for each thread, so showing the code for the same secret
+// again doesn't even redo the HMAC key schedule.
+HMACContext& hmacContext(TOTPDescriptor::Algorithm algorithm) {
+    thread_local HMACContext sha1(cryptoRegistry().sha1);
+    thread_local HMACContext sha256(cryptoRegistry().sha256);
+    thread_local HMACContext sha512(cryptoRegistry().sha512);
+    switch (algorithm) {
+        case TOTPDescriptor::SHA256:
+            return sha256;
+        case TOTPDescriptor::SHA512:
+            return sha512;
+        default:
+            return sha1;
     }
+}
 
-private:
-    std::unique_ptr<HMAC_CTX, decltype(hmacFreeFn)> ctx;
-};
-
-std::string calculateTOTPInternal(const EVP_MD* algo,
-                                  uint64_t counter,
-                                  int digits,
-                                  const std::vector<uint8_t>& key) {
-    std::vector<uint8_t> counterArr(8);
+// Writes the code for one counter value to out.
+void computeCode(const TOTPDescriptor& totp, HMACContext& hmac, uint64_t counter, char* out) {
+    uint8_t counterArr[8];
     for (int i = 7; i >= 0; i--) {
         counterArr[i] = counter & 0xff;
         counter >>= 8;
     }
 
-    HMACWrapper hmac(algo, key);
-    hmac.update(counterArr);
-    auto finalHmac = hmac.finalize();
+    uint8_t finalHmac[EVP_MAX_MD_SIZE];
+    hmac.compute(totp.key, totp.key_size, counterArr, sizeof(counterArr), finalHmac);
 
-    const auto offset = finalHmac[19] & 0xf;
+    // RFC 4226's dynamic truncation, which takes the offset from the last byte of the HMAC
+    // whatever its size.
+    const auto offset = finalHmac[hmac.size() - 1] & 0xf;
     uint32_t truncated = (finalHmac[offset] & 0x7f) << 24 | (finalHmac[offset + 1] & 0xff) << 16 |
         (finalHmac[offset + 2] & 0xff) << 8 | (finalHmac[offset + 3] & 0xff);
 
-    std::stringstream ss;
-    const int digitsPow = pow(10, digits);
-    ss << std::setw(digits) << std::setfill('0') << truncated % digitsPow;
-    return ss.str();
+    truncated %= kPowersOfTen[totp.digits];
+    for (int i = totp.digits - 1; i >= 0; i--) {
+        out[i] = '0' + truncated % 10;
+        truncated /= 10;
+    }
+    out[totp.digits] = '\0';
 }
 
-const auto kURIPattern = "otpauth://(totp|hotp)/(?:[^\\?]+)\\?((?:(?:[^=]+)=(?:[^\\&]+)\\&?)+)";
-const auto kURIRegex = std::regex(kURIPattern, std::regex::ECMAScript | std::regex::optimize);
-const auto kQueryComponentPattern = "([^=]+)=([^\\&]+)&?";
-const auto kQueryComponentRegex =
-    std::regex(kQueryComponentPattern, std::regex::ECMAScript | std::regex::optimize);
-
 }  // namespace
 
-bool isTOTPURI(const std::string& uri) {
-    std::smatch match;
-    return std::regex_match(uri, match, kURIRegex);
+void TOTPDescriptor::code(time_t now, char* out) const {
+    computeCode(*this, hmacContext(algorithm), counter(now), out);
 }
 
-std::string calculateTOTP(const std::string& uri) {
-    std::smatch match;
-    if (!std::regex_match(uri, match, kURIRegex)) {
-        throw std::runtime_error("Error parsing OTP URI");
+void calculateTOTPCodes(const TOTPDescriptor* descriptors,
+                        size_t count,
+                        time_t now,
+                        size_t following,
+                        char* out) {
+    HMACContext* contexts[] = {&hmacContext(TOTPDescriptor::SHA1),
+                               &hmacContext(TOTPDescriptor::SHA256),
+                               &hmacContext(TOTPDescriptor::SHA512)};
+    for (size_t index = 0; index < count; ++index) {
+        const auto& totp = descriptors[index];
+        auto& hmac = *contexts[totp.algorithm];
+        const auto counter = totp.counter(now);
+        // After the first of these the key is the same, so HMACContext skips setting it up.
+        for (size_t offset = 0; offset <= following; ++offset) {
+            computeCode(totp, hmac, counter + offset, out);
+            out += TOTPDescriptor::kCodeSize;
+        }
     }
+}
 
-    const auto type = match[1].str();
-    if (type != "totp") {
-        std::stringstream ss;
-        ss << "Unsupported OTP format: " << type;
-        throw std::runtime_error(ss.str());
-    }
+std::string TOTPDescriptor::code(time_t now) const {
+    char out[kCodeSize];
+    code(now, out);
+    return out;
+}
 
-    const auto query = match[2].str();
-    auto begin = std::sregex_iterator(query.begin(), query.end(), kQueryComponentRegex);
-    const auto end = std::sregex_iterator();
-    std::unordered_map<std::string, std::string> params;
-    for (auto it = begin; it != end; ++it) {
-        auto curParam = *it;
-        params.emplace(curParam[1], curParam[2]);
-    }
+bool isTOTPURI(const char* uri, size_t size) {
+    URIParts parts;
+    return splitURI(uri, size, parts);
+}
+
+TOTPDescriptor parseTOTPURI(const char* uri, size_t size) {
+    URIParts parts;
+    if (!splitURI(uri, size, parts))
+        throw std::runtime_error("Error parsing OTP URI");
+    if (!parts.totp)
+        throw std::runtime_error("Unsupported OTP format: hotp");
+
+    // The first of any repeated parameter wins.
+    Param secret, algorithm, period, digits;
+    forEachParam(parts.query, parts.end, [&](const Param& name, const Param& value) {
+        Param* param = nullptr;
+        if (name == "secret")
+            param = &secret;
+        else if (name == "algorithm")
+            param = &algorithm;
+        else if (name == "period")
+            param = &period;
+        else if (name == "digits")
+            param = &digits;
+        if (param && !param->found())
+            *param = value;
+    });
 
-    if (params.find("secret") == params.end()) {
+    if (!secret.found())
         throw std::runtime_error("OTP URI is missing a key");
-    }
 
-    const EVP_MD* algo = EVP_sha1();
-    if (params.find("algorithm") != params.end()) {
-        const auto& algoStr = params["algorithm"];
-        if (algoStr == "SHA256") {
-            algo = EVP_sha256();
-        } else if (algoStr == "SHA512") {
-            algo = EVP_sha512();
-        } else if (algoStr != "SHA1") {
-            std::stringstream ss;
-            ss << "Unsurpported algorithm in OTP URI: " << algoStr;
-            throw std::runtime_error(ss.str());
+    TOTPDescriptor descriptor = {};
+    descriptor.algorithm = TOTPDescriptor::SHA1;
+    if (algorithm.found()) {
+        if (algorithm == "SHA256") {
+            descriptor.algorithm = TOTPDescriptor::SHA256;
+        } else if (algorithm == "SHA512") {
+            descriptor.algorithm = TOTPDescriptor::SHA512;
+        } else if (!(algorithm == "SHA1")) {
+            throw std::runtime_error("Unsupported algorithm in OTP URI: " + algorithm.str());
         }
     }
 
-    auto now = std::time(nullptr);
-    int period = 30;
-    if (params.find("period") != params.end()) {
-        period = std::stoi(params["period"]);
-    }
+    const int period_value = period.found() ? std::stoi(period.str()) : 30;
+    if (period_value <= 0)
+        throw std::runtime_error("Unsupported period in OTP URI: " + period.str());
+    descriptor.period = period_value;
 
-    const auto key = base32Decode(params["secret"]);
-    uint64_t counter = now / period;
+    const int digits_value = digits.found() ? std::stoi(digits.str()) : 6;
+    if (digits_value < 1 || digits_value > TOTPDescriptor::kMaxDigits)
+        throw std::runtime_error("Unsupported number of digits in OTP URI: " + digits.str());
+    descriptor.digits = digits_value;
 
-    int digits = 6;
-    if (params.find("digits") != params.end()) {
-        digits = std::stoi(params["digits"]);
-    }
+    descriptor.key_size = base32Decode(secret, descriptor.key);
+    return descriptor;
+}
 
-    return calculateTOTPInternal(algo, counter, digits, key);
+std::string calculateTOTP(const std::string& uri) {
+    return parseTOTPURI(uri).code(std::time(nullptr));
 }
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+// An otpauth://totp URI with everything needed to compute its codes worked out up front, so
+// showing a code is an HMAC and nothing else. Plain data: it can be copied around freely and
+// placed in an ItemArena.
+struct TOTPDescriptor {
+    enum Algorithm : uint8_t { SHA1, SHA256, SHA512 };
+
+    // The decoded secret. Real ones are 10 to 64 bytes.
+    static const size_t kMaxKeySize = 128;
+    // Codes are taken from 31 bits of the HMAC, so more digits than this would only be padding.
+    static const int kMaxDigits = 9;
+    // Room for any code and its NUL.
+    static const size_t kCodeSize = kMaxDigits + 1;
+
+    uint8_t key[kMaxKeySize];
+    uint16_t key_size;
+    Algorithm algorithm;
+    uint8_t digits;
+    uint32_t period;
+
+    // Identifies the period containing now; the code only changes when this does.
+    uint64_t counter(time_t now) const {
+        return now / period;
+    }
+    // How many seconds the code for now has left.
+    uint32_t secondsRemaining(time_t now) const {
+        return period - now % period;
+    }
+
+    // Writes the code for the period containing now, zero padded and NUL terminated, to out,
+    // which needs room for digits + 1 characters. Doesn't allocate.
+    void code(time_t now, char* out) const;
+    std::string code(time_t now) const;
+};
+
+// Works out the code for now, and for each of the next `following` periods, for every one of
+// count descriptors. They're written to out in order, each in a slot of kCodeSize characters,
+// so out needs room for count * (following + 1) * kCodeSize. Each descriptor's key is only set
+// up once however many codes it gets, and nothing is allocated.
+void calculateTOTPCodes(const TOTPDescriptor* descriptors,
+                        size_t count,
+                        time_t now,
+                        size_t following,
+                        char* out);
+
+// Whether uri looks like an otpauth:// URI. Cheap enough to ask of every field value: anything
+// that doesn't start with the scheme is turned down without looking any further.
+bool isTOTPURI(const char* uri, size_t size);
+inline bool isTOTPURI(const std::string& uri) {
+    return isTOTPURI(uri.data(), uri.size());
+}
+
+// Throws if uri isn't an otpauth:// URI, or is one we can't compute codes for: an HOTP
+// counter, a missing secret, or an algorithm, digit count or period we don't support.
+TOTPDescriptor parseTOTPURI(const char* uri, size_t size);
+inline TOTPDescriptor parseTOTPURI(const std::string& uri) {
+    return parseTOTPURI(uri.data(), uri.size());
+}
+
+// The current code for uri. Parses it every time; keep a TOTPDescriptor to avoid that.
+std::string calculateTOTP(const std::string& uri);
@@ -0,0 +1,90 @@
+#pragma once
+#include <ctime>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include <gtkmm.h>
+
+// Drives every TOTP code on screen from a single timer. It ticks on the second, since that's
+// where both the countdowns and every code's period roll over, so all of them change together
+// on one wakeup. With nothing registered, or while paused because the window can't be seen,
+// there's no timer at all.
+class TOTPClock {
+public:
+    using TickCallback = std::function<void(time_t now)>;
+
+    // The main loop only needs one.
+    static TOTPClock& get() {
+        static TOTPClock clock;
+        return clock;
+    }
+
+    // The callback is called straight away, so the code is up to date as soon as it's shown,
+    // and then on every tick. Returns an id for remove().
+    unsigned int add(TickCallback callback) {
+        const auto id = ++last_id;
+        callbacks.emplace(id, std::move(callback)).first->second(now());
+        schedule();
+        return id;
+    }
+
+    void remove(unsigned int id) {
+        callbacks.erase(id);
+        if (callbacks.empty())
+            timer.disconnect();
+    }
+
+    // Codes are left as they are while paused, and brought up to date on resuming.
+    void setPaused(bool _paused) {
+        if (paused == _paused)
+            return;
+        paused = _paused;
+        if (paused)
+            timer.disconnect();
+        else
+            tick();
+    }
+
+private:
+    // Glib's timers can fire a touch early; aiming this far past the second makes sure the
+    // tick sees the new time.
+    static constexpr gint64 kSlackMs = 5;
+
+    static time_t now() {
+        return g_get_real_time() / G_USEC_PER_SEC;
+    }
+
+    void schedule() {
+        if (paused || callbacks.empty() || timer.connected())
+            return;
+        const auto until_next_second = G_USEC_PER_SEC - g_get_real_time() % G_USEC_PER_SEC;
+        timer = Glib::signal_timeout().connect(
+            [this]() {
+                // Returning false removes the source; forget it so schedule() can add the next.
+                timer = sigc::connection();
+                tick();
+                return false;
+            },
+            until_next_second / 1000 + kSlackMs);
+    }
+
+    void tick() {
+        const auto time = now();
+        // A callback may add or remove others, so go by a copy of the ids.
+        std::vector<unsigned int> ids;
+        for (const auto& callback : callbacks)
+            ids.push_back(callback.first);
+        for (auto id : ids) {
+            auto callback = callbacks.find(id);
+            if (callback != callbacks.end())
+                callback->second(time);
+        }
+        schedule();
+    }
+
+    std::map<unsigned int, TickCallback> callbacks;
+    unsigned int last_id = 0;
+    bool paused = false;
+    sigc::connection timer;
+};
@@ -0,0 +1,138 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <gtkmm.h>
+
+#include "keychain.h"
+#include "snapshot_cache.h"
+
+// Derives a vault's keys and loads its items on a worker thread so the main loop stays
+// responsive. Progress and the final result are marshalled back to the main thread through a
+// Glib::Dispatcher, so both callbacks always run on the main thread.
+class UnlockTask {
+public:
+    using ProgressCallback = std::function<void(size_t done, size_t total)>;
+    // keychain is null if the unlock failed or was cancelled; error is empty if it was cancelled.
+    using DoneCallback =
+        std::function<void(std::shared_ptr<Keychain> keychain, const std::string& error)>;
+
+    UnlockTask(std::string path,
+               std::string master_password,
+               Keychain::LoadMode _load_mode,
+               std::shared_ptr<const SessionKeyCache> _key_cache,
+               ProgressCallback _progress_callback,
+               DoneCallback _done_callback)
+        : load_mode(_load_mode),
+          key_cache(std::move(_key_cache)),
+          progress_callback(_progress_callback),
+          done_callback(_done_callback) {
+        dispatcher.connect([this]() { notified(); });
+        worker = std::thread([this, path, master_password]() { run(path, master_password); });
+    }
+
+    ~UnlockTask() {
+        cancel();
+        // Key derivation can't be interrupted, so this may wait for it to finish.
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // The done callback will still be called, with a null keychain, once the worker stops.
+    void cancel() {
+        cancelled = true;
+    }
+
+private:
+    void run(const std::string& path, const std::string& master_password) {
+        std::shared_ptr<Keychain> keychain;
+        std::string error;
+        try {
+            keychain = std::make_shared<Keychain>(path, master_password, load_mode, key_cache);
+            keychain->setProgressCallback([this](size_t done, size_t total) {
+                items_done = done;
+                items_total = total;
+                notify();
+                return !cancelled;
+            });
+
+            // A snapshot from the last session saves decrypting everything again. If it's
+            // missing or unusable the keychain just loads from the vault as usual. Read-only
+            // keychains never save one.
+            std::string snapshot;
+            try {
+                if (!keychain->readOnly())
+                    snapshot = SnapshotCache(path).load();
+            } catch (Glib::Error& e) {
+            }
+            if (snapshot.empty() || !keychain->loadSnapshot(snapshot))
+                keychain->reloadItems();
+            keychain->setProgressCallback(nullptr);
+        } catch (KeychainLoadCancelled&) {
+            keychain.reset();
+        } catch (std::exception& e) {
+            keychain.reset();
+            error = e.what();
+        }
+
+        if (cancelled)
+            keychain.reset();
+        {
+            std::lock_guard<std::mutex> guard(result_lock);
+            result = std::move(keychain);
+            result_error = std::move(error);
+        }
+        finished = true;
+        dispatcher.emit();
+    }
+
+    // Only one notification is kept in flight so a fast load can't flood the main loop.
+    void notify() {
+        if (!notify_pending.exchange(true))
+            dispatcher.emit();
+    }
+
+    void notified() {
+        notify_pending = false;
+        if (reported)
+            return;
+        if (!finished) {
+            progress_callback(items_done, items_total);
+            return;
+        }
+
+        if (worker.joinable())
+            worker.join();
+        std::shared_ptr<Keychain> keychain;
+        std::string error;
+        {
+            std::lock_guard<std::mutex> guard(result_lock);
+            keychain = std::move(result);
+            error = std::move(result_error);
+        }
+        // The done callback may well destroy this task, so it has to come last.
+        reported = true;
+        done_callback(keychain, error);
+    }
+
+    Keychain::LoadMode load_mode;
+    std::shared_ptr<const SessionKeyCache> key_cache;
+    ProgressCallback progress_callback;
+    DoneCallback done_callback;
+    Glib::Dispatcher dispatcher;
+    std::thread worker;
+
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> finished{false};
+    std::atomic<bool> notify_pending{false};
+    std::atomic<size_t> items_done{0};
+    std::atomic<size_t> items_total{0};
+
+    std::mutex result_lock;
+    std::shared_ptr<Keychain> result;
+    std::string result_error;
+    bool reported = false;
+};
@@ -0,0 +1,103 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <unordered_set>
+
+#include <gtkmm.h>
+
+// Watches a vault's data directory and reports which items were touched. GIO uses
+// inotify for this on Linux, so nothing runs while the vault is idle. Bursts of events, like a
+// Dropbox sync landing hundreds of files at once, are coalesced into a single callback once the
+// directory has been quiet for a moment.
+class VaultWatcher {
+public:
+    // The callback gets the uuids of the .1password files that changed. It's also called with
+    // an empty set if only contents.js changed, or for an OPVault, any of its band files, or for
+    // a 1PIF export, the .1pif file itself.
+    using ChangedCallback = std::function<void(const std::unordered_set<std::string>& uuids)>;
+
+    // data_path is the directory holding the item files, or the 1PIF export, see
+    // Keychain::dataPath.
+    VaultWatcher(const std::string& data_path, ChangedCallback _changed_callback)
+        : changed_callback(_changed_callback) {
+        auto data_dir = Gio::File::create_for_path(data_path);
+        monitor = data_dir->monitor_directory();
+        monitor->signal_changed().connect(
+            [this](const Glib::RefPtr<Gio::File>& file,
+                   const Glib::RefPtr<Gio::File>& other_file,
+                   Gio::FileMonitorEvent event) {
+                if (event == Gio::FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED)
+                    return;
+                bool relevant = noteFile(file);
+                relevant = noteFile(other_file) || relevant;
+                if (relevant)
+                    scheduleFlush();
+            });
+    }
+
+    ~VaultWatcher() {
+        debounce_timer.disconnect();
+        monitor->cancel();
+    }
+
+private:
+    static constexpr unsigned int kQuietPeriodMs = 250;
+    static constexpr gint64 kMaxDelayUs = 2 * G_USEC_PER_SEC;
+
+    static bool endsWith(const std::string& str, const std::string& suffix) {
+        return str.size() > suffix.size() &&
+               str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    bool noteFile(const Glib::RefPtr<Gio::File>& file) {
+        if (!file)
+            return false;
+        const std::string name = file->get_basename();
+        const std::string suffix = ".1password";
+        if (name == "contents.js")
+            return true;
+        if (name.compare(0, 5, "band_") == 0 && name.size() > 8 && endsWith(name, ".js"))
+            return true;
+        // Any export in the directory counts, not just the open one, but they're rarely kept
+        // side by side.
+        if (endsWith(name, ".1pif"))
+            return true;
+        if (endsWith(name, suffix)) {
+            pending_uuids.insert(name.substr(0, name.size() - suffix.size()));
+            return true;
+        }
+        return false;
+    }
+
+    void scheduleFlush() {
+        // Restart the quiet period on every event, but don't let a sync that never pauses
+        // put off the refresh forever.
+        const auto now = g_get_monotonic_time();
+        if (!debounce_timer.connected()) {
+            first_event_time = now;
+        } else if (now - first_event_time < kMaxDelayUs) {
+            debounce_timer.disconnect();
+        } else {
+            return;
+        }
+
+        debounce_timer = Glib::signal_timeout().connect(
+            [this]() {
+                flush();
+                return false;
+            },
+            kQuietPeriodMs);
+    }
+
+    void flush() {
+        std::unordered_set<std::string> uuids;
+        std::swap(uuids, pending_uuids);
+        changed_callback(uuids);
+    }
+
+    Glib::RefPtr<Gio::FileMonitor> monitor;
+    sigc::connection debounce_timer;
+    gint64 first_event_time = 0;
+    std::unordered_set<std::string> pending_uuids;
+    ChangedCallback changed_callback;
+};